@@ -0,0 +1,268 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Compact representations of the heat pump settings, plus constexpr tables that map each value to
+// the string the HeatPump library speaks, the name Home Assistant expects, and the numeric code we
+// export to Prometheus. Every conversion is a linear scan over a handful of entries.
+namespace heatpump {
+
+enum class Power : uint8_t {
+  off,
+  on,
+};
+
+enum class Mode : uint8_t {
+  heat,
+  dry,
+  cool,
+  fan,
+  automatic,
+  unknown,
+};
+
+enum class FanSpeed : uint8_t {
+  automatic,
+  quiet,
+  speed1,
+  speed2,
+  speed3,
+  speed4,
+  unknown,
+};
+
+// vertical vane, up/down
+enum class Vane : uint8_t {
+  automatic,
+  position1,
+  position2,
+  position3,
+  position4,
+  position5,
+  swing,
+  unknown,
+};
+
+// horizontal vane, left/right
+enum class WideVane : uint8_t {
+  farLeft,
+  left,
+  center,
+  right,
+  farRight,
+  split,
+  swing,
+  unknown,
+};
+
+// Home Assistant's CURRENT_HVAC_* values
+enum class Action : uint8_t {
+  off,
+  idle,
+  fan,
+  heating,
+  cooling,
+  drying,
+};
+
+template <typename Value>
+struct CodecEntry {
+  Value value;
+  const char *protocol;       // as used by the HeatPump library
+  const char *homeAssistant;  // as used by the Home Assistant MQTT climate entity
+  int8_t metric;              // as exported to Prometheus
+};
+
+template <typename Value>
+struct Codec;
+
+template <>
+struct Codec<Power> {
+  static constexpr Power unknown = Power::off;
+  static constexpr CodecEntry<Power> entries[] = {
+      {Power::off, "OFF", "off", 0},
+      {Power::on, "ON", "on", 1},
+  };
+};
+
+// Map the heat pump state to one of HA's HVAC_MODE_* values.
+// https://github.com/home-assistant/core/blob/master/homeassistant/components/climate/const.py#L3-L23
+template <>
+struct Codec<Mode> {
+  static constexpr Mode unknown = Mode::unknown;
+  static constexpr CodecEntry<Mode> entries[] = {
+      {Mode::heat, "HEAT", "heat", 3},
+      {Mode::dry, "DRY", "dry", 2},
+      {Mode::cool, "COOL", "cool", 1},
+      {Mode::fan, "FAN", "fan_only", 4},
+      {Mode::automatic, "AUTO", "heat_cool", -1},
+  };
+};
+
+template <>
+struct Codec<FanSpeed> {
+  static constexpr FanSpeed unknown = FanSpeed::unknown;
+  static constexpr CodecEntry<FanSpeed> entries[] = {
+      {FanSpeed::automatic, "AUTO", "AUTO", -1},
+      {FanSpeed::quiet, "QUIET", "QUIET", 0},
+      {FanSpeed::speed1, "1", "1", 1},
+      {FanSpeed::speed2, "2", "2", 2},
+      {FanSpeed::speed3, "3", "3", 3},
+      {FanSpeed::speed4, "4", "4", 4},
+  };
+};
+
+template <>
+struct Codec<Vane> {
+  static constexpr Vane unknown = Vane::unknown;
+  static constexpr CodecEntry<Vane> entries[] = {
+      {Vane::automatic, "AUTO", "AUTO", -1},
+      {Vane::position1, "1", "1", 1},
+      {Vane::position2, "2", "2", 2},
+      {Vane::position3, "3", "3", 3},
+      {Vane::position4, "4", "4", 4},
+      {Vane::position5, "5", "5", 5},
+      {Vane::swing, "SWING", "SWING", 0},
+  };
+};
+
+template <>
+struct Codec<WideVane> {
+  static constexpr WideVane unknown = WideVane::unknown;
+  static constexpr CodecEntry<WideVane> entries[] = {
+      {WideVane::farLeft, "<<", "<<", 1},
+      {WideVane::left, "<", "<", 2},
+      {WideVane::center, "|", "|", 3},
+      {WideVane::right, ">", ">", 4},
+      {WideVane::farRight, ">>", ">>", 5},
+      {WideVane::split, "<>", "<>", 6},
+      {WideVane::swing, "SWING", "SWING", 0},
+  };
+};
+
+// Map heat pump state to one of HA's CURRENT_HVAC_* values.
+// https://github.com/home-assistant/core/blob/master/homeassistant/components/climate/const.py#L80-L86
+template <>
+struct Codec<Action> {
+  static constexpr Action unknown = Action::idle;
+  static constexpr CodecEntry<Action> entries[] = {
+      {Action::off, "off", "off", 0},
+      {Action::idle, "idle", "idle", 1},
+      {Action::fan, "fan", "fan", 2},
+      {Action::heating, "heating", "heating", 3},
+      {Action::cooling, "cooling", "cooling", 4},
+      {Action::drying, "drying", "drying", 5},
+  };
+};
+
+// Value returned by toMetric() for anything not in a table
+constexpr int8_t unknownMetric = -2;
+
+constexpr char toLower(const char character) {
+  return character >= 'A' && character <= 'Z' ? static_cast<char>(character - 'A' + 'a')
+                                              : character;
+}
+
+constexpr bool equalsIgnoreCase(const char *lhs, const char *rhs) {
+  while (*lhs != '\0' && toLower(*lhs) == toLower(*rhs)) {
+    lhs++;
+    rhs++;
+  }
+  return toLower(*lhs) == toLower(*rhs);
+}
+
+template <typename Value>
+constexpr const CodecEntry<Value> *lookup(const Value value) {
+  for (const auto &entry : Codec<Value>::entries) {
+    if (entry.value == value) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Parsing is case-insensitive and tolerates null; unrecognized names map to Codec<Value>::unknown
+template <typename Value>
+constexpr Value fromProtocol(const char *name) {
+  if (name != nullptr) {
+    for (const auto &entry : Codec<Value>::entries) {
+      if (equalsIgnoreCase(entry.protocol, name)) {
+        return entry.value;
+      }
+    }
+  }
+  return Codec<Value>::unknown;
+}
+
+template <typename Value>
+constexpr Value fromHomeAssistant(const char *name) {
+  if (name != nullptr) {
+    for (const auto &entry : Codec<Value>::entries) {
+      if (equalsIgnoreCase(entry.homeAssistant, name)) {
+        return entry.value;
+      }
+    }
+  }
+  return Codec<Value>::unknown;
+}
+
+template <typename Value>
+constexpr const char *toProtocol(const Value value) {
+  const auto *entry = lookup(value);
+  return entry != nullptr ? entry->protocol : "";
+}
+
+template <typename Value>
+constexpr const char *toHomeAssistant(const Value value) {
+  const auto *entry = lookup(value);
+  return entry != nullptr ? entry->homeAssistant : "";
+}
+
+template <typename Value>
+constexpr int8_t toMetric(const Value value) {
+  const auto *entry = lookup(value);
+  return entry != nullptr ? entry->metric : unknownMetric;
+}
+
+// Home Assistant folds power into the mode: a unit that's switched off is in mode "off"
+constexpr const char *homeAssistantMode(const Power power, const Mode mode) {
+  return power == Power::off ? "off" : toHomeAssistant(mode);
+}
+
+constexpr Action homeAssistantAction(const Power power, const Mode mode, const bool operating) {
+  if (power == Power::off) {
+    return Action::off;
+  }
+  if (mode == Mode::fan) {
+    return Action::fan;
+  }
+  if (!operating) {
+    return Action::idle;
+  }
+  switch (mode) {
+    case Mode::cool:
+      return Action::cooling;
+    case Mode::heat:
+      return Action::heating;
+    case Mode::dry:
+      return Action::drying;
+    default:
+      return Action::idle;
+  }
+}
+
+}  // namespace heatpump
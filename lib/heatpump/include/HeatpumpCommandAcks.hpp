@@ -0,0 +1,175 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "moment.hpp"
+
+// Follows commands that came with a correlation id through the reconciler, so whoever sent one can
+// be told when it went out on the serial link and when the unit took it up, instead of sleeping
+// and reading the state back. A command covers one or more reconciler fields; it's confirmed once
+// the unit reports all of them, and fails if the reconciler gives up on any. A newer command for
+// the same fields supersedes it.
+//
+// Acknowledgements go to `emit(const Ack &)` as they happen. The id pointer is only valid for the
+// duration of the call.
+class HeatpumpCommandAcks {
+ public:
+  // Every command being followed has at least one field bit to itself, so there can't be more of
+  // them than there are bits
+  static constexpr size_t capacity = 8;
+  static constexpr size_t maxIdLength = 40;  // a UUID with room to spare
+
+  enum class Status : uint8_t {
+    accepted,     // done, and there's nothing for the unit to confirm
+    written,      // the settings packet went out on the serial link
+    confirmed,    // the unit reports the new settings
+    unconfirmed,  // the reconciler gave up waiting for the unit
+    superseded,   // a newer command replaced this one before it was confirmed
+    rejected,     // the command wasn't valid, so nothing was done
+  };
+
+  struct Ack {
+    const char *id;
+    Status status;
+    int64_t latencyMs;  // since the command arrived; -1 where it doesn't apply
+  };
+
+  static const char *statusName(const Status status) {
+    switch (status) {
+      case Status::accepted:
+        return "accepted";
+      case Status::written:
+        return "written";
+      case Status::confirmed:
+        return "confirmed";
+      case Status::unconfirmed:
+        return "unconfirmed";
+      case Status::superseded:
+        return "superseded";
+      case Status::rejected:
+        return "rejected";
+    }
+    return "unknown";
+  }
+
+  // Ids longer than maxIdLength are refused outright
+  static bool validId(const char *id) {
+    const size_t length = std::strlen(id);
+    return length > 0 && length <= maxIdLength;
+  }
+
+  // Start following a command that asked for `fields`. One that asked for none, such as a remote
+  // temperature on its own, is accepted straight away.
+  template <typename Emit>
+  void track(const char *id, const uint8_t fields, const Moment &now, Emit &&emit) {
+    for (size_t idx = 0; idx < count; idx++) {
+      Entry &entry = entries[idx];
+      entry.fields &= ~fields;
+      entry.queued &= ~fields;
+    }
+    sweep(Status::superseded, now, emit);
+    if (fields == 0) {
+      emit(Ack{id, Status::accepted, -1});
+      return;
+    }
+    if (count == capacity) {
+      return;
+    }
+    Entry &entry = entries[count++];
+    std::strncpy(entry.id.data(), id, maxIdLength);
+    entry.id[maxIdLength] = '\0';
+    entry.fields = fields;
+    entry.queued = 0;
+    entry.written = false;
+    entry.since = now;
+  }
+
+  // The reconciler handed out a write of `fields`, which will go out on the next settings packet
+  void queued(const uint8_t fields) {
+    for (size_t idx = 0; idx < count; idx++) {
+      entries[idx].queued |= entries[idx].fields & fields;
+    }
+  }
+
+  // A settings packet went out on the serial link
+  template <typename Emit>
+  void written(const Moment &now, Emit &&emit) {
+    for (size_t idx = 0; idx < count; idx++) {
+      Entry &entry = entries[idx];
+      if (entry.queued != 0 && !entry.written) {
+        entry.written = true;
+        emit(Ack{entry.id.data(), Status::written, now - entry.since});
+      }
+    }
+  }
+
+  // Feed this the reconciler's outcomes
+  template <typename Emit>
+  void settle(const uint8_t confirmed, const uint8_t abandoned, const Moment &now, Emit &&emit) {
+    for (size_t idx = 0; idx < count;) {
+      Entry &entry = entries[idx];
+      if ((entry.fields & abandoned) != 0) {
+        emit(Ack{entry.id.data(), Status::unconfirmed, -1});
+        remove(idx);
+        continue;
+      }
+      entry.fields &= ~confirmed;
+      entry.queued &= ~confirmed;
+      idx++;
+    }
+    sweep(Status::confirmed, now, emit);
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+ private:
+  struct Entry {
+    std::array<char, maxIdLength + 1> id;
+    uint8_t fields;  // still waiting for the unit to report these
+    uint8_t queued;  // ...of which these have been handed out in a write
+    bool written;
+    Moment since = Moment::never();
+  };
+
+  // Let go of every command with nothing left to wait for
+  template <typename Emit>
+  void sweep(const Status status, const Moment &now, Emit &emit) {
+    for (size_t idx = 0; idx < count;) {
+      if (entries[idx].fields == 0) {
+        emit(Ack{entries[idx].id.data(), status,
+                 status == Status::confirmed ? now - entries[idx].since : -1});
+        remove(idx);
+      } else {
+        idx++;
+      }
+    }
+  }
+
+  void remove(const size_t idx) {
+    for (size_t next = idx + 1; next < count; next++) {
+      entries[next - 1] = entries[next];
+    }
+    count--;
+  }
+
+  std::array<Entry, capacity> entries{};
+  size_t count = 0;
+};
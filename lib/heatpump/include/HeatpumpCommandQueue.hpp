@@ -0,0 +1,157 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "HeatpumpSettings.hpp"
+
+// Outbound commands for the heat pump, waiting for their turn on the serial link. Commands come
+// out highest priority first (custom packets, then settings writes, then remote temperature
+// updates) and in arrival order within a priority. There's only ever one settings write and one
+// remote temperature queued: a newer one replaces the older one in place. The queue is a fixed
+// size; when it's full, a new command evicts the newest lower priority one if there is one, and is
+// dropped otherwise.
+class HeatpumpCommandQueue {
+ public:
+  // Declared in dispatch order
+  enum class Kind : uint8_t {
+    customPacket,
+    settings,
+    remoteTemperature,
+  };
+
+  static constexpr size_t capacity = 8;
+  static constexpr size_t maxPacketLength = 20;
+
+  struct Command {
+    Kind kind = Kind::customPacket;
+    uint8_t length = 0;                             // customPacket
+    std::array<uint8_t, maxPacketLength> packet{};  // customPacket
+    float remoteTemperature = 0.0f;                 // remoteTemperature, Celsius; 0 = unit's own
+    HeatpumpSettings settings{heatpumpSettings{}};  // settings
+  };
+
+  struct Stats {
+    uint32_t queued;      // commands accepted
+    uint32_t replaced;    // settings or remote temperature updates merged into a queued one
+    uint32_t overflowed;  // commands dropped or evicted because the queue was full
+    uint32_t dispatched;  // commands taken off the queue
+    uint8_t highWater;    // deepest the queue has been
+  };
+
+  // Returns false if the packet is too long or there was no room for it
+  bool pushCustomPacket(const uint8_t *bytes, const size_t length) {
+    if (length > maxPacketLength) {
+      return false;
+    }
+    Command command;
+    command.kind = Kind::customPacket;
+    command.length = static_cast<uint8_t>(length);
+    std::memcpy(command.packet.data(), bytes, length);
+    return push(command);
+  }
+
+  bool pushSettings(const HeatpumpSettings &settings) {
+    Command command;
+    command.kind = Kind::settings;
+    command.settings = settings;
+    return replaceOrPush(command);
+  }
+
+  bool pushRemoteTemperature(const float celsius) {
+    Command command;
+    command.kind = Kind::remoteTemperature;
+    command.remoteTemperature = celsius;
+    return replaceOrPush(command);
+  }
+
+  // Takes the next command to send, if there is one
+  bool pop(Command &command) {
+    if (count == 0) {
+      return false;
+    }
+    size_t next = 0;
+    for (size_t idx = 1; idx < count; idx++) {
+      if (entries[idx].kind < entries[next].kind) {
+        next = idx;
+      }
+    }
+    command = entries[next];
+    remove(next);
+    stats.dispatched++;
+    return true;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+ private:
+  bool replaceOrPush(const Command &command) {
+    for (size_t idx = 0; idx < count; idx++) {
+      if (entries[idx].kind == command.kind) {
+        entries[idx] = command;
+        stats.replaced++;
+        return true;
+      }
+    }
+    return push(command);
+  }
+
+  bool push(const Command &command) {
+    if (count == capacity) {
+      // Make room by evicting the newest of the lowest priority commands, if that's lower than
+      // the incoming one
+      size_t victim = 0;
+      for (size_t idx = 1; idx < count; idx++) {
+        if (entries[idx].kind >= entries[victim].kind) {
+          victim = idx;
+        }
+      }
+      stats.overflowed++;
+      if (entries[victim].kind <= command.kind) {
+        return false;
+      }
+      remove(victim);
+    }
+    entries[count++] = command;
+    stats.queued++;
+    stats.highWater = std::max<uint8_t>(stats.highWater, static_cast<uint8_t>(count));
+    return true;
+  }
+
+  void remove(const size_t index) {
+    for (size_t idx = index; idx + 1 < count; idx++) {
+      entries[idx] = entries[idx + 1];
+    }
+    count--;
+  }
+
+  std::array<Command, capacity> entries;
+  size_t count = 0;
+  Stats stats{};
+};
@@ -0,0 +1,158 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "histogram.hpp"
+
+// Measurements of the CN105 serial link, fed every packet the HeatPump library sends or receives.
+// When the unit keeps dropping off the link, these tell line noise (checksum errors, malformed
+// packets), a slow unit (long request-to-response times) and a busy firmware (long gaps between
+// sync() calls, which is when replies get read) apart.
+//
+// Every CN105 packet is 0xfc, a type byte, three fixed bytes, a length, that many data bytes and
+// a checksum. Responses carry the request type with 0x20 set.
+class HeatpumpLinkStats {
+ public:
+  enum class Direction : uint8_t { sent, received };
+  static constexpr size_t directionCount = 2;
+
+  enum class PacketType : uint8_t { connect, set, info, other };
+  static constexpr size_t typeCount = 4;
+
+  // Reply time includes the ~90ms it takes to clock a request out at 2400 baud
+  using LatencyHistogram = Histogram<8>;
+  static constexpr std::array<uint32_t, 8> latencyBoundsMs = {100, 150, 200, 300,
+                                                              500, 750, 1000, 2000};
+  // A request still unanswered after this long counts as timed out
+  static constexpr uint32_t responseTimeoutMs = 2000;
+
+  using SyncHistogram = Histogram<8>;
+  static constexpr std::array<uint32_t, 8> syncBoundsMs = {10, 25, 50, 100, 250, 500, 1000, 5000};
+
+  struct Stats {
+    std::array<std::array<uint32_t, typeCount>, directionCount> packets;
+    uint32_t malformed;       // too short, or not starting with 0xfc
+    uint32_t checksumErrors;  // well-formed, but the checksum doesn't match
+    uint32_t timeouts;        // requests with no reply within responseTimeoutMs
+    uint32_t unsolicited;     // replies with no request outstanding
+
+    uint32_t packetsOf(const Direction direction, const PacketType type) const {
+      return packets[static_cast<size_t>(direction)][static_cast<size_t>(type)];
+    }
+  };
+
+  static PacketType classify(const uint8_t typeByte) {
+    switch (typeByte & ~responseBit) {
+      case 0x5a:
+        return PacketType::connect;
+      case 0x41:
+        return PacketType::set;
+      case 0x42:
+        return PacketType::info;
+      default:
+        return PacketType::other;
+    }
+  }
+
+  // A settings write, as opposed to the remote temperature and other writes that share its type
+  static bool isSettingsWrite(const uint8_t *packet, const size_t length) {
+    return length > headerBytes && packet[1] == 0x41 && packet[headerBytes] == 0x01;
+  }
+
+  static bool checksumValid(const uint8_t *packet, const size_t length) {
+    uint8_t sum = 0;
+    for (size_t idx = 0; idx + 1 < length; idx++) {
+      sum += packet[idx];
+    }
+    return static_cast<uint8_t>(0xfc - sum) == packet[length - 1];
+  }
+
+  void onPacket(const uint8_t *packet, const size_t length, const Direction direction,
+                const uint32_t nowMs) {
+    if (length < headerBytes + 1 || packet[0] != 0xfc) {
+      stats.malformed++;
+      return;
+    }
+    if (!checksumValid(packet, length)) {
+      stats.checksumErrors++;
+      return;
+    }
+    stats.packets[static_cast<size_t>(direction)][static_cast<size_t>(classify(packet[1]))]++;
+
+    if (direction == Direction::sent) {
+      if (awaitingReply) {
+        stats.timeouts++;
+      }
+      awaitingReply = true;
+      requestSentMs = nowMs;
+    } else if (awaitingReply) {
+      latency.observe(nowMs - requestSentMs);
+      awaitingReply = false;
+    } else {
+      stats.unsolicited++;
+    }
+  }
+
+  // Give up on a request that's waited too long, so a unit that's stopped answering shows up
+  // before the next request goes out
+  void expire(const uint32_t nowMs) {
+    if (awaitingReply && nowMs - requestSentMs > responseTimeoutMs) {
+      stats.timeouts++;
+      awaitingReply = false;
+    }
+  }
+
+  // Call just before each HeatPump::sync() while the unit is connected
+  void onSync(const uint32_t nowMs) {
+    if (haveSync) {
+      syncInterval.observe(nowMs - lastSyncMs);
+    }
+    lastSyncMs = nowMs;
+    haveSync = true;
+  }
+
+  // Reconnection attempts back off for minutes at a time, which says nothing about how promptly
+  // the loop gets round to reading replies, so the gap across a disconnection isn't counted
+  void onDisconnected() {
+    haveSync = false;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+  const LatencyHistogram &getLatency() const {
+    return latency;
+  }
+
+  const SyncHistogram &getSyncInterval() const {
+    return syncInterval;
+  }
+
+ private:
+  static constexpr uint8_t responseBit = 0x20;
+  static constexpr size_t headerBytes = 5;
+
+  Stats stats{};
+  LatencyHistogram latency{latencyBoundsMs};
+  SyncHistogram syncInterval{syncBoundsMs};
+  uint32_t requestSentMs = 0;
+  bool awaitingReply = false;
+  uint32_t lastSyncMs = 0;
+  bool haveSync = false;
+};
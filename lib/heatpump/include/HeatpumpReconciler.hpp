@@ -0,0 +1,276 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "HeatpumpSettings.hpp"
+#include "histogram.hpp"
+#include "moment.hpp"
+
+// Holds the settings that have been asked for (from the web UI or MQTT) separately from what the
+// unit last reported, and decides when a write to the unit is actually needed. Requests for values
+// the unit already has are dropped, everything requested since the last write is merged into one
+// settings packet, and a write that the unit hasn't reflected back within ackTimeoutMs is retried
+// a few times before being abandoned.
+//
+// It also times each request from the moment it's made to the report that shows the unit has
+// taken it up, which is the delay people standing in front of the unit actually notice.
+class HeatpumpReconciler {
+ public:
+  using Power = HeatpumpSettings::Power;
+  using Mode = HeatpumpSettings::Mode;
+  using FanSpeed = HeatpumpSettings::FanSpeed;
+  using Vane = HeatpumpSettings::Vane;
+  using WideVane = HeatpumpSettings::WideVane;
+
+  enum Field : uint8_t {
+    power = 1U << 0U,
+    mode = 1U << 1U,
+    temperature = 1U << 2U,
+    fan = 1U << 3U,
+    vane = 1U << 4U,
+    wideVane = 1U << 5U,
+  };
+  static constexpr size_t fieldCount = 6;
+
+  static constexpr int64_t ackTimeoutMs = 5000;
+  static constexpr uint8_t maxAttempts = 3;
+  // The unit works in half degrees, so anything finer would never be acknowledged
+  static constexpr int32_t temperatureStepCenti = 50;
+
+  struct Stats {
+    uint32_t writes;       // settings packets handed to the HeatPump library
+    uint32_t skipped;      // requested fields that the unit already had
+    uint32_t retries;      // writes repeated because the unit didn't acknowledge them
+    uint32_t abandoned;    // requests dropped after maxAttempts unacknowledged writes
+    uint32_t unconfirmed;  // requested fields dropped that way, never seen in a report
+  };
+
+  // Request-to-report time for each field written to the unit, in ms. Retries take ackTimeoutMs
+  // each, so those land from 5s up.
+  using LatencyHistogram = Histogram<10>;
+  static constexpr std::array<uint32_t, 10> latencyBoundsMs = {250,  500,  1000,  2000,  3000,
+                                                               5000, 7500, 10000, 15000, 30000};
+
+  HeatpumpReconciler() : desired(heatpumpSettings{}) {
+  }
+
+  // Each request is timed from `now`; requests made without one aren't timed
+  void setPower(const Power power, const Moment &now = Moment::never()) {
+    request(desired.power, power, Field::power, now);
+  }
+
+  void setMode(const Mode mode, const Moment &now = Moment::never()) {
+    if (mode != Mode::unknown) {
+      request(desired.mode, mode, Field::mode, now);
+    }
+  }
+
+  void setTemperature(const Temperature &temperature, const Moment &now = Moment::never()) {
+    request(desired.temperature,
+            Temperature::fromCentiCelsius(
+                Temperature::roundToStep(temperature.getCentiCelsius(), temperatureStepCenti)),
+            Field::temperature, now);
+  }
+
+  void setFan(const FanSpeed fan, const Moment &now = Moment::never()) {
+    if (fan != FanSpeed::unknown) {
+      request(desired.fan, fan, Field::fan, now);
+    }
+  }
+
+  void setVane(const Vane vane, const Moment &now = Moment::never()) {
+    if (vane != Vane::unknown) {
+      request(desired.vane, vane, Field::vane, now);
+    }
+  }
+
+  void setWideVane(const WideVane wideVane, const Moment &now = Moment::never()) {
+    if (wideVane != WideVane::unknown) {
+      request(desired.wideVane, wideVane, Field::wideVane, now);
+    }
+  }
+
+  // Forget requested fields that the unit now reports, timing the ones that were written to it.
+  // Called with every new report, and by nextWrite() before it decides anything.
+  void acknowledge(const HeatpumpSettings &reported, const Moment &now = Moment::never()) {
+    const uint8_t matched = requested & ~differing(reported);
+    if (matched == 0) {
+      return;
+    }
+    stats.skipped += countFields(matched & ~sent);
+    for (size_t idx = 0; idx < fieldCount; idx++) {
+      const bool timed = now != Moment::never() && requestedAt[idx] != Moment::never();
+      if (timed && (matched & sent & (1U << idx)) != 0) {
+        const int64_t elapsed = now - requestedAt[idx];
+        latency.observe(static_cast<uint32_t>(elapsed > 0 ? elapsed : 0));
+      }
+    }
+    outcomes.confirmed |= matched;
+    requested &= ~matched;
+    sent &= ~matched;
+    if (requested == 0) {
+      attempts = 0;
+    }
+  }
+
+  // True while there's anything left that the unit hasn't confirmed
+  bool isPending(const HeatpumpSettings &reported) const {
+    return (requested & differing(reported)) != 0;
+  }
+
+  // If a write should go out now, fills `write` with the reported settings plus every outstanding
+  // request and returns true.
+  bool nextWrite(const HeatpumpSettings &reported, const Moment &now, HeatpumpSettings &write) {
+    acknowledge(reported, now);
+    if (requested == 0) {
+      return false;
+    }
+
+    if (!changedSinceWrite) {
+      if (now - lastWrite < ackTimeoutMs) {
+        return false;
+      }
+      if (attempts >= maxAttempts) {
+        stats.abandoned++;
+        stats.unconfirmed += countFields(requested);
+        outcomes.abandoned |= requested;
+        requested = 0;
+        sent = 0;
+        attempts = 0;
+        return false;
+      }
+      stats.retries++;
+    }
+
+    write = merged(reported);
+    sent = requested;
+    changedSinceWrite = false;
+    lastWrite = now;
+    attempts++;
+    stats.writes++;
+    return true;
+  }
+
+  // The reported settings with every outstanding request applied, i.e. what the unit should
+  // report once it has caught up
+  HeatpumpSettings merged(const HeatpumpSettings &reported) const {
+    HeatpumpSettings result = reported;
+    if (has(Field::power)) {
+      result.power = desired.power;
+    }
+    if (has(Field::mode)) {
+      result.mode = desired.mode;
+    }
+    if (has(Field::temperature)) {
+      result.temperature = desired.temperature;
+    }
+    if (has(Field::fan)) {
+      result.fan = desired.fan;
+    }
+    if (has(Field::vane)) {
+      result.vane = desired.vane;
+    }
+    if (has(Field::wideVane)) {
+      result.wideVane = desired.wideVane;
+    }
+    return result;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+  const LatencyHistogram &getLatency() const {
+    return latency;
+  }
+
+  // Fields settled since the last call, as Field bits: the ones the unit now reports and the ones
+  // given up on. For telling whoever asked for them how it went.
+  struct Outcomes {
+    uint8_t confirmed;
+    uint8_t abandoned;
+  };
+
+  Outcomes takeOutcomes() {
+    const Outcomes result = outcomes;
+    outcomes = Outcomes{};
+    return result;
+  }
+
+  // Field bits in the most recent write
+  uint8_t lastWriteFields() const {
+    return sent;
+  }
+
+ private:
+  // Repeating a request that's already outstanding doesn't restart it, or its clock
+  template <typename Value>
+  void request(Value &slot, const Value &value, const Field field, const Moment &now) {
+    if (has(field) && slot == value) {
+      return;
+    }
+    slot = value;
+    requestedAt[fieldIndex(field)] = now;
+    requested |= field;
+    changedSinceWrite = true;
+    // A fresh request gets a fresh set of attempts
+    attempts = 0;
+  }
+
+  bool has(const Field field) const {
+    return (requested & field) != 0;
+  }
+
+  uint8_t differing(const HeatpumpSettings &reported) const {
+    uint8_t result = 0;
+    result |= desired.power != reported.power ? Field::power : 0;
+    result |= desired.mode != reported.mode ? Field::mode : 0;
+    result |= desired.temperature != reported.temperature ? Field::temperature : 0;
+    result |= desired.fan != reported.fan ? Field::fan : 0;
+    result |= desired.vane != reported.vane ? Field::vane : 0;
+    result |= desired.wideVane != reported.wideVane ? Field::wideVane : 0;
+    return result;
+  }
+
+  static size_t fieldIndex(const Field field) {
+    size_t idx = 0;
+    while ((field >> idx) != 1U) {
+      idx++;
+    }
+    return idx;
+  }
+
+  static uint32_t countFields(uint8_t fields) {
+    uint32_t count = 0;
+    for (; fields != 0; fields &= fields - 1) {
+      count++;
+    }
+    return count;
+  }
+
+  HeatpumpSettings desired;
+  Moment lastWrite = Moment::never();
+  Stats stats{};
+  LatencyHistogram latency{latencyBoundsMs};
+  std::array<Moment, fieldCount> requestedAt{Moment::never(), Moment::never(), Moment::never(),
+                                            Moment::never(), Moment::never(), Moment::never()};
+  Outcomes outcomes{};
+  uint8_t requested = 0;  // Field bits that have been asked for and not yet seen in a report
+  uint8_t sent = 0;       // Field bits included in the last write
+  uint8_t attempts = 0;
+  bool changedSinceWrite = false;
+};
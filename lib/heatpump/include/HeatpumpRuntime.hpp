@@ -0,0 +1,129 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "HeatpumpCodec.hpp"
+#include "moment.hpp"
+
+// Running totals of what the unit has been doing: time powered on in each mode, compressor run
+// time and starts, and an estimate of the energy used. Each update() charges the time since the
+// previous one to the state the unit was in, so the totals are exact to the resolution of the
+// updates and cost a few additions each, where deriving them from scraped gauges is both lossy
+// and expensive at query time. The totals only ever grow.
+class HeatpumpRuntime {
+ public:
+  // Estimated electrical draw: idleWatts while the unit is on with the compressor stopped, and
+  // compressorWatts plus wattsPerHz for every Hz of compressor frequency while it runs. Crude, but
+  // compressor speed is what dominates consumption.
+  struct EnergyModel {
+    uint16_t idleWatts = 10;
+    uint16_t compressorWatts = 100;
+    uint16_t wattsPerHz = 15;
+  };
+
+  struct Sample {
+    bool connected;
+    heatpump::Power power;
+    heatpump::Mode mode;
+    int compressorFrequency;  // Hz
+  };
+
+  static constexpr size_t modeCount = static_cast<size_t>(heatpump::Mode::unknown) + 1;
+
+  struct Totals {
+    uint64_t poweredMs;                      // switched on
+    std::array<uint64_t, modeCount> modeMs;  // switched on, by mode
+    uint64_t compressorMs;                   // compressor frequency above zero
+    uint32_t compressorStarts;               // compressor going from stopped to running
+    uint64_t energyWattMs;                   // estimated, see EnergyModel
+
+    uint64_t modeMsFor(const heatpump::Mode mode) const {
+      return modeMs[static_cast<size_t>(mode)];
+    }
+
+    double energyKWh() const {
+      return static_cast<double>(energyWattMs) / 3.6e9;
+    }
+  };
+
+  HeatpumpRuntime() = default;
+  explicit HeatpumpRuntime(const EnergyModel &model) : model(model) {
+  }
+
+  void setModel(const EnergyModel &newModel) {
+    model = newModel;
+  }
+
+  const EnergyModel &getModel() const {
+    return model;
+  }
+
+  // Charge the time since the last update to the state reported then, and carry on from `sample`.
+  // Time while disconnected isn't charged to anything.
+  void update(const Moment &now, const Sample &sample) {
+    if (haveLast) {
+      const int64_t elapsed = now - lastUpdate;
+      if (elapsed > 0) {
+        accumulate(static_cast<uint64_t>(elapsed));
+      }
+      if (sample.connected && last.connected && last.compressorFrequency <= 0 &&
+          sample.compressorFrequency > 0) {
+        totals.compressorStarts++;
+      }
+    }
+    last = sample;
+    lastUpdate = now;
+    haveLast = true;
+  }
+
+  const Totals &getTotals() const {
+    return totals;
+  }
+
+  // Carry on from totals saved before a restart
+  void restore(const Totals &saved) {
+    totals = saved;
+  }
+
+ private:
+  void accumulate(const uint64_t elapsedMs) {
+    if (!last.connected) {
+      return;
+    }
+    const bool running = last.compressorFrequency > 0;
+    if (running) {
+      totals.compressorMs += elapsedMs;
+    }
+    if (last.power != heatpump::Power::on) {
+      return;
+    }
+    totals.poweredMs += elapsedMs;
+    totals.modeMs[static_cast<size_t>(last.mode)] += elapsedMs;
+    const uint32_t watts =
+        running ? model.compressorWatts +
+                      static_cast<uint32_t>(model.wattsPerHz) * last.compressorFrequency
+                : model.idleWatts;
+    totals.energyWattMs += watts * elapsedMs;
+  }
+
+  EnergyModel model;
+  Totals totals{};
+  Sample last{};
+  Moment lastUpdate = Moment::never();
+  bool haveLast = false;
+};
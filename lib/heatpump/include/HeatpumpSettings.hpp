@@ -16,40 +16,62 @@
 #include <Arduino.h>
 #include <HeatPump.h>
 
+#include "HeatpumpCodec.hpp"
 #include "temperature.hpp"
 
+// A snapshot of the heat pump settings: a handful of bytes, no heap allocation. Strings from the
+// HeatPump library are decoded once on construction; use the codec in HeatpumpCodec.hpp to turn
+// the values back into protocol strings, Home Assistant names or metric codes.
 class HeatpumpSettings {
  public:
+  using Power = heatpump::Power;
+  using Mode = heatpump::Mode;
+  using FanSpeed = heatpump::FanSpeed;
+  using Vane = heatpump::Vane;
+  using WideVane = heatpump::WideVane;
+
   HeatpumpSettings() = delete;
 
   explicit HeatpumpSettings(const heatpumpSettings& settings)
-      : power(settings.power),
-        mode(settings.mode),
-        temperature(settings.temperature, Temperature::Unit::C),
-        fan(settings.fan),
-        vane(settings.vane),
-        wideVane(settings.wideVane),
+      : temperature(settings.temperature, Temperature::Unit::C),
+        power(heatpump::fromProtocol<Power>(settings.power)),
+        mode(heatpump::fromProtocol<Mode>(settings.mode)),
+        fan(heatpump::fromProtocol<FanSpeed>(settings.fan)),
+        vane(heatpump::fromProtocol<Vane>(settings.vane)),
+        wideVane(heatpump::fromProtocol<WideVane>(settings.wideVane)),
         iSee(settings.iSee),
         connected(settings.connected) {
   }
 
+  // The returned strings point into the codec tables, so they stay valid indefinitely
   heatpumpSettings getRaw() const {
-    return heatpumpSettings{.power = power.c_str(),
-                            .mode = mode.c_str(),
+    return heatpumpSettings{.power = heatpump::toProtocol(power),
+                            .mode = heatpump::toProtocol(mode),
                             .temperature = temperature.getCelsius(),
-                            .fan = fan.c_str(),
-                            .vane = vane.c_str(),
-                            .wideVane = wideVane.c_str(),
+                            .fan = heatpump::toProtocol(fan),
+                            .vane = heatpump::toProtocol(vane),
+                            .wideVane = heatpump::toProtocol(wideVane),
                             .iSee = iSee,
                             .connected = connected};
   }
 
-  String power;
-  String mode;
+  bool operator==(const HeatpumpSettings& other) const {
+    return temperature == other.temperature && power == other.power && mode == other.mode &&
+           fan == other.fan && vane == other.vane && wideVane == other.wideVane &&
+           iSee == other.iSee && connected == other.connected;
+  }
+
+  bool operator!=(const HeatpumpSettings& other) const {
+    return !(*this == other);
+  }
+
+  // ordered for packing
   Temperature temperature;
-  String fan;
-  String vane;      // vertical vane, up/down
-  String wideVane;  // horizontal vane, left/right
-  bool iSee;        // iSee sensor, at the moment can only detect it, not set it
+  Power power;
+  Mode mode;
+  FanSpeed fan;
+  Vane vane;          // vertical vane, up/down
+  WideVane wideVane;  // horizontal vane, left/right
+  bool iSee;          // iSee sensor, at the moment can only detect it, not set it
   bool connected;
 };
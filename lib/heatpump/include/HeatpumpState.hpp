@@ -0,0 +1,88 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+#include "HeatpumpSettings.hpp"
+#include "HeatpumpStatus.hpp"
+
+// The one copy of the heat pump's reported settings and status that every reader shares. The
+// version counter moves on only when something actually changed, so derived output (JSON, metrics,
+// rendered pages) can be cached against it with VersionedCache.
+class HeatpumpState {
+ public:
+  HeatpumpState() : settings(heatpumpSettings{}), status(heatpumpStatus{}) {
+  }
+
+  // Returns true (and bumps the version) if the new snapshot differs from the current one
+  bool update(const HeatpumpSettings &nextSettings, const HeatpumpStatus &nextStatus,
+              const bool nextConnected) {
+    if (nextSettings == settings && nextStatus == status && nextConnected == connected) {
+      return false;
+    }
+    settings = nextSettings;
+    status = nextStatus;
+    connected = nextConnected;
+    version++;
+    return true;
+  }
+
+  const HeatpumpSettings &getSettings() const {
+    return settings;
+  }
+
+  const HeatpumpStatus &getStatus() const {
+    return status;
+  }
+
+  bool isConnected() const {
+    return connected;
+  }
+
+  uint32_t getVersion() const {
+    return version;
+  }
+
+ private:
+  HeatpumpSettings settings;
+  HeatpumpStatus status;
+  bool connected = false;
+  uint32_t version = 0;
+};
+
+// Holds a value derived from some versioned source, and rebuilds it only when the version changes.
+template <typename Value>
+class VersionedCache {
+ public:
+  template <typename Builder>
+  const Value &get(const uint32_t version, Builder &&build) {
+    if (!valid || version != cachedVersion) {
+      value = build();
+      cachedVersion = version;
+      valid = true;
+    }
+    return value;
+  }
+
+  void invalidate() {
+    valid = false;
+  }
+
+ private:
+  Value value{};
+  uint32_t cachedVersion = 0;
+  bool valid = false;
+};
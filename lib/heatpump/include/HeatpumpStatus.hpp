@@ -29,6 +29,19 @@ class HeatpumpStatus {
         compressorFrequency(status.compressorFrequency) {
   }
 
+  bool operator==(const HeatpumpStatus& other) const {
+    return roomTemperature == other.roomTemperature && operating == other.operating &&
+           compressorFrequency == other.compressorFrequency &&
+           timers.onMinutesSet == other.timers.onMinutesSet &&
+           timers.onMinutesRemaining == other.timers.onMinutesRemaining &&
+           timers.offMinutesSet == other.timers.offMinutesSet &&
+           timers.offMinutesRemaining == other.timers.offMinutesRemaining;
+  }
+
+  bool operator!=(const HeatpumpStatus& other) const {
+    return !(*this == other);
+  }
+
   Temperature roomTemperature;
   bool operating;  // if true, the heatpump is operating to reach the desired temperature
   heatpumpTimers timers;
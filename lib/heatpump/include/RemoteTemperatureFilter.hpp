@@ -0,0 +1,126 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "moment.hpp"
+#include "temperature.hpp"
+
+// Decides which remote temperature readings are worth sending to the heat pump. Readings can be
+// smoothed with an exponentially weighted moving average; a (smoothed) reading is forwarded when
+// it differs from the last forwarded one by at least minDeltaCenti and minIntervalMs has passed
+// since the last forward. The last value is re-sent every refreshIntervalMs regardless, so the
+// unit doesn't give up on the remote sensor while the temperature is steady.
+class RemoteTemperatureFilter {
+ public:
+  struct Policy {
+    uint32_t minIntervalMs = 5000;
+    uint32_t refreshIntervalMs = 120000;
+    int32_t minDeltaCenti = 10;  // in hundredths of a degree Celsius
+    // Weight of each new reading in the moving average, in percent; 100 turns smoothing off
+    uint8_t newReadingPercent = 100;
+  };
+
+  struct Stats {
+    uint32_t received;   // readings offered
+    uint32_t forwarded;  // readings passed on to the unit, including refreshes
+    uint32_t refreshed;  // unchanged values re-sent to keep the unit listening
+  };
+
+  RemoteTemperatureFilter() = default;
+  explicit RemoteTemperatureFilter(const Policy &policy) : policy(policy) {
+  }
+
+  void setPolicy(const Policy &newPolicy) {
+    policy = newPolicy;
+  }
+
+  const Policy &getPolicy() const {
+    return policy;
+  }
+
+  // Take a new reading. Returns true if something should be sent to the unit now, and sets
+  // `forward` to it.
+  bool offer(const Temperature &reading, const Moment &now, Temperature &forward) {
+    stats.received++;
+    const int64_t scaled = static_cast<int64_t>(reading.getCentiCelsius()) * fractionScale;
+    if (!haveReading) {
+      smoothed = scaled;
+      haveReading = true;
+    } else {
+      // Rounded away from zero, so the average always moves and settles exactly on a steady
+      // reading instead of stalling short of it
+      const int64_t weighted = (scaled - smoothed) * policy.newReadingPercent;
+      smoothed += (weighted + (weighted > 0 ? 99 : weighted < 0 ? -99 : 0)) / 100;
+    }
+    return poll(now, forward);
+  }
+
+  // Check whether a held back change or a refresh is due, without a new reading
+  bool poll(const Moment &now, Temperature &forward) {
+    if (!haveReading) {
+      return false;
+    }
+    const int64_t sinceForward = now - lastForward;
+    const bool changed =
+        !haveForwarded || std::abs(smoothedCenti() - forwardedCenti) >= policy.minDeltaCenti;
+    if (changed && sinceForward >= policy.minIntervalMs) {
+      return send(now, forward);
+    }
+    if (sinceForward >= policy.refreshIntervalMs) {
+      stats.refreshed++;
+      return send(now, forward);
+    }
+    return false;
+  }
+
+  // Forget everything seen so far, e.g. when the remote sensor is switched off or goes stale
+  void reset() {
+    haveReading = false;
+    haveForwarded = false;
+    lastForward = Moment::never();
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+ private:
+  // The average is kept in hundredths of a centidegree, so small weights still move it
+  static constexpr int64_t fractionScale = 100;
+
+  int32_t smoothedCenti() const {
+    return static_cast<int32_t>((smoothed + (smoothed < 0 ? -fractionScale : fractionScale) / 2) /
+                                fractionScale);
+  }
+
+  bool send(const Moment &now, Temperature &forward) {
+    forwardedCenti = smoothedCenti();
+    haveForwarded = true;
+    lastForward = now;
+    stats.forwarded++;
+    forward = Temperature::fromCentiCelsius(forwardedCenti);
+    return true;
+  }
+
+  Policy policy;
+  Stats stats{};
+  Moment lastForward = Moment::never();
+  int64_t smoothed = 0;
+  int32_t forwardedCenti = 0;
+  bool haveReading = false;
+  bool haveForwarded = false;
+};
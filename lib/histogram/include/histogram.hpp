@@ -0,0 +1,85 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Counts of observations falling under each of a fixed set of upper bounds, plus their sum: the
+// shape Prometheus expects of a histogram, so it can work out percentiles across a fleet and over
+// any window. Observing is a short scan over the bounds, with no allocation, so it's cheap enough
+// to call from a serial callback.
+template <size_t Buckets>
+class Histogram {
+ public:
+  static constexpr size_t buckets = Buckets;
+
+  // `bounds` must be in ascending order; anything above the last lands in an overflow bucket
+  explicit Histogram(const std::array<uint32_t, Buckets> &bounds) : bounds(bounds) {
+  }
+
+  void observe(const uint32_t value) {
+    size_t idx = 0;
+    while (idx < Buckets && value > bounds[idx]) {
+      idx++;
+    }
+    counts[idx]++;
+    total++;
+    sum += value;
+    if (value > maximum) {
+      maximum = value;
+    }
+  }
+
+  uint32_t bound(const size_t idx) const {
+    return bounds[idx];
+  }
+
+  // Observations at or under bound(idx), counted the way Prometheus buckets are. Passing
+  // `buckets` gives the total, which is the +Inf bucket.
+  uint32_t cumulative(const size_t idx) const {
+    uint32_t result = 0;
+    for (size_t bucket = 0; bucket <= idx && bucket <= Buckets; bucket++) {
+      result += counts[bucket];
+    }
+    return result;
+  }
+
+  uint32_t count() const {
+    return total;
+  }
+
+  uint64_t getSum() const {
+    return sum;
+  }
+
+  uint32_t max() const {
+    return maximum;
+  }
+
+  void clear() {
+    counts.fill(0);
+    total = 0;
+    sum = 0;
+    maximum = 0;
+  }
+
+ private:
+  std::array<uint32_t, Buckets> bounds;
+  std::array<uint32_t, Buckets + 1> counts{};
+  uint32_t total = 0;
+  uint64_t sum = 0;
+  uint32_t maximum = 0;
+};
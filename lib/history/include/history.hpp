@@ -0,0 +1,239 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// One reading of the heat pump
+struct HistorySample {
+  int16_t roomCenti;    // room temperature, hundredths of a degree C
+  int16_t targetCenti;  // target temperature, hundredths of a degree C
+  uint8_t compressorFrequency;
+  bool operating;
+  bool valid;  // false for periods when the heat pump wasn't connected
+
+  bool operator==(const HistorySample &other) const {
+    return roomCenti == other.roomCenti && targetCenti == other.targetCenti &&
+           compressorFrequency == other.compressorFrequency && operating == other.operating &&
+           valid == other.valid;
+  }
+  bool operator!=(const HistorySample &other) const {
+    return !(*this == other);
+  }
+};
+
+// A fixed-size ring of periodic heat pump samples, delta compressed. Samples are stored in blocks;
+// each block starts from scratch (its first sample is encoded against an all-zero sample) so the
+// oldest block can be dropped without touching the others. Each sample is a header byte saying
+// which fields changed since the previous one, followed by a zigzag varint delta for each changed
+// field. A steady system costs one byte per sample.
+template <size_t BlockSize = 256, size_t BlockCount = 16>
+class HistoryRing {
+ public:
+  using Sample = HistorySample;
+
+  static constexpr size_t capacityBytes = BlockSize * BlockCount;
+
+  void append(const Sample &sample) {
+    if (blocks == 0 || newest().used + maxEncodedSize > BlockSize) {
+      startBlock();
+    }
+    Block &block = newest();
+    encode(block, sample);
+    block.count++;
+    previous = sample;
+    samples++;
+    appended++;
+  }
+
+  // Calls visit(const Sample &) for every stored sample, oldest first
+  template <typename Visitor>
+  void forEach(Visitor &&visit) const {
+    for (size_t idx = 0; idx < blocks; idx++) {
+      const Block &block = storage[(first + idx) % BlockCount];
+      Sample sample = zero();
+      size_t offset = 0;
+      for (uint16_t count = 0; count < block.count; count++) {
+        decode(block, offset, sample);
+        visit(sample);
+      }
+    }
+  }
+
+  // Calls visit(const Sample &) for the stored samples numbered `from` onwards (see total()),
+  // oldest first, until visit returns false. Returns the number of the next sample it would have
+  // visited, so a reader can work through the ring in pieces while samples are still arriving.
+  template <typename Visitor>
+  uint32_t forEachFrom(uint32_t from, Visitor &&visit) const {
+    uint32_t number = appended - static_cast<uint32_t>(samples);
+    if (static_cast<int32_t>(from - number) < 0) {
+      // Those samples were dropped with their block; carry on from the oldest one left
+      from = number;
+    }
+    for (size_t idx = 0; idx < blocks; idx++) {
+      const Block &block = storage[(first + idx) % BlockCount];
+      if (static_cast<int32_t>(from - (number + block.count)) >= 0) {
+        number += block.count;
+        continue;
+      }
+      Sample sample = zero();
+      size_t offset = 0;
+      for (uint16_t count = 0; count < block.count; count++, number++) {
+        decode(block, offset, sample);
+        if (number >= from && !visit(sample)) {
+          return number + 1;
+        }
+      }
+    }
+    return number;
+  }
+
+  size_t size() const {
+    return samples;
+  }
+
+  // Samples appended since construction, including those since dropped. The stored samples are
+  // numbered total() - size() through total() - 1.
+  uint32_t total() const {
+    return appended;
+  }
+
+  size_t bytesUsed() const {
+    size_t total = 0;
+    for (size_t idx = 0; idx < blocks; idx++) {
+      total += storage[(first + idx) % BlockCount].used;
+    }
+    return total;
+  }
+
+  void clear() {
+    first = 0;
+    blocks = 0;
+    samples = 0;
+  }
+
+ private:
+  enum Changed : uint8_t {
+    room = 1U << 0U,
+    target = 1U << 1U,
+    frequency = 1U << 2U,
+    // Not deltas: the current value of the flag
+    operatingFlag = 1U << 3U,
+    validFlag = 1U << 4U,
+  };
+
+  // Header byte, then at most three bytes per temperature and two for the frequency
+  static constexpr size_t maxEncodedSize = 1 + 3 + 3 + 2;
+  static_assert(BlockSize >= maxEncodedSize, "blocks must hold at least one sample");
+  static_assert(BlockSize <= UINT16_MAX, "block offsets are 16 bit");
+
+  struct Block {
+    std::array<uint8_t, BlockSize> data{};
+    uint16_t used = 0;
+    uint16_t count = 0;
+  };
+
+  static constexpr Sample zero() {
+    return Sample{0, 0, 0, false, false};
+  }
+
+  Block &newest() {
+    return storage[(first + blocks - 1) % BlockCount];
+  }
+
+  void startBlock() {
+    if (blocks == BlockCount) {
+      samples -= storage[first].count;
+      first = (first + 1) % BlockCount;
+      blocks--;
+    }
+    blocks++;
+    Block &block = newest();
+    block.used = 0;
+    block.count = 0;
+    previous = zero();
+  }
+
+  void encode(Block &block, const Sample &sample) {
+    uint8_t header = (sample.operating ? Changed::operatingFlag : 0) |
+                     (sample.valid ? Changed::validFlag : 0);
+    header |= sample.roomCenti != previous.roomCenti ? Changed::room : 0;
+    header |= sample.targetCenti != previous.targetCenti ? Changed::target : 0;
+    header |= sample.compressorFrequency != previous.compressorFrequency ? Changed::frequency : 0;
+    block.data[block.used++] = header;
+    if ((header & Changed::room) != 0) {
+      writeVarint(block, zigzag(sample.roomCenti - previous.roomCenti));
+    }
+    if ((header & Changed::target) != 0) {
+      writeVarint(block, zigzag(sample.targetCenti - previous.targetCenti));
+    }
+    if ((header & Changed::frequency) != 0) {
+      writeVarint(block, zigzag(sample.compressorFrequency - previous.compressorFrequency));
+    }
+  }
+
+  static void decode(const Block &block, size_t &offset, Sample &sample) {
+    const uint8_t header = block.data[offset++];
+    if ((header & Changed::room) != 0) {
+      sample.roomCenti =
+          static_cast<int16_t>(sample.roomCenti + unzigzag(readVarint(block, offset)));
+    }
+    if ((header & Changed::target) != 0) {
+      sample.targetCenti =
+          static_cast<int16_t>(sample.targetCenti + unzigzag(readVarint(block, offset)));
+    }
+    if ((header & Changed::frequency) != 0) {
+      sample.compressorFrequency =
+          static_cast<uint8_t>(sample.compressorFrequency + unzigzag(readVarint(block, offset)));
+    }
+    sample.operating = (header & Changed::operatingFlag) != 0;
+    sample.valid = (header & Changed::validFlag) != 0;
+  }
+
+  static uint32_t zigzag(const int32_t value) {
+    return (static_cast<uint32_t>(value) << 1U) ^ static_cast<uint32_t>(value >> 31);
+  }
+
+  static int32_t unzigzag(const uint32_t value) {
+    return static_cast<int32_t>(value >> 1U) ^ -static_cast<int32_t>(value & 1U);
+  }
+
+  static void writeVarint(Block &block, uint32_t value) {
+    while (value >= 0x80U) {
+      block.data[block.used++] = static_cast<uint8_t>(value | 0x80U);
+      value >>= 7U;
+    }
+    block.data[block.used++] = static_cast<uint8_t>(value);
+  }
+
+  static uint32_t readVarint(const Block &block, size_t &offset) {
+    uint32_t value = 0;
+    for (uint8_t shift = 0;; shift += 7) {
+      const uint8_t byte = block.data[offset++];
+      value |= static_cast<uint32_t>(byte & 0x7FU) << shift;
+      if ((byte & 0x80U) == 0) {
+        return value;
+      }
+    }
+  }
+
+  std::array<Block, BlockCount> storage;
+  Sample previous = zero();
+  size_t first = 0;
+  size_t blocks = 0;
+  size_t samples = 0;
+  uint32_t appended = 0;
+};
@@ -0,0 +1,201 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Counters that survive a restart. The journal is append-only: each checkpoint writes one
+// fixed-size record per counter that changed, holding the change since the last checkpoint, so
+// keeping the totals current costs a few bytes of flash rather than a rewrite. Once the journal
+// reaches maxBytes it's compacted into one absolute record per counter, which bounds both the
+// space it takes and the work of replaying it at boot. Spreading the writes over the flash is
+// left to the filesystem underneath.
+//
+// Each record is a tag byte (delta or absolute), the counter id, the value as 8 bytes
+// little-endian, and a CRC-8 of the preceding bytes. Replay stops at the first bad record, which
+// is what a write torn by a power cut leaves behind; the next checkpoint compacts it away.
+class CounterJournal {
+ public:
+  static constexpr size_t maxCounters = 16;
+  static constexpr size_t recordBytes = 11;
+  static constexpr size_t snapshotBytes = maxCounters * recordBytes;
+  static constexpr size_t defaultMaxBytes = 2048;
+
+  // Where the journal is kept. append() must land after everything already written; replace()
+  // swaps the whole journal for `data`, and should do so atomically where the medium allows it.
+  class Storage {
+   public:
+    virtual ~Storage() = default;
+    virtual size_t size() = 0;
+    virtual size_t read(size_t offset, uint8_t *data, size_t length) = 0;
+    virtual bool append(const uint8_t *data, size_t length) = 0;
+    virtual bool replace(const uint8_t *data, size_t length) = 0;
+  };
+
+  struct Stats {
+    uint32_t restored;     // records replayed at boot
+    uint32_t discarded;    // bytes of torn or corrupt records found at boot
+    uint32_t appended;     // delta records written
+    uint32_t compactions;  // times the journal was rewritten as a snapshot
+    uint32_t failed;       // writes the storage refused
+  };
+
+  explicit CounterJournal(Storage &storage, size_t maxBytes = defaultMaxBytes)
+      : storage(storage), maxBytes(maxBytes < 2 * snapshotBytes ? 2 * snapshotBytes : maxBytes) {
+  }
+
+  // Replay the journal into the counters, replacing their values. Returns the number of records
+  // replayed.
+  size_t restore() {
+    values.fill(0);
+    const size_t size = storage.size();
+    size_t offset = 0;
+    std::array<uint8_t, recordBytes> record{};
+    while (offset + recordBytes <= size &&
+           storage.read(offset, record.data(), recordBytes) == recordBytes) {
+      if (!apply(record)) {
+        break;
+      }
+      offset += recordBytes;
+      stats.restored++;
+    }
+    if (offset < size) {
+      stats.discarded += size - offset;
+      compactionDue = true;
+    }
+    journalBytes = offset;
+    saved = values;
+    return offset / recordBytes;
+  }
+
+  uint64_t get(const uint8_t id) const {
+    return id < maxCounters ? values[id] : 0;
+  }
+
+  void set(const uint8_t id, const uint64_t value) {
+    if (id < maxCounters) {
+      values[id] = value;
+    }
+  }
+
+  // Write whatever has changed since the last checkpoint. Returns false if the storage refused
+  // the write, in which case the changes are kept for the next attempt.
+  bool checkpoint() {
+    std::array<uint8_t, snapshotBytes> buffer{};
+    size_t length = 0;
+    for (uint8_t id = 0; id < maxCounters; id++) {
+      if (values[id] != saved[id]) {
+        // Unsigned arithmetic wraps, so a counter that went down replays correctly too
+        encode(deltaTag, id, values[id] - saved[id], &buffer[length]);
+        length += recordBytes;
+      }
+    }
+    if (length == 0 && !compactionDue) {
+      return true;
+    }
+    if (compactionDue || journalBytes + length > maxBytes) {
+      return compact();
+    }
+    if (!storage.append(buffer.data(), length)) {
+      stats.failed++;
+      // We don't know how much of that made it out, so don't append after it
+      compactionDue = true;
+      return false;
+    }
+    journalBytes += length;
+    stats.appended += length / recordBytes;
+    saved = values;
+    return true;
+  }
+
+  // Rewrite the journal as one absolute record per non-zero counter.
+  bool compact() {
+    std::array<uint8_t, snapshotBytes> buffer{};
+    size_t length = 0;
+    for (uint8_t id = 0; id < maxCounters; id++) {
+      if (values[id] != 0) {
+        encode(absoluteTag, id, values[id], &buffer[length]);
+        length += recordBytes;
+      }
+    }
+    if (!storage.replace(buffer.data(), length)) {
+      stats.failed++;
+      compactionDue = true;
+      return false;
+    }
+    journalBytes = length;
+    stats.compactions++;
+    compactionDue = false;
+    saved = values;
+    return true;
+  }
+
+  size_t size() const {
+    return journalBytes;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+ private:
+  static constexpr uint8_t deltaTag = 0xd7;
+  static constexpr uint8_t absoluteTag = 0xab;
+
+  static uint8_t crc8(const uint8_t *data, const size_t length) {
+    uint8_t crc = 0;
+    for (size_t idx = 0; idx < length; idx++) {
+      crc ^= data[idx];
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80) != 0 ? static_cast<uint8_t>((crc << 1) ^ 0x07)
+                                : static_cast<uint8_t>(crc << 1);
+      }
+    }
+    return crc;
+  }
+
+  static void encode(const uint8_t tag, const uint8_t id, const uint64_t value, uint8_t *record) {
+    record[0] = tag;
+    record[1] = id;
+    for (size_t idx = 0; idx < 8; idx++) {
+      record[2 + idx] = static_cast<uint8_t>(value >> (8 * idx));
+    }
+    record[recordBytes - 1] = crc8(record, recordBytes - 1);
+  }
+
+  bool apply(const std::array<uint8_t, recordBytes> &record) {
+    const uint8_t tag = record[0];
+    const uint8_t id = record[1];
+    if ((tag != deltaTag && tag != absoluteTag) || id >= maxCounters ||
+        crc8(record.data(), recordBytes - 1) != record[recordBytes - 1]) {
+      return false;
+    }
+    uint64_t value = 0;
+    for (size_t idx = 0; idx < 8; idx++) {
+      value |= static_cast<uint64_t>(record[2 + idx]) << (8 * idx);
+    }
+    values[id] = tag == absoluteTag ? value : values[id] + value;
+    return true;
+  }
+
+  Storage &storage;
+  const size_t maxBytes;
+  std::array<uint64_t, maxCounters> values{};
+  std::array<uint64_t, maxCounters> saved{};
+  size_t journalBytes = 0;
+  bool compactionDue = false;
+  Stats stats{};
+};
@@ -0,0 +1,168 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+// Pulls a single number out of a JSON document without building the document in memory: the
+// scanner walks the text once, skipping over everything that isn't on the way to the requested
+// field. Paths are dot separated object keys, e.g. "temperature" or "sensor.temperature". An empty
+// path matches a document that is just a number. Numbers given as strings ("21.5") are accepted,
+// since some sensor bridges publish them that way.
+namespace jsonscan {
+
+class Scanner {
+ public:
+  explicit Scanner(const char *json) : cursor(json) {
+  }
+
+  bool find(const char *path, float &value) {
+    skipWhitespace();
+    if (*path == '\0') {
+      return readNumber(value);
+    }
+    if (*cursor != '{') {
+      return false;
+    }
+    cursor++;
+
+    const char *segmentEnd = strchr(path, '.');
+    const size_t segmentLength = segmentEnd ? segmentEnd - path : strlen(path);
+    const char *rest = segmentEnd ? segmentEnd + 1 : path + segmentLength;
+
+    skipWhitespace();
+    if (*cursor == '}') {
+      return false;
+    }
+    while (true) {
+      skipWhitespace();
+      const char *key = nullptr;
+      size_t keyLength = 0;
+      if (!readString(key, keyLength)) {
+        return false;
+      }
+      skipWhitespace();
+      if (*cursor != ':') {
+        return false;
+      }
+      cursor++;
+      if (keyLength == segmentLength && strncmp(key, path, segmentLength) == 0) {
+        return find(rest, value);
+      }
+      if (!skipValue()) {
+        return false;
+      }
+      skipWhitespace();
+      if (*cursor != ',') {
+        return false;  // end of the object (or malformed): the key isn't there
+      }
+      cursor++;
+    }
+  }
+
+ private:
+  void skipWhitespace() {
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\n' || *cursor == '\r') {
+      cursor++;
+    }
+  }
+
+  // Leaves `start` pointing at the raw (still escaped) contents of the string
+  bool readString(const char *&start, size_t &length) {
+    if (*cursor != '"') {
+      return false;
+    }
+    start = ++cursor;
+    while (*cursor != '"') {
+      if (*cursor == '\0') {
+        return false;
+      }
+      if (*cursor == '\\' && cursor[1] != '\0') {
+        cursor++;
+      }
+      cursor++;
+    }
+    length = cursor - start;
+    cursor++;
+    return true;
+  }
+
+  bool readNumber(float &value) {
+    const bool quoted = *cursor == '"';
+    const char *start = quoted ? cursor + 1 : cursor;
+    char *end = nullptr;
+    const float parsed = strtof(start, &end);
+    if (end == start || (quoted && *end != '"') || !std::isfinite(parsed)) {
+      return false;
+    }
+    value = parsed;
+    cursor = quoted ? end + 1 : end;
+    return true;
+  }
+
+  // Skips any value, nested or not, without looking at what's in it
+  bool skipValue() {
+    skipWhitespace();
+    if (*cursor == '"') {
+      const char *ignored = nullptr;
+      size_t ignoredLength = 0;
+      return readString(ignored, ignoredLength);
+    }
+    if (*cursor == '{' || *cursor == '[') {
+      size_t depth = 0;
+      do {
+        if (*cursor == '"') {
+          const char *ignored = nullptr;
+          size_t ignoredLength = 0;
+          if (!readString(ignored, ignoredLength)) {
+            return false;
+          }
+          continue;
+        }
+        if (*cursor == '{' || *cursor == '[') {
+          depth++;
+        } else if (*cursor == '}' || *cursor == ']') {
+          depth--;
+        } else if (*cursor == '\0') {
+          return false;
+        }
+        cursor++;
+      } while (depth > 0);
+      return true;
+    }
+    // Numbers, true, false, null
+    const char *start = cursor;
+    while (*cursor != '\0' && *cursor != ',' && *cursor != '}' && *cursor != ']' &&
+           *cursor != ' ' && *cursor != '\t' && *cursor != '\n' && *cursor != '\r') {
+      cursor++;
+    }
+    return cursor != start;
+  }
+
+  const char *cursor;
+};
+
+// Find the number at `path` in the null-terminated `json`. Returns false, leaving `value` alone,
+// if the document doesn't have a number there.
+inline bool findNumber(const char *json, const char *path, float &value) {
+  if (json == nullptr || path == nullptr) {
+    return false;
+  }
+  return Scanner(json).find(path, value);
+}
+
+}  // namespace jsonscan
@@ -11,6 +11,8 @@
   02110-1301 USA
 */
 
+#pragma once
+
 #include <climits>
 #include <cstdint>
 #include <cstdio>
@@ -0,0 +1,223 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+// Outbound MQTT messages, waiting for the loop to hand them to the client. Publishing blocks until
+// the TCP write completes, so rather than publishing from wherever a message comes up, callers
+// queue it here and the loop drains the queue within a time budget.
+//
+// Messages go out highest priority first (state, then availability, command acknowledgements, log
+// lines, telemetry batches and finally packet dumps) and in arrival order within a priority. Only
+// the latest state or availability message for a topic matters, so a newer one replaces a queued
+// one in place. The queue is bounded by message count and by bytes; when a new message doesn't fit,
+// the newest lower priority messages are evicted to make room, and if that isn't enough the new
+// message is dropped. A slow broker therefore sheds packet dumps and logs long before it sheds
+// state.
+//
+// Anything refused while the connection is down is dropped: the loop queues fresh state and
+// availability as soon as it reconnects. Command acknowledgements can't be recreated that way, so
+// an ack the client refuses stays queued and goes out in the same burst.
+class MqttOutbox {
+ public:
+  // Declared in drain order
+  enum class Kind : uint8_t {
+    state,
+    availability,
+    ack,
+    log,
+    telemetry,
+    debugPacket,
+  };
+  static constexpr size_t kindCount = 6;
+
+  static constexpr size_t capacity = 16;
+  static constexpr size_t maxBytes = 4096;  // topics and payloads together
+  // Refusals before an ack is given up on, in case it's the ack rather than the connection
+  static constexpr uint8_t maxAckAttempts = 3;
+
+  struct Message {
+    Kind kind = Kind::log;
+    bool retained = false;
+    uint8_t refusals = 0;
+    std::string topic;
+    std::string payload;
+  };
+
+  struct Stats {
+    uint32_t queued;                          // messages accepted
+    uint32_t coalesced;                       // messages that replaced a queued one
+    std::array<uint32_t, kindCount> dropped;  // by kind, turned away or evicted for space
+    uint32_t published;                       // handed to the client
+    uint32_t failed;                          // refused by the client
+    uint8_t highWater;                        // deepest the queue has been
+  };
+
+  // Returns false if the message was dropped
+  bool push(const Kind kind, const char *topic, const char *payload, const bool retained = false) {
+    return push(kind, topic, payload, std::strlen(payload), retained);
+  }
+
+  // For binary payloads, which may contain nulls
+  bool push(const Kind kind, const char *topic, const void *payload, const size_t payloadLength,
+            const bool retained = false) {
+    return enqueue(kind, topic, static_cast<const char *>(payload), payloadLength, retained);
+  }
+
+  // Publishes queued messages until the queue is empty or outOfTime() returns true; at least one
+  // goes out per call, so a tight budget can't starve the queue. publish(const Message &) returns
+  // whether the client took the message. One it refused is dropped rather than retried: the
+  // client only refuses a message that's too big for it or when the connection is gone, and
+  // retrying helps with neither. The exception is an ack, which is only sent once: it stays at the
+  // head of the queue for the reconnect, and draining stops until then. Returns the number of
+  // messages taken off the queue.
+  template <typename Publish, typename OutOfTime>
+  size_t drain(Publish &&publish, OutOfTime &&outOfTime) {
+    size_t drained = 0;
+    while (count > 0) {
+      size_t next = 0;
+      for (size_t idx = 1; idx < count; idx++) {
+        if (entries[idx].kind < entries[next].kind) {
+          next = idx;
+        }
+      }
+      if (publish(static_cast<const Message &>(entries[next]))) {
+        stats.published++;
+      } else {
+        stats.failed++;
+        Message &refused = entries[next];
+        if (refused.kind == Kind::ack && ++refused.refusals < maxAckAttempts) {
+          break;
+        }
+      }
+      remove(next);
+      drained++;
+      if (outOfTime()) {
+        break;
+      }
+    }
+    return drained;
+  }
+
+  void clear() {
+    while (count > 0) {
+      remove(count - 1);
+    }
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  // Topic and payload bytes currently queued
+  size_t bytesQueued() const {
+    return bytes;
+  }
+
+  const Stats &getStats() const {
+    return stats;
+  }
+
+ private:
+  bool enqueue(const Kind kind, const char *topic, const char *payload, const size_t payloadLength,
+               const bool retained) {
+    const size_t length = std::strlen(topic) + payloadLength;
+    if (kind == Kind::state || kind == Kind::availability) {
+      for (size_t idx = 0; idx < count; idx++) {
+        Message &queued = entries[idx];
+        if (queued.kind == kind && queued.topic == topic) {
+          if (bytes - footprint(queued) + length > maxBytes) {
+            // A bigger replacement has to make room like any other message
+            remove(idx);
+            stats.coalesced++;
+            break;
+          }
+          bytes = bytes - footprint(queued) + length;
+          queued.payload.assign(payload, payloadLength);
+          queued.retained = retained;
+          stats.coalesced++;
+          return true;
+        }
+      }
+    }
+    if (!makeRoom(kind, length)) {
+      stats.dropped[static_cast<size_t>(kind)]++;
+      return false;
+    }
+    Message &message = entries[count++];
+    message.kind = kind;
+    message.retained = retained;
+    message.refusals = 0;
+    message.topic = topic;
+    message.payload.assign(payload, payloadLength);
+    bytes += length;
+    stats.queued++;
+    stats.highWater = std::max<uint8_t>(stats.highWater, static_cast<uint8_t>(count));
+    return true;
+  }
+
+  static size_t footprint(const Message &message) {
+    return message.topic.size() + message.payload.size();
+  }
+
+  // Evicts the newest of the lowest priority messages, as long as they're lower priority than
+  // `kind`, until there's a free slot and `length` bytes to spare
+  bool makeRoom(const Kind kind, const size_t length) {
+    if (length > maxBytes) {
+      return false;
+    }
+    while (count == capacity || bytes + length > maxBytes) {
+      size_t victim = 0;
+      for (size_t idx = 1; idx < count; idx++) {
+        if (entries[idx].kind >= entries[victim].kind) {
+          victim = idx;
+        }
+      }
+      if (entries[victim].kind <= kind) {
+        return false;
+      }
+      stats.dropped[static_cast<size_t>(entries[victim].kind)]++;
+      remove(victim);
+    }
+    return true;
+  }
+
+  void remove(const size_t index) {
+    bytes -= footprint(entries[index]);
+    for (size_t idx = index; idx + 1 < count; idx++) {
+      std::swap(entries[idx], entries[idx + 1]);
+    }
+    count--;
+    // Topics are short and the slot's buffer gets reused; payloads can be big, so let go of those
+    entries[count].topic.clear();
+    entries[count].payload.clear();
+    entries[count].payload.shrink_to_fit();
+  }
+
+  std::array<Message, capacity> entries;
+  size_t count = 0;
+  size_t bytes = 0;
+  Stats stats{};
+};
@@ -0,0 +1,162 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Writes MessagePack (https://msgpack.org) straight into a caller-supplied buffer, for payloads
+// where a JsonDocument and its long keys would be overkill. Only the types we publish are covered:
+// maps, arrays, strings, integers, floats, booleans and nil. Each value takes the smallest
+// encoding that holds it. Nothing is ever written past the end of the buffer; if a value doesn't
+// fit, the writer stops and ok() turns false.
+class MsgpackWriter {
+ public:
+  MsgpackWriter(uint8_t *buffer, const size_t capacity) : buffer(buffer), capacity(capacity) {
+  }
+
+  // Starts a map of `count` pairs: follow it with key, value, key, value...
+  void map(const size_t count) {
+    if (count < 16) {
+      byte(0x80 | count);
+    } else {
+      byte(0xde);
+      bigEndian(count, 2);
+    }
+  }
+
+  // Starts an array of `count` values
+  void array(const size_t count) {
+    if (count < 16) {
+      byte(0x90 | count);
+    } else {
+      byte(0xdc);
+      bigEndian(count, 2);
+    }
+  }
+
+  void str(const char *text) {
+    str(text, std::strlen(text));
+  }
+
+  void str(const char *text, const size_t length) {
+    if (length < 32) {
+      byte(0xa0 | length);
+    } else if (length <= UINT8_MAX) {
+      byte(0xd9);
+      bigEndian(length, 1);
+    } else if (length <= UINT16_MAX) {
+      byte(0xda);
+      bigEndian(length, 2);
+    } else {
+      byte(0xdb);
+      bigEndian(length, 4);
+    }
+    bytes(reinterpret_cast<const uint8_t *>(text), length);
+  }
+
+  void integer(const int64_t value) {
+    if (value >= 0) {
+      unsignedInteger(static_cast<uint64_t>(value));
+    } else if (value >= -32) {
+      byte(static_cast<uint8_t>(value));
+    } else if (value >= INT8_MIN) {
+      byte(0xd0);
+      bigEndian(static_cast<uint64_t>(value), 1);
+    } else if (value >= INT16_MIN) {
+      byte(0xd1);
+      bigEndian(static_cast<uint64_t>(value), 2);
+    } else if (value >= INT32_MIN) {
+      byte(0xd2);
+      bigEndian(static_cast<uint64_t>(value), 4);
+    } else {
+      byte(0xd3);
+      bigEndian(static_cast<uint64_t>(value), 8);
+    }
+  }
+
+  void unsignedInteger(const uint64_t value) {
+    if (value < 128) {
+      byte(static_cast<uint8_t>(value));
+    } else if (value <= UINT8_MAX) {
+      byte(0xcc);
+      bigEndian(value, 1);
+    } else if (value <= UINT16_MAX) {
+      byte(0xcd);
+      bigEndian(value, 2);
+    } else if (value <= UINT32_MAX) {
+      byte(0xce);
+      bigEndian(value, 4);
+    } else {
+      byte(0xcf);
+      bigEndian(value, 8);
+    }
+  }
+
+  // Always float32: the sensors we report don't have the precision to need more
+  void number(const float value) {
+    uint32_t bits;
+    static_assert(sizeof(bits) == sizeof(value), "float must be 32 bits");
+    std::memcpy(&bits, &value, sizeof(bits));
+    byte(0xca);
+    bigEndian(bits, 4);
+  }
+
+  void boolean(const bool value) {
+    byte(value ? 0xc3 : 0xc2);
+  }
+
+  void nil() {
+    byte(0xc0);
+  }
+
+  // Bytes written so far
+  size_t size() const {
+    return length;
+  }
+
+  // False once anything has been cut off
+  bool ok() const {
+    return !overflowed;
+  }
+
+ private:
+  void byte(const size_t value) {
+    const auto narrowed = static_cast<uint8_t>(value);
+    bytes(&narrowed, 1);
+  }
+
+  void bigEndian(const uint64_t value, const size_t width) {
+    uint8_t encoded[8];
+    for (size_t idx = 0; idx < width; idx++) {
+      encoded[idx] = static_cast<uint8_t>(value >> (8 * (width - 1 - idx)));
+    }
+    bytes(encoded, width);
+  }
+
+  void bytes(const uint8_t *data, const size_t count) {
+    if (overflowed || count > capacity - length) {
+      overflowed = true;
+      return;
+    }
+    std::memcpy(buffer + length, data, count);
+    length += count;
+  }
+
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length = 0;
+  bool overflowed = false;
+};
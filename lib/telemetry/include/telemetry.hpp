@@ -0,0 +1,92 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "msgpack.hpp"
+
+// Heat pump status samples, taken as the unit reports them and sent several to a message. Each
+// sample is a few bytes of MessagePack, so a batch of them costs less to publish than a single
+// JSON state message:
+//
+//   {"t": device millis of the first sample,
+//    "s": [[ms since the first sample, room temperature in hundredths of °C,
+//           compressor frequency in Hz, operating], ...]}
+template <size_t Capacity = 16>
+class TelemetryBatch {
+ public:
+  static constexpr size_t capacity = Capacity;
+
+  struct Sample {
+    uint32_t millis;  // device clock when the sample was taken
+    int16_t roomCenti;
+    uint8_t compressorFrequency;
+    bool operating;
+  };
+
+  // Enough room for encode() with a full batch
+  static constexpr size_t maxEncodedBytes = 15 + Capacity * 12;
+
+  // Returns false, and keeps what it has, if the batch is already full
+  bool add(const Sample &sample) {
+    if (count == Capacity) {
+      return false;
+    }
+    samples[count++] = sample;
+    return true;
+  }
+
+  // Whether the batch should go out now: it's full, or its oldest sample is `maxAgeMs` old
+  bool due(const uint32_t now, const uint32_t maxAgeMs) const {
+    return count == Capacity || (count > 0 && now - samples[0].millis >= maxAgeMs);
+  }
+
+  // Returns the encoded length, or 0 if it didn't fit in `length` bytes
+  size_t encode(uint8_t *buffer, const size_t length) const {
+    MsgpackWriter writer(buffer, length);
+    writer.map(2);
+    writer.str("t", 1);
+    writer.unsignedInteger(count > 0 ? samples[0].millis : 0);
+    writer.str("s", 1);
+    writer.array(count);
+    for (size_t idx = 0; idx < count; idx++) {
+      const Sample &sample = samples[idx];
+      writer.array(4);
+      writer.unsignedInteger(sample.millis - samples[0].millis);
+      writer.integer(sample.roomCenti);
+      writer.unsignedInteger(sample.compressorFrequency);
+      writer.boolean(sample.operating);
+    }
+    return writer.ok() ? writer.size() : 0;
+  }
+
+  void clear() {
+    count = 0;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+ private:
+  std::array<Sample, Capacity> samples{};
+  size_t count = 0;
+};
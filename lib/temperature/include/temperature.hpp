@@ -15,13 +15,20 @@
 
 #include <Arduino.h>
 
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
 
 class Temperature {
  private:
-  // Temperature always stored internally as Celsius
-  float celsius;
+  // Temperature always stored internally as hundredths of a degree Celsius. The ESP8266 has no
+  // FPU, so an integer representation keeps conversion, rounding and formatting cheap.
+  int16_t centiCelsius;
+
+  struct Centi {};
+  constexpr Temperature(Centi /*tag*/, int32_t value) : centiCelsius(saturate(value)) {
+  }
 
  public:
   enum class Unit {
@@ -29,25 +36,36 @@ class Temperature {
     F
   };
 
+  // Longest string produced by toChars, including the terminating NUL: "-557.82"
+  static constexpr size_t maxChars = 8;
+
   // Constructor
   explicit Temperature(float value, Unit unit)
-      : celsius(unit == Unit::C ? value : fahrenheitToCelsius(value)) {
+      : centiCelsius(saturate(unit == Unit::C ? toCenti(value)
+                                              : centiFahrenheitToCentiCelsius(toCenti(value)))) {
   }
 
-  Temperature(const Temperature &other) : celsius(other.celsius) {
+  constexpr Temperature(const Temperature &other) = default;
+  constexpr Temperature &operator=(const Temperature &other) = default;
+
+  static constexpr Temperature fromCentiCelsius(int32_t value) {
+    return Temperature(Centi{}, value);
   }
 
-  Temperature &operator=(const Temperature &other) {
-    this->celsius = other.celsius;
-    return *this;
+  constexpr int16_t getCentiCelsius() const {
+    return centiCelsius;
+  }
+
+  // Hundredths of a degree in the requested unit, rounded to the nearest multiple of `stepCenti`
+  // (also in hundredths). A step of zero or less disables rounding.
+  constexpr int32_t getCenti(const Unit unit, const int32_t stepCenti = 0) const {
+    const int32_t value =
+        unit == Unit::C ? centiCelsius : centiCelsiusToCentiFahrenheit(centiCelsius);
+    return roundToStep(value, stepCenti);
   }
 
   float get(const Unit unit, const float tempStep = 0.0f) const {
-    const auto value = unit == Unit::C ? this->celsius : celsiusToFahrenheit(this->celsius);
-    if (tempStep > 0.0f) {
-      return std::round(value / tempStep) * tempStep;
-    }
-    return value;
+    return static_cast<float>(getCenti(unit, stepToCenti(tempStep))) / 100.0f;
   }
 
   // Convenience methods
@@ -59,31 +77,82 @@ class Temperature {
     return get(Unit::F, tempStep);
   }
 
+  // Writes the temperature, rounded to `tempStep`, into `buffer` as a NUL-terminated string and
+  // returns its length. The number of decimals follows the step: none for whole degrees, one for
+  // tenths and halves, two otherwise. Returns 0 (and writes nothing) if the buffer is too small.
+  size_t toChars(char *buffer, const size_t size, const Unit unit,
+                 const float tempStep = 1.0f) const {
+    const int32_t stepCenti = stepToCenti(tempStep);
+    const int32_t value = getCenti(unit, stepCenti);
+    const int decimals = stepCenti > 0 && stepCenti % 100 == 0  ? 0
+                         : stepCenti > 0 && stepCenti % 10 == 0 ? 1
+                                                                : 2;
+
+    // Build the digits right to left in a scratch buffer, then copy out
+    std::array<char, maxChars> scratch{};
+    size_t pos = scratch.size();
+    uint32_t magnitude = value < 0 ? static_cast<uint32_t>(-value) : static_cast<uint32_t>(value);
+    if (decimals == 0) {
+      magnitude /= 100;
+    } else if (decimals == 1) {
+      magnitude /= 10;
+    }
+    for (int digit = 0; digit < decimals; digit++) {
+      scratch[--pos] = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    }
+    if (decimals > 0) {
+      scratch[--pos] = '.';
+    }
+    do {
+      scratch[--pos] = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+      scratch[--pos] = '-';
+    }
+
+    const size_t length = scratch.size() - pos;
+    if (length + 1 > size) {
+      return 0;
+    }
+    for (size_t idx = 0; idx < length; idx++) {
+      buffer[idx] = scratch[pos + idx];
+    }
+    buffer[length] = '\0';
+    return length;
+  }
+
   String toString(const Unit unit, const float tempStep = 1.0f) const {
-    // Would like to use std::to_chars here, but it's not available in the Arduino environment
-    std::array<char, 10> str;
-    const auto value = get(unit, tempStep);
-    const auto digits =
-        tempStep > 0.f ? static_cast<int>(std::ceil(std::log10(1.0f / tempStep))) : 6;
-    snprintf(str.data(), str.size(), "%.*f", std::max(0, digits), value);
+    std::array<char, maxChars> str;
+    toChars(str.data(), str.size(), unit, tempStep);
     return String(str.data());
   }
 
   void set(float value, const Unit unit) {
-    this->celsius = unit == Unit::C ? value : fahrenheitToCelsius(value);
+    *this = Temperature(value, unit);
   }
 
   // NOLINTBEGIN(bugprone-easily-swappable-parameters)
   Temperature clamp(const Temperature &min, const Temperature &max) const {
-    return Temperature(std::max(std::min(this->celsius, max.celsius), min.celsius), Unit::C);
+    return fromCentiCelsius(std::max(std::min(this->centiCelsius, max.centiCelsius),
+                                     min.centiCelsius));
   }
 
   Temperature &clamp(const Temperature &min, const Temperature &max) {
-    celsius = std::max(std::min(this->celsius, max.celsius), min.celsius);
+    centiCelsius = std::max(std::min(this->centiCelsius, max.centiCelsius), min.centiCelsius);
     return *this;
   }
   // NOLINTEND(bugprone-easily-swappable-parameters)
 
+  constexpr bool operator==(const Temperature &other) const {
+    return centiCelsius == other.centiCelsius;
+  }
+
+  constexpr bool operator!=(const Temperature &other) const {
+    return centiCelsius != other.centiCelsius;
+  }
+
   static float celsiusToFahrenheit(const float celsius) {
     return celsius * 9.0f / 5.0f + 32.0f;
   }
@@ -91,4 +160,47 @@ class Temperature {
   static float fahrenheitToCelsius(const float fahrenheit) {
     return (fahrenheit - 32.0f) * 5.0f / 9.0f;
   }
-};
\ No newline at end of file
+
+  static constexpr int32_t centiCelsiusToCentiFahrenheit(const int32_t celsius) {
+    return divideRounded(celsius * 9, 5) + 3200;
+  }
+
+  static constexpr int32_t centiFahrenheitToCentiCelsius(const int32_t fahrenheit) {
+    return divideRounded((fahrenheit - 3200) * 5, 9);
+  }
+
+  // Round to the nearest multiple of `step`, halfway cases away from zero (like std::round)
+  static constexpr int32_t roundToStep(const int32_t value, const int32_t step) {
+    return step > 0 ? divideRounded(value, step) * step : value;
+  }
+
+  static constexpr int32_t stepToCenti(const float step) {
+    return step > 0.0f ? toCenti(step) : 0;
+  }
+
+ private:
+  // Wide enough that a Fahrenheit value still saturates after conversion to Celsius, narrow enough
+  // that neither the float-to-int cast nor that conversion can overflow.
+  static constexpr float centiLimit = 2.0f * INT16_MAX;
+
+  // Out-of-range values clamp to the limit. NaN has no sensible temperature, so it maps to zero
+  // rather than reaching the cast, which would be undefined.
+  static constexpr int32_t toCenti(const float value) {
+    const float centi = value * 100.0f;
+    return centi != centi          ? 0
+           : centi >= centiLimit  ? static_cast<int32_t>(centiLimit)
+           : centi <= -centiLimit ? -static_cast<int32_t>(centiLimit)
+                                  : static_cast<int32_t>(centi + (value < 0.0f ? -0.5f : 0.5f));
+  }
+
+  static constexpr int32_t divideRounded(const int32_t numerator, const int32_t denominator) {
+    return numerator >= 0 ? (numerator + denominator / 2) / denominator
+                          : -((-numerator + denominator / 2) / denominator);
+  }
+
+  static constexpr int16_t saturate(const int32_t value) {
+    return static_cast<int16_t>(value > INT16_MAX   ? INT16_MAX
+                                : value < INT16_MIN ? INT16_MIN
+                                                    : value);
+  }
+};
@@ -2,6 +2,7 @@
 
 require 'webrick'
 require 'mustache'
+require 'json'
 
 root = File.expand_path '~/public_html'
 server = WEBrick::HTTPServer.new :Port => 8000, :DocumentRoot => root
@@ -52,6 +53,18 @@ server.mount_proc '/' do |req, res|
     # puts req.path
     case req.path
     when "/css" then res.body = File.read File.expand_path("mvp.css", "src/frontend/statics")
+    when "/history.json"
+        res.content_type = "application/json"
+        samples = (0...1440).map do |minute|
+            next nil if minute.between?(600, 640)
+            operating = (minute / 45).even?
+            [(21 + Math.sin(minute / 120.0)).round(1), 21.5, operating ? 40 : 0, operating ? 1 : 0]
+        end
+        res.body = {interval: 60, age: 12, unit: "C", samples: samples}.to_json
+    when "/events"
+        # One-shot stream; the browser reconnects after `retry`, which is enough to exercise the page
+        res.content_type = "text/event-stream"
+        res.body = "retry: 5000\n\nevent: state\ndata: #{{current_temp: "21.#{rand(10)}"}.to_json}\n\n"
     
     when "/captive/" then res.body = render("captive/index", {hostname: "the_hostname"})
     when "/captive/reboot" then res.body = render("captive/reboot")
@@ -87,6 +100,18 @@ server.mount_proc '/' do |req, res|
             param: "mt",
             placeholder: "topic",
         },
+        remoteTempTopic: {
+            value: "zigbee2mqtt/bedroom_sensor",
+            label: "Remote temperature sensor topic (optional)",
+            param: "mrt",
+            placeholder: "zigbee2mqtt/bedroom_sensor",
+        },
+        remoteTempPath: {
+            value: "temperature",
+            label: "Temperature field in sensor messages",
+            param: "mrp",
+            placeholder: "temperature",
+        },
     })
 
     when "/" then res.body = render("index")
@@ -116,6 +141,12 @@ server.mount_proc '/' do |req, res|
         topic: "the_topic",
         dumpPacketsToMqtt: true,
         logToMqtt: true,
+        fields: [
+            {title: "Remote temperature: minimum interval (seconds)", name: "RtInterval", value: 5},
+            {title: "Remote temperature: minimum change (C)", name: "RtDelta", value: 0.1},
+            {title: "Remote temperature: smoothing (% weight of past readings)", name: "RtSmoothing", value: 0},
+            {title: "Remote temperature: resend unchanged value every (seconds)", name: "RtRefresh", value: 120},
+        ],
         toggles: [
             {title: "Safe mode", name: "SafeMode", value: true},
             {title: "Optimistic updates", name: "OptimisticUpdates", value: true},
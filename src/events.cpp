@@ -0,0 +1,56 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#include "events.hpp"
+
+#include "moment.hpp"
+
+// Each open stream holds a TCP connection and its buffers, so keep the count low
+static const size_t MAX_SUBSCRIBERS = 4;
+static const uint32_t KEEPALIVE_INTERVAL_MS = 15000;
+static const uint32_t RECONNECT_DELAY_MS = 5000;
+
+static AsyncEventSource source("/events");
+static Moment lastKeepAlive(Moment::never());
+
+void Events::initialize(AsyncWebServer &server, ArRequestFilterFunction filter,
+                        String (*initialData)()) {
+  source.onConnect([initialData](AsyncEventSourceClient *client) {
+    if (source.count() > MAX_SUBSCRIBERS) {
+      client->close();
+      return;
+    }
+    client->send(initialData().c_str(), "state", 0, RECONNECT_DELAY_MS);
+  });
+  source.setFilter(std::move(filter));
+  server.addHandler(&source);
+}
+
+void Events::broadcast(const char *event, const String &data) {
+  source.send(data.c_str(), event);
+}
+
+size_t Events::subscriberCount() {
+  return source.count();
+}
+
+void Events::maintain() {
+  if (Moment::now() - lastKeepAlive < KEEPALIVE_INTERVAL_MS) {
+    return;
+  }
+  lastKeepAlive = Moment::now();
+  if (source.count() > 0) {
+    // The page doesn't listen for these; they just keep proxies from closing an idle stream
+    source.send("", "ping");
+  }
+}
@@ -0,0 +1,28 @@
+/*
+  MitsuQTT Copyright (c) 2024 floatplane
+
+  This library is free software; you can redistribute it and/or modify it under the terms of the GNU
+  Lesser General Public License as published by the Free Software Foundation; either version 2.1 of
+  the License, or (at your option) any later version. This library is distributed in the hope that
+  it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public License along with this library;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  02110-1301 USA
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+// Server-Sent Events, so state changes reach open pages as a few bytes instead of a reload
+namespace Events {
+// Serve the event stream at /events. Requests `filter` rejects are turned away; every other
+// subscriber gets `initialData()` as its first `state` event.
+void initialize(AsyncWebServer &server, ArRequestFilterFunction filter, String (*initialData)());
+void broadcast(const char *event, const String &data);
+size_t subscriberCount();
+// Call from the loop: keeps idle connections from timing out
+void maintain();
+}  // namespace Events
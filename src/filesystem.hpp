@@ -71,6 +71,63 @@ class FileSystem {
     configFile.close();
   }
 
+  static size_t fileSize(const char *filename) {
+    if (!FILESYSTEM.exists(filename)) {
+      return 0;
+    }
+    File file = FILESYSTEM.open(filename, "r");
+    if (!file) {
+      return 0;
+    }
+    const size_t size = file.size();
+    file.close();
+    return size;
+  }
+
+  static size_t readBytes(const char *filename, size_t offset, uint8_t *data, size_t length) {
+    File file = FILESYSTEM.open(filename, "r");
+    if (!file) {
+      return 0;
+    }
+    size_t count = 0;
+    if (file.seek(offset)) {
+      count = file.read(data, length);
+    }
+    file.close();
+    return count;
+  }
+
+  static bool appendBytes(const char *filename, const uint8_t *data, size_t length) {
+    File file = FILESYSTEM.open(filename, "a");
+    if (!file) {
+      return false;
+    }
+    const size_t written = file.write(data, length);
+    file.close();
+    return written == length;
+  }
+
+  // Write to a scratch file and rename it over the original, so a power cut leaves one or the
+  // other intact rather than a truncated file
+  static bool replaceBytes(const char *filename, const uint8_t *data, size_t length) {
+    const String scratch = String(filename) + F(".tmp");
+    File file = FILESYSTEM.open(scratch.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    const size_t written = file.write(data, length);
+    file.close();
+    if (written != length) {
+      FILESYSTEM.remove(scratch.c_str());
+      return false;
+    }
+#ifdef USE_SPIFFS
+    // SPIFFS won't rename over an existing file
+    FILESYSTEM.remove(filename);
+#endif
+    return FILESYSTEM.rename(scratch.c_str(), filename);
+  }
+
   static void deleteFile(const char *filename) {
     if (FILESYSTEM.exists(filename)) {
       FILESYSTEM.remove(filename);
@@ -20,5 +20,8 @@ const char* friendlyNameLabel PROGMEM = "Friendly Name";
 const char* hostLabel PROGMEM = "Host";
 const char* userLabel PROGMEM = "User";
 const char* topicLabel PROGMEM = "Topic";
+const char* remoteTempTopicLabel PROGMEM = "Remote temperature sensor topic (optional)";
+const char* remoteTempPathLabel PROGMEM = "Temperature field in sensor messages (Celsius)";
+const char* groupsLabel PROGMEM = "Groups, comma separated (optional)";
 }  // namespace mqtt
 }  // namespace views
@@ -28,6 +28,7 @@ INCTXT(captiveIndex, "src/frontend/" STRINGIFY(LANGUAGE) "/views/captive/index.m
 INCTXT(captiveReboot, "src/frontend/" STRINGIFY(LANGUAGE) "/views/captive/reboot.mst");
 INCTXT(captiveSave, "src/frontend/" STRINGIFY(LANGUAGE) "/views/captive/save.mst");
 INCTXT(control, "src/frontend/" STRINGIFY(LANGUAGE) "/views/control.mst");
+INCTXT(counters, "src/frontend/" STRINGIFY(LANGUAGE) "/views/counters.mst");
 INCTXT(index, "src/frontend/" STRINGIFY(LANGUAGE) "/views/index.mst");
 INCTXT(login, "src/frontend/" STRINGIFY(LANGUAGE) "/views/login.mst");
 INCTXT(metrics, "src/frontend/" STRINGIFY(LANGUAGE) "/views/metrics.mst");
@@ -61,6 +62,7 @@ const __FlashStringHelper *save = FPSTR(captiveSaveData);
 }  // namespace captive
 
 const __FlashStringHelper *control = FPSTR(controlData);
+const __FlashStringHelper *counters = FPSTR(countersData);
 const __FlashStringHelper *index = FPSTR(indexData);
 const __FlashStringHelper *login = FPSTR(loginData);
 const __FlashStringHelper *metrics = FPSTR(metricsData);
@@ -31,6 +31,7 @@ extern const __FlashStringHelper *save;
 }  // namespace captive
 
 extern const __FlashStringHelper *control;
+extern const __FlashStringHelper *counters;
 extern const __FlashStringHelper *index;
 extern const __FlashStringHelper *login;
 extern const __FlashStringHelper *metrics;
@@ -14,7 +14,6 @@
 #include "logger.hpp"
 
 #include <ESPAsyncWebServer.h>
-#include <PubSubClient.h>
 
 #ifdef ENABLE_WEBSOCKET_LOGGING
 static AsyncWebServer server(81);
@@ -33,6 +32,22 @@ void onEvent(const AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEven
 
 const auto LOG_BUFFER_SIZE = 256;
 
+#ifdef ESP32
+extern TaskHandle_t loopTaskHandle;
+#else
+extern "C" bool can_yield();
+#endif
+
+// Web handlers run outside the loop (in the network stack's context on ESP8266, on the async TCP
+// task on ESP32), and the MQTT sink belongs to the loop. Their lines only go to the websocket.
+static bool inLoop() {
+#ifdef ESP32
+  return xTaskGetCurrentTaskHandle() == loopTaskHandle;
+#else
+  return can_yield();
+#endif
+}
+
 void Logger::initialize() {
 #ifdef ENABLE_WEBSOCKET_LOGGING
   webSocket.onEvent(onEvent);
@@ -41,21 +56,18 @@ void Logger::initialize() {
 #endif
 }
 
-static PubSubClient *mqttClient = nullptr;
-static const char *mqttTopic = nullptr;
-void Logger::enableMqttLogging(PubSubClient &mqttClient, const char *mqttTopic) {
-  ::mqttClient = &mqttClient;
-  ::mqttTopic = mqttTopic;
+static Logger::MqttSink mqttSink = nullptr;
+void Logger::enableMqttLogging(const MqttSink sink) {
+  mqttSink = sink;
 }
 
 void Logger::disableMqttLogging() {
-  ::mqttClient = nullptr;
-  ::mqttTopic = nullptr;
+  mqttSink = nullptr;
 }
 
 void Logger::log(const char *format, ...) {
 #ifndef ENABLE_WEBSOCKET_LOGGING
-  if (mqttClient == nullptr) {
+  if (mqttSink == nullptr) {
     // early out if no log output is enabled
     return;
   }
@@ -67,15 +79,15 @@ void Logger::log(const char *format, ...) {
 #ifdef ENABLE_WEBSOCKET_LOGGING
   webSocket.printfAll(logBuffer);
 #endif
-  if (mqttClient != nullptr) {
-    mqttClient->publish(mqttTopic, logBuffer);
+  if (mqttSink != nullptr && inLoop()) {
+    mqttSink(logBuffer);
   }
   va_end(args);
 }
 
 void Logger::log(const __FlashStringHelper *format, ...) {
 #ifndef ENABLE_WEBSOCKET_LOGGING
-  if (mqttClient == nullptr) {
+  if (mqttSink == nullptr) {
     // early out if no log output is enabled
     return;
   }
@@ -89,8 +101,8 @@ void Logger::log(const __FlashStringHelper *format, ...) {
 #ifdef ENABLE_WEBSOCKET_LOGGING
   webSocket.printfAll(logBuffer);
 #endif
-  if (mqttClient != nullptr) {
-    mqttClient->publish(mqttTopic, logBuffer);
+  if (mqttSink != nullptr && inLoop()) {
+    mqttSink(logBuffer);
   }
   va_end(args);
 }
\ No newline at end of file
@@ -16,11 +16,12 @@
 
 #include <Arduino.h>
 
-class PubSubClient;
-
 namespace Logger {
+// Takes each log line for publishing; it's expected to queue the line rather than block on it
+using MqttSink = void (*)(const char* line);
+
 void initialize();
-void enableMqttLogging(PubSubClient& mqttClient, const char* mqttTopic);
+void enableMqttLogging(MqttSink sink);
 void disableMqttLogging();
 void log(const char* format, ...) __attribute__((format(printf, 1, 2)));
 void log(const __FlashStringHelper* format, ...);
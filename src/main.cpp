@@ -15,36 +15,56 @@
 #include "filesystem.hpp"
 
 #ifdef ESP32
-#include <ESPmDNS.h>    // mDNS for ESP32
-#include <WebServer.h>  // webServer for ESP32
-#include <WiFi.h>       // WIFI for ESP32
+#include <ESPmDNS.h>  // mDNS for ESP32
+#include <WiFi.h>     // WIFI for ESP32
 #include <WiFiUdp.h>
 
-WebServer server(80);  // ESP32 web
+#include <mutex>
 #else
-#include <ESP8266WebServer.h>  // webServer for ESP8266
-#include <ESP8266WiFi.h>       // WIFI for ESP8266
-#include <ESP8266mDNS.h>       // mDNS for ESP8266
+#include <ESP8266WiFi.h>  // WIFI for ESP8266
+#include <ESP8266mDNS.h>  // mDNS for ESP8266
 #include <WiFiClient.h>
-ESP8266WebServer server(80);  // ESP8266 web
 #endif
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>  // for Update
-#include <DNSServer.h>   // DNS for captive portal
-#include <HeatPump.h>    // SwiCago library: https://github.com/SwiCago/HeatPump
-#include <MD5Builder.h>  // for the session cookie hash
+#include <AsyncJson.h>
+#include <DNSServer.h>          // DNS for captive portal
+#include <ESPAsyncWebServer.h>  // web UI, served outside the loop
+#include <HeatPump.h>           // SwiCago library: https://github.com/SwiCago/HeatPump
+#include <MD5Builder.h>         // for the session cookie hash
 #include <Ministache.h>
 #include <PubSubClient.h>  // MQTT: PubSubClient 2.8.0
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <memory>
+#include <set>
+#include <vector>
 #include <temperature.hpp>
 
+#include "HeatpumpCodec.hpp"
+#include "HeatpumpCommandAcks.hpp"
+#include "HeatpumpCommandQueue.hpp"
+#include "HeatpumpLinkStats.hpp"
+#include "HeatpumpReconciler.hpp"
+#include "HeatpumpRuntime.hpp"
 #include "HeatpumpSettings.hpp"
+#include "HeatpumpState.hpp"
 #include "HeatpumpStatus.hpp"
+#include "RemoteTemperatureFilter.hpp"
+#include "counterjournal.hpp"
+#include "events.hpp"
 #include "frontend/templates.hpp"
+#include "histogram.hpp"
+#include "history.hpp"
+#include "jsonscan.hpp"
 #include "logger.hpp"
 #include "main.hpp"
 #include "moment.hpp"
+#include "msgpack.hpp"
+#include "mqttoutbox.hpp"
+#include "telemetry.hpp"
 #include "timer.hpp"
 #include "views/mqtt/strings.hpp"
 
@@ -54,6 +74,8 @@ const PROGMEM char *const mqtt_conf = "/mqtt.json";
 const PROGMEM char *const unit_conf = "/unit.json";
 const PROGMEM char *const console_file = "/console.log";
 const PROGMEM char *const others_conf = "/others.json";
+const PROGMEM char *const discovery_hash = "/discovery.json";
+const PROGMEM char *const counters_journal = "/counters.bin";
 // pinouts
 const PROGMEM uint8_t blueLedPin = 2;  // The ESP32 has an internal blue LED at D2 (GPIO 02)
 #else
@@ -62,6 +84,8 @@ const PROGMEM char *const mqtt_conf = "mqtt.json";
 const PROGMEM char *const unit_conf = "unit.json";
 const PROGMEM char *const console_file = "console.log";
 const PROGMEM char *const others_conf = "others.json";
+const PROGMEM char *const discovery_hash = "discovery.json";
+const PROGMEM char *const counters_journal = "counters.bin";
 // pinouts
 const PROGMEM uint8_t blueLedPin = LED_BUILTIN;  // Onboard LED = digital pin 2 "D4" (blue LED on
                                                  // WEMOS D1-Mini)
@@ -111,13 +135,27 @@ struct Config {
     // confirmed the change. This is useful if you want to make the UI feel more responsive, but
     // could lead to the UI showing the wrong state if the heat pump fails to change state.
     bool optimisticUpdates;
+    // Compact state: when true, the state also goes out as MessagePack with one-letter keys on
+    // <root>/<name>/state/msgpack, for consumers that read it often and aren't Home Assistant
+    bool compactState;
+    // Telemetry: when true, every status report from the heat pump is recorded and sent in
+    // batches to <root>/<name>/telemetry, for analysis finer grained than the state topic allows
+    bool telemetry;
+    // Which remote temperature readings get passed on to the heat pump: see
+    // RemoteTemperatureFilter. The defaults drop sub-0.1° jitter and readings less than 5 seconds
+    // apart.
+    RemoteTemperatureFilter::Policy remoteTemp;
+    // How the runtime totals estimate energy use: see HeatpumpRuntime
+    HeatpumpRuntime::EnergyModel energyModel;
     Other()
         : haAutodiscovery(true),
           haAutodiscoveryTopic(F("homeassistant")),
           logToMqtt(false),
           dumpPacketsToMqtt(false),
           safeMode(false),
-          optimisticUpdates(true) {
+          optimisticUpdates(true),
+          compactState(false),
+          telemetry(false) {
     }
   } other;
 
@@ -149,14 +187,25 @@ struct Config {
     String username;
     String password;
     String rootTopic;
+    // An existing sensor topic to take the remote temperature from, e.g. a zigbee2mqtt device, and
+    // the dotted path of the temperature field in its JSON messages
+    String remoteTempTopic;
+    String remoteTempPath;
+    // Comma-separated groups whose <root>/groups/<group>/... command topics this unit also follows
+    String groups;
     MQTT()
-        : rootTopic(F("mitsubishi2mqtt")) {  // TODO(floatplane): change name of default root topic
+        : rootTopic(F("mitsubishi2mqtt")),  // TODO(floatplane): change name of default root topic
+          remoteTempPath(F("temperature")) {
     }
 
     bool configured() const {
       return friendlyName.length() > 0 && server.length() > 0 && username.length() > 0 &&
              password.length() > 0 && rootTopic.length() > 0;
     }
+    const String &ha_ack_topic() const {
+      static const String topicPath{rootTopic + F("/") + friendlyName + F("/ack")};
+      return topicPath;
+    }
     const String &ha_availability_topic() const {
       static const String topicPath{rootTopic + "/" + friendlyName + F("/availability")};
       return topicPath;
@@ -181,6 +230,10 @@ struct Config {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/debug/packets")};
       return topicPath;
     }
+    const String &ha_diagnostics_topic() const {
+      static const String topicPath{rootTopic + F("/") + friendlyName + F("/diagnostics")};
+      return topicPath;
+    }
     const String &ha_fan_set_topic() const {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/fan/set")};
       return topicPath;
@@ -193,14 +246,26 @@ struct Config {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/remote_temp/set")};
       return topicPath;
     }
+    const String &ha_set_topic() const {
+      static const String topicPath{rootTopic + F("/") + friendlyName + F("/set")};
+      return topicPath;
+    }
     const String &ha_state_topic() const {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/state")};
       return topicPath;
     }
+    const String &ha_state_msgpack_topic() const {
+      static const String topicPath{rootTopic + F("/") + friendlyName + F("/state/msgpack")};
+      return topicPath;
+    }
     const String &ha_system_set_topic() const {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/system/set")};
       return topicPath;
     }
+    const String &ha_telemetry_topic() const {
+      static const String topicPath{rootTopic + F("/") + friendlyName + F("/telemetry")};
+      return topicPath;
+    }
     const String &ha_temp_set_topic() const {
       static const String topicPath{rootTopic + F("/") + friendlyName + F("/temp/set")};
       return topicPath;
@@ -224,8 +289,10 @@ Moment wifi_reconnect_timeout(Moment::now());
 
 enum HttpStatusCodes {
   httpOk = 200,
+  httpAccepted = 202,
   httpFound = 302,
   httpSeeOther = 303,
+  httpNotModified = 304,
   httpBadRequest = 400,
   httpUnauthorized = 401,
   httpForbidden = 403,
@@ -239,7 +306,7 @@ enum HttpStatusCodes {
 // Define global variables for MQTT
 const PROGMEM char *const mqtt_payload_available = "online";
 const PROGMEM char *const mqtt_payload_unavailable = "offline";
-const size_t maxCustomPacketLength = 20;  // max custom packet bytes is 20
+const size_t maxCustomPacketLength = HeatpumpCommandQueue::maxPacketLength;
 
 // Define global variables for HA topics
 String ha_config_topic;
@@ -249,12 +316,27 @@ String ha_config_topic;
 // sketch settings
 const PROGMEM uint32_t CHECK_REMOTE_TEMP_INTERVAL_MS = 300000;  // 5 minutes
 const PROGMEM uint32_t MQTT_RETRY_INTERVAL_MS = 1000;           // 1 second
+// Home Assistant sends mode, temperature and fan commands within a few ms of each other; hold
+// optimistic state publishes this long so the whole burst goes out as one message
+const PROGMEM uint32_t OPTIMISTIC_PUBLISH_WINDOW_MS = 50;
 const PROGMEM uint32_t MQTT_MAX_RETRIES =
     8;  // Double the interval between retries up to this many times, then keep
         // retrying forever at that maximum interval.
 // Default values give a final retry interval of 1000ms * 2^8, which is 256
 // seconds, about 4 minutes.
 const PROGMEM int64_t HP_RETRY_INTERVAL_MS = 1000LL;  // 1 second
+// A full CN105 packet takes ~90ms to send at 2400 baud; leave room for the reply
+const PROGMEM uint32_t HP_COMMAND_INTERVAL_MS = 200;
+// How long each loop pass may spend handing queued messages to the MQTT client
+const PROGMEM uint32_t MQTT_DRAIN_BUDGET_MS = 20;
+// Each group adds a dozen subscriptions
+const PROGMEM size_t MQTT_MAX_GROUPS = 4;
+// Telemetry batches go out when full or when their first sample is this old
+const PROGMEM uint32_t TELEMETRY_MAX_AGE_MS = 10000;
+// One history sample a minute; the default ring holds a day or more of them in 4KB
+const PROGMEM uint32_t HISTORY_INTERVAL_MS = 60000;
+// How often the persistent counters are saved; at most this much is lost to a power cut
+const PROGMEM uint32_t COUNTER_CHECKPOINT_INTERVAL_MS = 900000;  // 15 minutes
 const PROGMEM uint32_t HP_MAX_RETRIES =
     10;  // Double the interval between retries up to this many times, then keep
          // retrying forever at that maximum interval.
@@ -267,6 +349,51 @@ const PROGMEM uint32_t HP_MAX_RETRIES =
 WiFiClient espClient;
 PubSubClient mqtt_client(espClient);
 
+// Web UI. Requests are handled outside loop(): in the network stack's context on ESP8266, and on
+// the async TCP task on ESP32. Handlers take a StateLock around anything they share with the
+// loop, and hand anything that does I/O (flash writes, the serial link, MQTT) to the loop as
+// DeferredWork.
+AsyncWebServer server(80);
+
+#ifdef ESP32
+std::mutex stateMutex;
+#endif
+
+// On ESP8266 this is a no-op: handlers can only run while the loop is yielding, and nothing below
+// yields in the middle of an update
+class StateLock {
+ public:
+  StateLock() {
+#ifdef ESP32
+    stateMutex.lock();
+#endif
+  }
+  ~StateLock() {
+#ifdef ESP32
+    stateMutex.unlock();
+#endif
+  }
+  StateLock(const StateLock &) = delete;
+  StateLock &operator=(const StateLock &) = delete;
+};
+
+enum DeferredWork : uint32_t {
+  saveWifi = 1U << 0U,
+  saveMqtt = 1U << 1U,
+  saveUnit = 1U << 2U,
+  saveOthers = 1U << 3U,
+  formatFilesystem = 1U << 4U,
+  connectHeatpump = 1U << 5U,
+  connectMqtt = 1U << 6U,
+  disconnectMqtt = 1U << 7U,
+  restart = 1U << 8U,
+};
+std::atomic<uint32_t> deferredWork(0);
+std::atomic<uint32_t> deferredRestartDelayMs(0);
+// Settings pages write here, under a StateLock, and the loop saves it; the running config is only
+// ever read outside the loop
+Config pendingConfig;
+
 // Captive portal variables, only used for config page
 const byte DNS_PORT = 53;
 IPAddress apIP(192, 168, 1, 1);
@@ -278,9 +405,105 @@ boolean remoteTempActive = false;
 
 // HVAC
 HeatPump hp;  // NOLINT(readability-identifier-length)
+// Everything that reads heat pump state goes through this snapshot, which is only refreshed when
+// the HeatPump library reports a change during sync()
+HeatpumpState hpState;
+bool hpStateDirty = true;
+// Settings changes from the web UI and MQTT are requested here rather than pushed straight to the
+// unit, so that only real changes make it onto the serial link
+HeatpumpReconciler hpReconciler;
+// Everything we write to the unit waits here, so user commands can go ahead of remote temperature
+// updates and a flood of either can't grow without bound
+HeatpumpCommandQueue hpCommands;
+Moment lastHpCommand(Moment::never());
+// Packet counts and timings for the serial link, to diagnose a unit that keeps dropping off it
+HeatpumpLinkStats hpLink;
+// MQTT commands sent with a correlation id, followed until the unit confirms them
+HeatpumpCommandAcks hpAcks;
+// The correlation id of the MQTT command being handled, if it has one, and whether its handler
+// accepted it
+String mqttCommandId;
+bool mqttCommandTracked = false;
+RemoteTemperatureFilter remoteTempFilter;
+
+// Recent history, kept on the device so trends survive broker or Prometheus outages
+HistoryRing<> history;
+Moment nextHistorySample(Moment::never());
+// Compressor and per-mode run time and estimated energy, accumulated as the state changes
+HeatpumpRuntime hpRuntime;
+
+// Ids of the counters kept in the journal. These are stored on flash, so only ever add to the end.
+enum class JournalCounter : uint8_t {
+  hvacRetries,
+  poweredMs,
+  compressorMs,
+  compressorStarts,
+  energyWattMs,
+  modeMs,  // one per heatpump::Mode, so this must stay last
+};
+static_assert(static_cast<size_t>(JournalCounter::modeMs) + HeatpumpRuntime::modeCount <=
+                  CounterJournal::maxCounters,
+              "too many journal counters");
+
+class JournalFile : public CounterJournal::Storage {
+ public:
+  explicit JournalFile(const char *filename) : filename(filename) {
+  }
+  size_t size() override {
+    return FileSystem::fileSize(filename);
+  }
+  size_t read(const size_t offset, uint8_t *data, const size_t length) override {
+    return FileSystem::readBytes(filename, offset, data, length);
+  }
+  bool append(const uint8_t *data, const size_t length) override {
+    return FileSystem::appendBytes(filename, data, length);
+  }
+  bool replace(const uint8_t *data, const size_t length) override {
+    return FileSystem::replaceBytes(filename, data, length);
+  }
+
+ private:
+  const char *filename;
+};
+
+// Totals that survive a restart: restored at boot, checkpointed periodically and just before an
+// orderly restart
+JournalFile countersFile(counters_journal);
+CounterJournal counterJournal(countersFile);
+Moment nextCounterCheckpoint(Moment::never());
+// Status reports waiting to go out on the telemetry topic
+TelemetryBatch<> telemetry;
+// What the /events subscribers were last told, so only the fields that changed get pushed
+HeatpumpSettings eventSettings{heatpumpSettings{}};
+int16_t eventRoomCenti = 0;
+uint32_t eventVersion = 0;
+// Everything we publish waits here for the loop, so a slow broker sheds packet dumps and log lines
+// before state, and never holds up the code that produced the message
+MqttOutbox mqttOutbox;
+// The command queue, the outbox and the remote temperature filter belong to the loop: nothing else
+// touches them, so they need no lock. The counters page reads their stats from this copy instead,
+// which the loop refreshes on every pass.
+struct QueueCounters {
+  struct {
+    std::atomic<uint32_t> depth, highWater, queued, replaced, overflowed, dispatched;
+  } commands;
+  struct {
+    std::atomic<uint32_t> depth, bytes, highWater, queued, coalesced, published, failed;
+    std::array<std::atomic<uint32_t>, MqttOutbox::kindCount> dropped;
+  } outbox;
+  struct {
+    std::atomic<uint32_t> received, forwarded, refreshed;
+  } remoteTemp;
+};
+QueueCounters queueCounters;
 Moment lastMqttStatePacketSend(Moment::never());
+HeatpumpSettings pendingOptimisticSettings{heatpumpSettings{}};
+Moment pendingOptimisticSince(Moment::never());
+bool optimisticPublishPending = false;
 Moment lastMqttRetry(Moment::never());
 unsigned int mqttConnectionRetries;
+// Home Assistant has come online and wants discovery sent again
+bool haConfigRequested = false;
 Moment lastHpSync(Moment::never());
 unsigned int hpConnectionRetries;
 unsigned int hpConnectionTotalRetries;
@@ -308,6 +531,7 @@ void restartAfterDelay(uint32_t delayMs) {
   restartPending = true;
   // TODO(floatplane): optionally power down the heat pump to prevent runaways
   getTimer()->in(delayMs, []() {
+    checkpointCounters();
     ESP.restart();
     return Timers::TimerStatus::completed;
   });
@@ -350,6 +574,10 @@ void setup() {
   loadOthersConfig();
   loadUnitConfig();
   loadMqttConfig();
+  pendingConfig = config;
+  remoteTempFilter.setPolicy(config.other.remoteTemp);
+  hpRuntime.setModel(config.other.energyModel);
+  restoreCounters();
 #ifdef ESP32
   WiFi.setHostname(config.network.hostname.c_str());
 #else
@@ -359,51 +587,54 @@ void setup() {
     FileSystem::deleteFile(console_file);
     LOG(F("Starting MitsuQTT"));
     // Web interface
-    server.on(F("/"), handleRoot);
-    server.on(F("/control"), HTTPMethod::HTTP_GET, handleControlGet);
-    server.on(F("/control"), HTTPMethod::HTTP_POST, handleControlPost);
-    server.on(F("/setup"), handleSetup);
-    server.on(F("/mqtt"), handleMqtt);
-    server.on(F("/wifi"), handleWifi);
-    server.on(F("/unit"), HTTPMethod::HTTP_GET, handleUnitGet);
-    server.on(F("/unit"), HTTPMethod::HTTP_POST, handleUnitPost);
-    server.on(F("/status"), handleStatus);
-    server.on(F("/others"), handleOthers);
-    server.on(F("/metrics"), handleMetrics);
-    server.on(F("/metrics.json"), handleMetricsJson);
-    server.on(F("/css"), HTTPMethod::HTTP_GET, []() {
+    server.on("/", HTTP_ANY, handleRoot);
+    server.on("/control", HTTP_GET, handleControlGet);
+    server.on("/control", HTTP_POST, handleControlPost);
+    server.on("/setup", HTTP_ANY, handleSetup);
+    server.on("/mqtt", HTTP_ANY, handleMqtt);
+    server.on("/wifi", HTTP_ANY, handleWifi);
+    server.on("/unit", HTTP_GET, handleUnitGet);
+    server.on("/unit", HTTP_POST, handleUnitPost);
+    server.on("/status", HTTP_ANY, handleStatus);
+    server.on("/others", HTTP_ANY, handleOthers);
+    server.on("/metrics", HTTP_ANY, handleMetrics);
+    server.on("/metrics.json", HTTP_ANY, handleMetricsJson);
+    server.on("/history.json", HTTP_GET, handleHistoryJson);
+    Events::initialize(server, isAuthorized, renderStateEvent);
+    server.on("/api/state", HTTP_GET, handleApiState);
+    auto *apiControl = new AsyncCallbackJsonWebHandler("/api/control", handleApiControl);
+    apiControl->setMethod(HTTP_POST);
+    server.addHandler(apiControl);
+    server.on("/css", HTTP_GET, [](AsyncWebServerRequest *request) {
       // We always add the git_hash as a query param on the CSS request, so we can
       // use a very long cache expiry here. This makes browsing way faster.
-      server.sendHeader(F("Cache-Control"), F("public, max-age=604800, immutable"));
-      server.send(200, F("text/css"), statics::css);
+      AsyncWebServerResponse *response = request->beginResponse(
+          httpOk, "text/css", reinterpret_cast<const uint8_t *>(statics::css),
+          strlen_P(reinterpret_cast<PGM_P>(statics::css)));
+      response->addHeader(F("Cache-Control"), F("public, max-age=604800, immutable"));
+      request->send(response);
     });
     server.onNotFound(handleNotFound);
     if (config.unit.login_password.length() > 0) {
-      server.on(F("/login"), HTTPMethod::HTTP_GET, handleLogin);
-      server.on(F("/login"), HTTPMethod::HTTP_POST, handleAuth);
-      server.on(F("/logout"), HTTPMethod::HTTP_POST, handleLogout);
-      // here the list of headers to be recorded, use for authentication
-      const char *headerkeys[] = {"Cookie"};
-      const size_t headerkeyssize = sizeof(headerkeys) / sizeof(char *);
-      // ask server to track these headers
-      server.collectHeaders(headerkeys, headerkeyssize);
-    }
-    server.on(F("/upgrade"), handleUpgrade);
-    server.on(F("/upload"), HTTP_POST, handleUploadDone, handleUploadLoop);
+      server.on("/login", HTTP_GET, handleLogin);
+      server.on("/login", HTTP_POST, handleAuth);
+      server.on("/logout", HTTP_POST, handleLogout);
+    }
+    server.on("/upgrade", HTTP_ANY, handleUpgrade);
+    server.on("/upload", HTTP_POST, handleUploadDone, handleUploadLoop);
 
     server.begin();
     hpConnectionRetries = 0;
-    hpConnectionTotalRetries = 0;
     if (config.mqtt.configured()) {
       LOG(F("Starting MQTT"));
       if (config.other.haAutodiscovery) {
-        ha_config_topic = config.other.haAutodiscoveryTopic + F("/climate/") +
+        ha_config_topic = config.other.haAutodiscoveryTopic + F("/device/") +
                           config.mqtt.friendlyName + F("/config");
       }
       // startup mqtt connection
       initMqtt();
       if (config.other.logToMqtt) {
-        Logger::enableMqttLogging(mqtt_client, config.mqtt.ha_debug_logs_topic().c_str());
+        Logger::enableMqttLogging(queueMqttLog);
       }
     } else {
       LOG(F("Not found MQTT config go to configuration page"));
@@ -411,6 +642,11 @@ void setup() {
     // Serial.println(F("Connection to HVAC. Stop serial log."));
     LOG(F("MQTT initialized, trying to connect to HVAC"));
     hp.setPacketCallback(hpPacketDebug);
+    hp.setSettingsChangedCallback([]() { hpStateDirty = true; });
+    hp.setStatusChangedCallback([](const heatpumpStatus status) {
+      hpStateDirty = true;
+      recordTelemetry(status);
+    });
 
     // Merge settings from remote control with settings driven from MQTT
     hp.enableExternalUpdate();
@@ -456,6 +692,9 @@ void loadMqttConfig() {
   config.mqtt.username = doc["mqtt_user"].as<String>();
   config.mqtt.password = doc["mqtt_pwd"].as<String>();
   config.mqtt.rootTopic = doc["mqtt_topic"].as<String>();
+  config.mqtt.remoteTempTopic = doc["mqtt_rt_topic"] | "";
+  config.mqtt.remoteTempPath = doc["mqtt_rt_path"] | "temperature";
+  config.mqtt.groups = doc["mqtt_groups"] | "";
 }
 
 void loadUnitConfig() {
@@ -479,6 +718,36 @@ void loadUnitConfig() {
   }
 }
 
+// Build a remote temperature policy from the values on the others page: intervals in seconds, the
+// minimum change in degrees of `unit`, smoothing as the percentage weight given to past readings
+RemoteTemperatureFilter::Policy remoteTempPolicy(const float interval, const float refresh,
+                                                 const float delta, const float smoothing,
+                                                 const TempUnit unit) {
+  RemoteTemperatureFilter::Policy policy;
+  policy.minIntervalMs = static_cast<uint32_t>(std::max(interval, 0.0f) * 1000.0f);
+  // Keep refreshing well inside the window after which the remote feed counts as stale
+  policy.refreshIntervalMs = std::min(static_cast<uint32_t>(std::max(refresh, 1.0f) * 1000.0f),
+                                      CHECK_REMOTE_TEMP_INTERVAL_MS / 2);
+  const float deltaCelsius = unit == TempUnit::F ? delta * 5.0f / 9.0f : delta;
+  policy.minDeltaCenti = static_cast<int32_t>(std::max(deltaCelsius, 0.0f) * 100.0f + 0.5f);
+  policy.newReadingPercent =
+      static_cast<uint8_t>(100.0f - std::min(std::max(smoothing, 0.0f), 95.0f));
+  return policy;
+}
+
+// Build an energy model from the values on the others page, all in watts
+HeatpumpRuntime::EnergyModel energyModel(const float idle, const float compressor,
+                                         const float perHz) {
+  const auto watts = [](const float value) {
+    return static_cast<uint16_t>(std::min(std::max(value, 0.0f), 10000.0f) + 0.5f);
+  };
+  HeatpumpRuntime::EnergyModel model;
+  model.idleWatts = watts(idle);
+  model.compressorWatts = watts(compressor);
+  model.wattsPerHz = watts(perHz);
+  return model;
+}
+
 void loadOthersConfig() {
   const JsonDocument doc = FileSystem::loadJSON(others_conf);
   if (doc.isNull()) {
@@ -491,6 +760,17 @@ void loadOthersConfig() {
   config.other.safeMode = doc["safeMode"].as<String>() == "ON";
   // make optimisticUpdates default to true if it's not present in the config
   config.other.optimisticUpdates = doc["optimisticUpdates"].as<String>() != "OFF";
+  config.other.compactState = doc["compactState"].as<String>() == "ON";
+  config.other.telemetry = doc["telemetry"].as<String>() == "ON";
+  if (doc.containsKey("emIdle")) {
+    config.other.energyModel = energyModel(
+        doc["emIdle"].as<float>(), doc["emCompressor"].as<float>(), doc["emPerHz"].as<float>());
+  }
+  if (doc.containsKey("rtInterval")) {
+    config.other.remoteTemp = remoteTempPolicy(
+        doc["rtInterval"].as<float>(), doc["rtRefresh"].as<float>(), doc["rtDelta"].as<float>(),
+        doc["rtSmoothing"].as<float>(), TempUnit::C);
+  }
 }
 
 void saveMqttConfig(const Config &config) {
@@ -501,6 +781,9 @@ void saveMqttConfig(const Config &config) {
   doc["mqtt_user"] = config.mqtt.username;
   doc["mqtt_pwd"] = config.mqtt.password;
   doc["mqtt_topic"] = config.mqtt.rootTopic;
+  doc["mqtt_rt_topic"] = config.mqtt.remoteTempTopic;
+  doc["mqtt_rt_path"] = config.mqtt.remoteTempPath;
+  doc["mqtt_groups"] = config.mqtt.groups;
   FileSystem::saveJSON(mqtt_conf, doc);
 }
 
@@ -532,17 +815,78 @@ void saveOthersConfig(const Config &config) {
   doc["debugLogs"] = config.other.logToMqtt ? "ON" : "OFF";
   doc["safeMode"] = config.other.safeMode ? "ON" : "OFF";
   doc["optimisticUpdates"] = config.other.optimisticUpdates ? "ON" : "OFF";
+  doc["compactState"] = config.other.compactState ? "ON" : "OFF";
+  doc["telemetry"] = config.other.telemetry ? "ON" : "OFF";
+  doc["rtInterval"] = config.other.remoteTemp.minIntervalMs / 1000.0f;
+  doc["rtRefresh"] = config.other.remoteTemp.refreshIntervalMs / 1000.0f;
+  doc["rtDelta"] = config.other.remoteTemp.minDeltaCenti / 100.0f;
+  doc["rtSmoothing"] = 100 - config.other.remoteTemp.newReadingPercent;
+  doc["emIdle"] = config.other.energyModel.idleWatts;
+  doc["emCompressor"] = config.other.energyModel.compressorWatts;
+  doc["emPerHz"] = config.other.energyModel.wattsPerHz;
   FileSystem::saveJSON(others_conf, doc);
 }
 
+void defer(const DeferredWork work) {
+  deferredWork.fetch_or(work);
+}
+
+void deferRestart(const uint32_t delayMs) {
+  deferredRestartDelayMs = delayMs;
+  defer(DeferredWork::restart);
+}
+
+void runDeferredWork() {
+  const uint32_t work = deferredWork.exchange(0);
+  if (work == 0) {
+    return;
+  }
+  {
+    const StateLock lock;
+    if ((work & DeferredWork::saveWifi) != 0) {
+      saveWifiConfig(pendingConfig);
+    }
+    if ((work & DeferredWork::saveMqtt) != 0) {
+      saveMqttConfig(pendingConfig);
+    }
+    if ((work & DeferredWork::saveUnit) != 0) {
+      saveUnitConfig(pendingConfig);
+    }
+    if ((work & DeferredWork::saveOthers) != 0) {
+      saveOthersConfig(pendingConfig);
+    }
+  }
+  if ((work & DeferredWork::formatFilesystem) != 0) {
+    FileSystem::format();
+    // The journal went with everything else; start it again from the totals we have
+    counterJournal.compact();
+  }
+  if ((work & DeferredWork::connectHeatpump) != 0) {
+    hp.connect(&Serial);
+  }
+  if ((work & DeferredWork::disconnectMqtt) != 0 && mqtt_client.state() == MQTT_CONNECTED) {
+    mqtt_client.disconnect();
+    lastMqttRetry = Moment::now();
+  }
+  if ((work & DeferredWork::connectMqtt) != 0) {
+    mqttConnectionRetries = 0;
+    mqttConnect();
+  }
+  if ((work & DeferredWork::restart) != 0) {
+    restartAfterDelay(deferredRestartDelayMs);
+  }
+}
+
 // Initialize captive portal page
 void initCaptivePortal() {
   // Serial.println(F("Starting captive portal"));
-  server.on(F("/"), handleInitSetup);
-  server.on(F("/save"), handleSaveWifi);
-  server.on(F("/reboot"), handleReboot);
-  server.on(F("/css"), HTTPMethod::HTTP_GET,
-            []() { server.send(200, F("text/css"), statics::css); });
+  server.on("/", HTTP_ANY, handleInitSetup);
+  server.on("/save", HTTP_ANY, handleSaveWifi);
+  server.on("/reboot", HTTP_ANY, handleReboot);
+  server.on("/css", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(httpOk, "text/css", reinterpret_cast<const uint8_t *>(statics::css),
+                  strlen_P(reinterpret_cast<PGM_P>(statics::css)));
+  });
   server.onNotFound(handleNotFound);
   server.begin();
   captive = true;
@@ -599,8 +943,8 @@ bool safeModeActive() {
 }
 
 // NOLINTBEGIN(readability-named-parameter)
-void renderView(const String &view, JsonDocument &data,
-                const std::vector<std::pair<String, String>> &partials = {}) {
+String renderPage(const String &view, JsonDocument &data,
+                  const std::vector<std::pair<String, String>> &partials = {}) {
   // NOLINTEND(readability-named-parameter)
   auto header = data[F("header")].to<JsonObject>();
   header[F("hostname")] = config.network.hostname;
@@ -611,128 +955,165 @@ void renderView(const String &view, JsonDocument &data,
   footer[F("git_hash")] = F(MITSUQTT_GIT_COMMIT);
   footer[F("progname")] = F(MITSUQTT_PROGNAME);
 
-  server.send(HttpStatusCodes::httpOk, F("text/html"), ministache::render(view, data, partials));
+  return ministache::render(view, data, partials);
+}
+
+// NOLINTBEGIN(readability-named-parameter)
+void renderView(AsyncWebServerRequest *request, const String &view, JsonDocument &data,
+                const std::vector<std::pair<String, String>> &partials = {}) {
+  // NOLINTEND(readability-named-parameter)
+  request->send(HttpStatusCodes::httpOk, "text/html", renderPage(view, data, partials));
+}
+
+// Redirects that shouldn't be cached, optionally setting the session cookie on the way
+void redirect(AsyncWebServerRequest *request, const String &location, const String &cookie) {
+  AsyncWebServerResponse *response =
+      request->beginResponse(httpFound, "text/plain", "Redirecting to " + location);
+  response->addHeader(F("Location"), location);
+  response->addHeader(F("Cache-Control"), F("no-cache"));
+  if (cookie.length() > 0) {
+    response->addHeader(F("Set-Cookie"), cookie);
+  }
+  request->send(response);
 }
 
-void handleNotFound() {
+void handleNotFound(AsyncWebServerRequest *request) {
   LOG(F("handleNotFound()"));
-  server.send(HttpStatusCodes::httpNotFound, "text/plain", "Not found.");
+  request->send(HttpStatusCodes::httpNotFound, "text/plain", "Not found.");
 }
 
-void handleInitSetup() {
+void handleInitSetup(AsyncWebServerRequest *request) {
   LOG(F("handleInitSetup()"));
 
   JsonDocument data;
   data[F("hostname")] = config.network.hostname;
-  renderView(views::captive::index, data,
+  renderView(request, views::captive::index, data,
              {{"header", partials::header}, {"footer", partials::footer}});
 }
 
-void handleSaveWifi() {
-  if (!checkLogin()) {
+void handleSaveWifi(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleSaveWifi()"));
 
   // Serial.println(F("Saving wifi config"));
-  if (server.method() == HTTP_POST) {
-    config.network.accessPointSsid = server.arg("ssid");
-    config.network.accessPointPassword = server.arg("psk");
-    config.network.hostname = server.arg("hn");
-    saveWifiConfig(config);
-  }
   JsonDocument data;
-  data[F("access_point")] = config.network.accessPointSsid;
-  data[F("hostname")] = config.network.hostname;
-  renderView(views::captive::save, data,
+  {
+    const StateLock lock;
+    if (request->method() == HTTP_POST) {
+      pendingConfig.network.accessPointSsid = request->arg("ssid");
+      pendingConfig.network.accessPointPassword = request->arg("psk");
+      pendingConfig.network.hostname = request->arg("hn");
+      defer(DeferredWork::saveWifi);
+    }
+    data[F("access_point")] = pendingConfig.network.accessPointSsid;
+    data[F("hostname")] = pendingConfig.network.hostname;
+  }
+  renderView(request, views::captive::save, data,
              {{"header", partials::header}, {"footer", partials::footer}});
-  restartAfterDelay(2000);
+  deferRestart(2000);
 }
 
-void handleReboot() {
-  if (!checkLogin()) {
+void handleReboot(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleReboot()"));
 
   JsonDocument data;
-  renderView(views::captive::reboot, data,
+  renderView(request, views::captive::reboot, data,
              {{"header", partials::header}, {"footer", partials::footer}});
-  restartAfterDelay(2000);
+  deferRestart(2000);
 }
 
-void handleRoot() {
-  if (!checkLogin()) {
+void handleRoot(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleRoot()"));
 
-  if (server.hasArg("REBOOT")) {
+  if (request->hasArg("REBOOT")) {
     JsonDocument data;
-    renderView(views::reboot, data,
+    renderView(request, views::reboot, data,
                {{"header", partials::header},
                 {"footer", partials::footer},
                 {"countdown", partials::countdown}});
-    restartAfterDelay(500);
+    deferRestart(500);
   } else {
     JsonDocument data;
-    data[F("showControl")] = hp.isConnected();
+    data[F("showControl")] = hpState.isConnected();
     data[F("showLogout")] = config.unit.login_password.length() > 0;
-    renderView(views::index, data, {{"header", partials::header}, {"footer", partials::footer}});
+    renderView(request, views::index, data,
+               {{"header", partials::header}, {"footer", partials::footer}});
   }
 }
 
-void handleSetup() {
-  if (!checkLogin()) {
+void handleSetup(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleSetup()"));
 
-  if (server.hasArg("RESET")) {
+  if (request->hasArg("RESET")) {
     JsonDocument data;
     data["SSID"] = Config::Network::defaultHostname();
-    renderView(views::reset, data,
+    renderView(request, views::reset, data,
                {{"header", partials::header},
                 {"footer", partials::footer},
                 {"countdown", partials::countdown}});
-    FileSystem::format();
-    restartAfterDelay(500);
+    defer(DeferredWork::formatFilesystem);
+    deferRestart(500);
   } else {
     JsonDocument data;
-    renderView(views::setup, data, {{"header", partials::header}, {"footer", partials::footer}});
+    renderView(request, views::setup, data,
+               {{"header", partials::header}, {"footer", partials::footer}});
   }
 }
 
-void rebootAndSendPage() {
+void rebootAndSendPage(AsyncWebServerRequest *request) {
   JsonDocument data;
   data["saving"] = true;
-  renderView(views::reboot, data,
+  renderView(request, views::reboot, data,
              {{"header", partials::header},
               {"footer", partials::footer},
               {"countdown", partials::countdown}});
-  restartAfterDelay(500);
+  deferRestart(500);
 }
 
-void handleOthers() {
-  if (!checkLogin()) {
+void handleOthers(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleOthers()"));
 
-  if (server.method() == HTTP_POST) {
-    config.other.haAutodiscovery = server.arg("HAA") == "ON";
-    config.other.haAutodiscoveryTopic = server.arg("haat");
-    config.other.dumpPacketsToMqtt = server.arg("DebugPckts") == "ON";
-    config.other.logToMqtt = server.arg("DebugLogs") == "ON";
-    config.other.safeMode = server.arg("SafeMode") == "ON";
-    config.other.optimisticUpdates = server.arg("OptimisticUpdates") == "ON";
-    saveOthersConfig(config);
-    rebootAndSendPage();
+  if (request->method() == HTTP_POST) {
+    {
+      const StateLock lock;
+      Config::Other &other = pendingConfig.other;
+      other.haAutodiscovery = request->arg("HAA") == "ON";
+      other.haAutodiscoveryTopic = request->arg("haat");
+      other.dumpPacketsToMqtt = request->arg("DebugPckts") == "ON";
+      other.logToMqtt = request->arg("DebugLogs") == "ON";
+      other.safeMode = request->arg("SafeMode") == "ON";
+      other.optimisticUpdates = request->arg("OptimisticUpdates") == "ON";
+      other.compactState = request->arg("CompactState") == "ON";
+      other.telemetry = request->arg("Telemetry") == "ON";
+      other.remoteTemp = remoteTempPolicy(
+          request->arg("RtInterval").toFloat(), request->arg("RtRefresh").toFloat(),
+          request->arg("RtDelta").toFloat(), request->arg("RtSmoothing").toFloat(),
+          config.unit.tempUnit);
+      other.energyModel =
+          energyModel(request->arg("EmIdle").toFloat(), request->arg("EmCompressor").toFloat(),
+                      request->arg("EmPerHz").toFloat());
+      defer(DeferredWork::saveOthers);
+    }
+    rebootAndSendPage(request);
   } else {
     JsonDocument data;
     data[F("topic")] = config.other.haAutodiscoveryTopic;
@@ -753,6 +1134,16 @@ void handleOthers() {
     optimisticUpdates[F("name")] = F("OptimisticUpdates");
     optimisticUpdates[F("value")] = config.other.optimisticUpdates;
 
+    const auto compactState = toggles.add<JsonObject>();
+    compactState[F("title")] = F("MQTT compact state (MessagePack)");
+    compactState[F("name")] = F("CompactState");
+    compactState[F("value")] = config.other.compactState;
+
+    const auto telemetry = toggles.add<JsonObject>();
+    telemetry[F("title")] = F("MQTT telemetry stream");
+    telemetry[F("name")] = F("Telemetry");
+    telemetry[F("value")] = config.other.telemetry;
+
     const auto debugLog = toggles.add<JsonObject>();
     debugLog[F("title")] = F("MQTT topic debug logs");
     debugLog[F("name")] = F("DebugLogs");
@@ -763,28 +1154,77 @@ void handleOthers() {
     debugPackets[F("name")] = F("DebugPckts");
     debugPackets[F("value")] = config.other.dumpPacketsToMqtt;
 
+    const auto &remoteTemp = config.other.remoteTemp;
+    const auto fields = data[F("fields")].to<JsonArray>();
+    const auto interval = fields.add<JsonObject>();
+    interval[F("title")] = F("Remote temperature: minimum interval (seconds)");
+    interval[F("name")] = F("RtInterval");
+    interval[F("value")] = remoteTemp.minIntervalMs / 1000.0f;
+
+    const auto delta = fields.add<JsonObject>();
+    delta[F("title")] =
+        String(F("Remote temperature: minimum change (")) + getTemperatureScale() + F(")");
+    delta[F("name")] = F("RtDelta");
+    const float deltaCelsius = remoteTemp.minDeltaCenti / 100.0f;
+    delta[F("value")] =
+        config.unit.tempUnit == TempUnit::F ? deltaCelsius * 9.0f / 5.0f : deltaCelsius;
+
+    const auto smoothing = fields.add<JsonObject>();
+    smoothing[F("title")] = F("Remote temperature: smoothing (% weight of past readings)");
+    smoothing[F("name")] = F("RtSmoothing");
+    smoothing[F("value")] = 100 - remoteTemp.newReadingPercent;
+
+    const auto refresh = fields.add<JsonObject>();
+    refresh[F("title")] = F("Remote temperature: resend unchanged value every (seconds)");
+    refresh[F("name")] = F("RtRefresh");
+    refresh[F("value")] = remoteTemp.refreshIntervalMs / 1000.0f;
+
+    const auto &model = config.other.energyModel;
+    const auto idle = fields.add<JsonObject>();
+    idle[F("title")] = F("Energy estimate: watts while idle");
+    idle[F("name")] = F("EmIdle");
+    idle[F("value")] = model.idleWatts;
+
+    const auto compressor = fields.add<JsonObject>();
+    compressor[F("title")] = F("Energy estimate: watts while the compressor runs");
+    compressor[F("name")] = F("EmCompressor");
+    compressor[F("value")] = model.compressorWatts;
+
+    const auto perHz = fields.add<JsonObject>();
+    perHz[F("title")] = F("Energy estimate: additional watts per Hz of compressor frequency");
+    perHz[F("name")] = F("EmPerHz");
+    perHz[F("value")] = model.wattsPerHz;
+
     data[F("dumpPacketsToMqtt")] = config.other.dumpPacketsToMqtt;
     data[F("logToMqtt")] = config.other.logToMqtt;
-    renderView(views::others, data, {{"header", partials::header}, {"footer", partials::footer}});
+    renderView(request, views::others, data,
+               {{"header", partials::header}, {"footer", partials::footer}});
   }
 }
 
-void handleMqtt() {
-  if (!checkLogin()) {
+void handleMqtt(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleMqtt()"));
 
-  if (server.method() == HTTP_POST) {
-    config.mqtt.friendlyName = server.arg("fn");
-    config.mqtt.server = server.arg("mh");
-    config.mqtt.port = server.arg("ml").isEmpty() ? 1883 : server.arg("ml").toInt();
-    config.mqtt.username = server.arg("mu");
-    config.mqtt.password = server.arg("mp");
-    config.mqtt.rootTopic = server.arg("mt");
-    saveMqttConfig(config);
-    rebootAndSendPage();
+  if (request->method() == HTTP_POST) {
+    {
+      const StateLock lock;
+      Config::MQTT &mqtt = pendingConfig.mqtt;
+      mqtt.friendlyName = request->arg("fn");
+      mqtt.server = request->arg("mh");
+      mqtt.port = request->arg("ml").isEmpty() ? 1883 : request->arg("ml").toInt();
+      mqtt.username = request->arg("mu");
+      mqtt.password = request->arg("mp");
+      mqtt.rootTopic = request->arg("mt");
+      mqtt.remoteTempTopic = request->arg("mrt");
+      mqtt.remoteTempPath = request->arg("mrp");
+      mqtt.groups = request->arg("mg");
+      defer(DeferredWork::saveMqtt);
+    }
+    rebootAndSendPage(request);
   } else {
     JsonDocument data;
     auto friendlyName = data[F("friendlyName")].to<JsonObject>();
@@ -815,15 +1255,33 @@ void handleMqtt() {
     topic[F("param")] = F("mt");
     topic[F("placeholder")] = F("topic");
 
-    renderView(views::mqtt::index, data,
+    auto remoteTempTopic = data[F("remoteTempTopic")].to<JsonObject>();
+    remoteTempTopic[F("label")] = views::mqtt::remoteTempTopicLabel;
+    remoteTempTopic[F("value")] = config.mqtt.remoteTempTopic;
+    remoteTempTopic[F("param")] = F("mrt");
+    remoteTempTopic[F("placeholder")] = F("zigbee2mqtt/bedroom_sensor");
+
+    auto remoteTempPath = data[F("remoteTempPath")].to<JsonObject>();
+    remoteTempPath[F("label")] = views::mqtt::remoteTempPathLabel;
+    remoteTempPath[F("value")] = config.mqtt.remoteTempPath;
+    remoteTempPath[F("param")] = F("mrp");
+    remoteTempPath[F("placeholder")] = F("temperature");
+
+    auto groups = data[F("groups")].to<JsonObject>();
+    groups[F("label")] = views::mqtt::groupsLabel;
+    groups[F("value")] = config.mqtt.groups;
+    groups[F("param")] = F("mg");
+    groups[F("placeholder")] = F("upstairs,bedrooms");
+
+    renderView(request, views::mqtt::index, data,
                {{"mqttTextField", views::mqtt::textField},
                 {"header", partials::header},
                 {"footer", partials::footer}});
   }
 }
 
-void handleUnitGet() {
-  if (!checkLogin()) {
+void handleUnitGet(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
@@ -836,30 +1294,17 @@ void handleUnitGet() {
   data[F("temp_unit_c")] = config.unit.tempUnit == TempUnit::C;
   data[F("mode_selection_all")] = config.unit.supportHeatMode;
   data[F("login_password")] = config.unit.login_password;
-  renderView(views::unit, data, {{"header", partials::header}, {"footer", partials::footer}});
+  renderView(request, views::unit, data,
+             {{"header", partials::header}, {"footer", partials::footer}});
 }
 
-void handleUnitPost() {
-  if (!checkLogin()) {
+void handleUnitPost(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleUnitPost()"));
 
-  if (!server.arg("tu").isEmpty()) {
-    config.unit.tempUnit = server.arg("tu") == "fah" ? TempUnit::F : TempUnit::C;
-  }
-  if (!server.arg("md").isEmpty()) {
-    config.unit.supportHeatMode = server.arg("md") == "all";
-  }
-  if (server.hasArg("lpw")) {
-    // an empty value in "lpw" means we clear the password
-    config.unit.login_password = server.arg("lpw");
-  }
-  if (!server.arg("temp_step").isEmpty()) {
-    config.unit.tempStep = server.arg("temp_step");
-  }
-
   // In this POST handler, it's not entirely clear whether the min and max temp should be
   // interpreted as celsius or fahrenheit. If you change the unit on the web page, the web page
   // isn't smart enough to adjust the numeric values, so if the user just submits then there will
@@ -868,49 +1313,75 @@ void handleUnitPost() {
   //
   // We'll assume a dumb heuristic: get the values from the form, and try to figure out if they're
   // both valid celsius temps or valid fahrenheit temps.
-  if (!server.arg("min_temp").isEmpty() && !server.arg("max_temp").isEmpty()) {
-    // if both are non-empty, we're changing something
-    const auto nextMinTemp = server.arg("min_temp").toFloat();
-    const auto nextMaxTemp = server.arg("max_temp").toFloat();
-    if (nextMaxTemp < nextMinTemp) {
-      LOG(F("ERROR: min_temp > max_temp, not saving (min_temp: %f, max_temp: %f)"), nextMinTemp,
-          nextMaxTemp);
-      return;
+  // If both are non-empty, we're changing something
+  const bool changingRange =
+      !request->arg("min_temp").isEmpty() && !request->arg("max_temp").isEmpty();
+  const auto nextMinTemp = request->arg("min_temp").toFloat();
+  const auto nextMaxTemp = request->arg("max_temp").toFloat();
+  if (changingRange && nextMaxTemp < nextMinTemp) {
+    LOG(F("ERROR: min_temp > max_temp, not saving (min_temp: %f, max_temp: %f)"), nextMinTemp,
+        nextMaxTemp);
+    request->send(httpBadRequest, "text/plain", "Minimum temperature is above the maximum");
+    return;
+  }
+
+  {
+    const StateLock lock;
+    Config::Unit &unit = pendingConfig.unit;
+    if (!request->arg("tu").isEmpty()) {
+      unit.tempUnit = request->arg("tu") == "fah" ? TempUnit::F : TempUnit::C;
+    }
+    if (!request->arg("md").isEmpty()) {
+      unit.supportHeatMode = request->arg("md") == "all";
     }
-    // Both temperatures under 50 would be expected for Celsius, and not at all expected for
-    // Fahrenheit
-    TempUnit unit = (nextMinTemp < 50.0f && nextMaxTemp < 50.0f) ? TempUnit::C : TempUnit::F;
-    config.unit.minTemp = Temperature(nextMinTemp, unit);
-    config.unit.maxTemp = Temperature(nextMaxTemp, unit);
+    if (request->hasArg("lpw")) {
+      // an empty value in "lpw" means we clear the password
+      unit.login_password = request->arg("lpw");
+    }
+    if (!request->arg("temp_step").isEmpty()) {
+      unit.tempStep = request->arg("temp_step");
+    }
+    if (changingRange) {
+      // Both temperatures under 50 would be expected for Celsius, and not at all expected for
+      // Fahrenheit
+      TempUnit rangeUnit =
+          (nextMinTemp < 50.0f && nextMaxTemp < 50.0f) ? TempUnit::C : TempUnit::F;
+      unit.minTemp = Temperature(nextMinTemp, rangeUnit);
+      unit.maxTemp = Temperature(nextMaxTemp, rangeUnit);
+    }
+    defer(DeferredWork::saveUnit);
   }
-  saveUnitConfig(config);
-  rebootAndSendPage();
+  rebootAndSendPage(request);
 }
 
-void handleWifi() {
-  if (!checkLogin()) {
+void handleWifi(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
   LOG(F("handleWifi()"));
 
-  if (server.method() == HTTP_POST) {
-    config.network.accessPointSsid = server.arg("ssid");
-    config.network.accessPointPassword = server.arg("psk");
-    config.network.hostname = server.arg("hn");
-    saveWifiConfig(config);
-    rebootAndSendPage();
+  if (request->method() == HTTP_POST) {
+    {
+      const StateLock lock;
+      pendingConfig.network.accessPointSsid = request->arg("ssid");
+      pendingConfig.network.accessPointPassword = request->arg("psk");
+      pendingConfig.network.hostname = request->arg("hn");
+      defer(DeferredWork::saveWifi);
+    }
+    rebootAndSendPage(request);
   } else {
     JsonDocument data;
     data[F("access_point")] = config.network.accessPointSsid;
     data[F("hostname")] = config.network.hostname;
     data[F("password")] = config.network.accessPointPassword;
-    renderView(views::wifi, data, {{"header", partials::header}, {"footer", partials::footer}});
+    renderView(request, views::wifi, data,
+               {{"header", partials::header}, {"footer", partials::footer}});
   }
 }
 
-void handleStatus() {
-  if (!checkLogin()) {
+void handleStatus(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
   LOG(F("handleStatus()"));
@@ -929,9 +1400,10 @@ void handleStatus() {
           1000.f,
       3);
 
-  data[F("hvac_connected")] = (Serial) and hp.isConnected();
+  data[F("hvac_connected")] = (Serial) and hpState.isConnected();
   data[F("hvac_retries")] = hpConnectionTotalRetries;
-  data[F("mqtt_connected")] = mqtt_client.connected();
+  // connected() can tear down a dead socket, which is the loop's job; state() only reads
+  data[F("mqtt_connected")] = mqtt_client.state() == MQTT_CONNECTED;
   data[F("mqtt_error_code")] = mqtt_client.state();
   data[F("wifi_access_point")] = WiFi.SSID();
   data[F("wifi_signal_strength")] = WiFi.RSSI();
@@ -944,292 +1416,628 @@ void handleStatus() {
   data[F("filesystem")] = F("LittleFS");
 #endif
 
-  if (server.hasArg("mrconn")) {
-    mqttConnectionRetries = 0;
-    mqttConnect();
+  if (request->hasArg("mrconn")) {
+    defer(DeferredWork::connectMqtt);
   }
 
-  renderView(views::status, data, {{"header", partials::header}, {"footer", partials::footer}});
+  renderView(request, views::status, data,
+             {{"header", partials::header}, {"footer", partials::footer}});
 }
 
-void handleControlGet() {
-  if (!checkLogin()) {
+void handleControlGet(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
+  const StateLock lock;
   // not connected to hp, redirect to status page
-  if (!hp.isConnected()) {
-    server.sendHeader("Location", "/status");
-    server.sendHeader("Cache-Control", "no-cache");
-    server.send(httpFound);
+  if (!hpState.isConnected()) {
+    redirect(request, F("/status"));
     return;
   }
 
   LOG(F("handleControlGet()"));
 
-  HeatpumpSettings settings(hp.getSettings());
+  static VersionedCache<String> page;
+  request->send(HttpStatusCodes::httpOk, "text/html",
+                page.get(hpState.getVersion(), []() { return renderControlPage(); }));
+}
+
+String renderControlPage() {
+  const HeatpumpSettings &settings = hpState.getSettings();
   JsonDocument data;
   data[F("min_temp")] = config.unit.minTemp.toString(config.unit.tempUnit);
   data[F("max_temp")] = config.unit.maxTemp.toString(config.unit.tempUnit);
   data[F("current_temp")] =
-      Temperature(hp.getRoomTemperature(), TempUnit::C).toString(config.unit.tempUnit, 0.1f);
-  data[F("target_temp")] =
-      Temperature(hp.getTemperature(), TempUnit::C).toString(config.unit.tempUnit);
+      hpState.getStatus().roomTemperature.toString(config.unit.tempUnit, 0.1f);
+  data[F("target_temp")] = settings.temperature.toString(config.unit.tempUnit);
   data[F("temp_step")] = config.unit.tempStep;
   data[F("temp_unit")] = config.unit.tempUnit == TempUnit::C ? "C" : "F";
   data[F("supportHeatMode")] = config.unit.supportHeatMode;
-  data[F("power")] = settings.power == "ON";
+  data[F("power")] = settings.power == HeatpumpSettings::Power::on;
 
   const auto mode = data[F("mode")].to<JsonObject>();
-  mode[F("cool")] = settings.mode == "COOL";
-  mode[F("heat")] = settings.mode == "HEAT";
-  mode[F("dry")] = settings.mode == "DRY";
-  mode[F("fan")] = settings.mode == "FAN";
-  mode[F("auto")] = settings.mode == "AUTO";
+  mode[F("cool")] = settings.mode == HeatpumpSettings::Mode::cool;
+  mode[F("heat")] = settings.mode == HeatpumpSettings::Mode::heat;
+  mode[F("dry")] = settings.mode == HeatpumpSettings::Mode::dry;
+  mode[F("fan")] = settings.mode == HeatpumpSettings::Mode::fan;
+  mode[F("auto")] = settings.mode == HeatpumpSettings::Mode::automatic;
 
   const auto fan = data[F("fan")].to<JsonObject>();
-  fan[F("auto")] = settings.fan == "AUTO";
-  fan[F("quiet")] = settings.fan == "QUIET";
-  fan[F("1")] = settings.fan == "1";
-  fan[F("2")] = settings.fan == "2";
-  fan[F("3")] = settings.fan == "3";
-  fan[F("4")] = settings.fan == "4";
+  fan[F("auto")] = settings.fan == HeatpumpSettings::FanSpeed::automatic;
+  fan[F("quiet")] = settings.fan == HeatpumpSettings::FanSpeed::quiet;
+  fan[F("1")] = settings.fan == HeatpumpSettings::FanSpeed::speed1;
+  fan[F("2")] = settings.fan == HeatpumpSettings::FanSpeed::speed2;
+  fan[F("3")] = settings.fan == HeatpumpSettings::FanSpeed::speed3;
+  fan[F("4")] = settings.fan == HeatpumpSettings::FanSpeed::speed4;
 
   const auto vane = data[F("vane")].to<JsonObject>();
-  vane[F("auto")] = settings.vane == "AUTO";
-  vane[F("1")] = settings.vane == "1";
-  vane[F("2")] = settings.vane == "2";
-  vane[F("3")] = settings.vane == "3";
-  vane[F("4")] = settings.vane == "4";
-  vane[F("5")] = settings.vane == "5";
-  vane[F("swing")] = settings.vane == "SWING";
+  vane[F("auto")] = settings.vane == HeatpumpSettings::Vane::automatic;
+  vane[F("1")] = settings.vane == HeatpumpSettings::Vane::position1;
+  vane[F("2")] = settings.vane == HeatpumpSettings::Vane::position2;
+  vane[F("3")] = settings.vane == HeatpumpSettings::Vane::position3;
+  vane[F("4")] = settings.vane == HeatpumpSettings::Vane::position4;
+  vane[F("5")] = settings.vane == HeatpumpSettings::Vane::position5;
+  vane[F("swing")] = settings.vane == HeatpumpSettings::Vane::swing;
 
   const auto widevane = data[F("widevane")].to<JsonObject>();
-  widevane[F("swing")] = settings.wideVane == "SWING";
-  widevane[F("1")] = settings.wideVane == "<<";
-  widevane[F("2")] = settings.wideVane == "<";
-  widevane[F("3")] = settings.wideVane == "|";
-  widevane[F("4")] = settings.wideVane == ">";
-  widevane[F("5")] = settings.wideVane == ">>";
-  widevane[F("6")] = settings.wideVane == "<>";
-
-  // settings = change_states(settings);
-  // String controlPage = FPSTR(html_page_control);
-  // String headerContent = FPSTR(html_common_header);
-  // String footerContent = FPSTR(html_common_footer);
-  // headerContent.replace("_UNIT_NAME_", config.network.hostname);
-  // footerContent.replace("_VERSION_", F(MITSUQTT_BUILD_DATE));
-  // footerContent.replace("_GIT_HASH_", F(MITSUQTT_GIT_COMMIT));
-  // controlPage.replace("_TXT_BACK_", FPSTR(txt_back));
-  // controlPage.replace("_UNIT_NAME_", config.network.hostname);
-  // controlPage.replace("_RATE_", "60");
-  // controlPage.replace(
-  //     "_ROOMTEMP_",
-  //     Temperature(hp.getRoomTemperature(), TempUnit::C).toString(config.unit.tempUnit, 0.1f));
-  // controlPage.replace("_USE_FAHRENHEIT_", String(config.unit.tempUnit == TempUnit::F ? 1 : 0));
-  // controlPage.replace("_TEMP_SCALE_", getTemperatureScale());
-  // controlPage.replace("_HEAT_MODE_SUPPORT_", String(config.unit.supportHeatMode ? 1 : 0));
-  // controlPage.replace(F("_MIN_TEMP_"), config.unit.minTemp.toString(config.unit.tempUnit));
-  // controlPage.replace(F("_MAX_TEMP_"), config.unit.maxTemp.toString(config.unit.tempUnit));
-  // controlPage.replace(F("_TEMP_STEP_"), String(config.unit.tempStep));
-  // controlPage.replace("_TXT_CTRL_CTEMP_", FPSTR(txt_ctrl_ctemp));
-  // controlPage.replace("_TXT_CTRL_TEMP_", FPSTR(txt_ctrl_temp));
-  // controlPage.replace("_TXT_CTRL_TITLE_", FPSTR(txt_ctrl_title));
-  // controlPage.replace("_TXT_CTRL_POWER_", FPSTR(txt_ctrl_power));
-  // controlPage.replace("_TXT_CTRL_MODE_", FPSTR(txt_ctrl_mode));
-  // controlPage.replace("_TXT_CTRL_FAN_", FPSTR(txt_ctrl_fan));
-  // controlPage.replace("_TXT_CTRL_VANE_", FPSTR(txt_ctrl_vane));
-  // controlPage.replace("_TXT_CTRL_WVANE_", FPSTR(txt_ctrl_wvane));
-  // controlPage.replace("_TXT_F_ON_", FPSTR(txt_f_on));
-  // controlPage.replace("_TXT_F_OFF_", FPSTR(txt_f_off));
-  // controlPage.replace("_TXT_F_AUTO_", FPSTR(txt_f_auto));
-  // controlPage.replace("_TXT_F_HEAT_", FPSTR(txt_f_heat));
-  // controlPage.replace("_TXT_F_DRY_", FPSTR(txt_f_dry));
-  // controlPage.replace("_TXT_F_COOL_", FPSTR(txt_f_cool));
-  // controlPage.replace("_TXT_F_FAN_", FPSTR(txt_f_fan));
-  // controlPage.replace("_TXT_F_QUIET_", FPSTR(txt_f_quiet));
-  // controlPage.replace("_TXT_F_SPEED_", FPSTR(txt_f_speed));
-  // controlPage.replace("_TXT_F_SWING_", FPSTR(txt_f_swing));
-  // controlPage.replace("_TXT_F_POS_", FPSTR(txt_f_pos));
-
-  // if (settings.power == "ON") {
-  //   controlPage.replace("_POWER_ON_", "selected");
-  // } else if (settings.power == "OFF") {
-  //   controlPage.replace("_POWER_OFF_", "selected");
-  // }
+  widevane[F("swing")] = settings.wideVane == HeatpumpSettings::WideVane::swing;
+  widevane[F("1")] = settings.wideVane == HeatpumpSettings::WideVane::farLeft;
+  widevane[F("2")] = settings.wideVane == HeatpumpSettings::WideVane::left;
+  widevane[F("3")] = settings.wideVane == HeatpumpSettings::WideVane::center;
+  widevane[F("4")] = settings.wideVane == HeatpumpSettings::WideVane::right;
+  widevane[F("5")] = settings.wideVane == HeatpumpSettings::WideVane::farRight;
+  widevane[F("6")] = settings.wideVane == HeatpumpSettings::WideVane::split;
 
-  // if (settings.mode == "HEAT") {
-  //   controlPage.replace("_MODE_H_", "selected");
-  // } else if (settings.mode == "DRY") {
-  //   controlPage.replace("_MODE_D_", "selected");
-  // } else if (settings.mode == "COOL") {
-  //   controlPage.replace("_MODE_C_", "selected");
-  // } else if (settings.mode == "FAN") {
-  //   controlPage.replace("_MODE_F_", "selected");
-  // } else if (settings.mode == "AUTO") {
-  //   controlPage.replace("_MODE_A_", "selected");
-  // }
+  return renderPage(views::control, data,
+                    {{"header", partials::header}, {"footer", partials::footer}});
+}
 
-  // if (settings.fan == "AUTO") {
-  //   controlPage.replace("_FAN_A_", "selected");
-  // } else if (settings.fan == "QUIET") {
-  //   controlPage.replace("_FAN_Q_", "selected");
-  // } else if (settings.fan == "1") {
-  //   controlPage.replace("_FAN_1_", "selected");
-  // } else if (settings.fan == "2") {
-  //   controlPage.replace("_FAN_2_", "selected");
-  // } else if (settings.fan == "3") {
-  //   controlPage.replace("_FAN_3_", "selected");
-  // } else if (settings.fan == "4") {
-  //   controlPage.replace("_FAN_4_", "selected");
-  // }
+// Fields are named after the control form's inputs so the page can apply them directly. Without
+// `previous` every field is included.
+void addControlState(JsonDocument &doc, const HeatpumpSettings *previous,
+                     const int16_t previousRoomCenti) {
+  const HeatpumpSettings &settings = hpState.getSettings();
+  const Temperature &room = hpState.getStatus().roomTemperature;
+  if (previous == nullptr || room.getCentiCelsius() != previousRoomCenti) {
+    doc[F("current_temp")] = room.toString(config.unit.tempUnit, 0.1f);
+  }
+  if (previous == nullptr || settings.temperature != previous->temperature) {
+    doc[F("TEMP")] = settings.temperature.toString(config.unit.tempUnit);
+  }
+  if (previous == nullptr || settings.power != previous->power) {
+    doc[F("POWER")] = heatpump::toProtocol(settings.power);
+  }
+  if (previous == nullptr || settings.mode != previous->mode) {
+    doc[F("MODE")] = heatpump::toProtocol(settings.mode);
+  }
+  if (previous == nullptr || settings.fan != previous->fan) {
+    doc[F("FAN")] = heatpump::toProtocol(settings.fan);
+  }
+  if (previous == nullptr || settings.vane != previous->vane) {
+    doc[F("VANE")] = heatpump::toProtocol(settings.vane);
+  }
+  if (previous == nullptr || settings.wideVane != previous->wideVane) {
+    doc[F("WIDEVANE")] = heatpump::toProtocol(settings.wideVane);
+  }
+}
 
-  // controlPage.replace("_VANE_V_", settings.vane);
-  // if (settings.vane == "AUTO") {
-  //   controlPage.replace("_VANE_A_", "selected");
-  // } else if (settings.vane == "1") {
-  //   controlPage.replace("_VANE_1_", "selected");
-  // } else if (settings.vane == "2") {
-  //   controlPage.replace("_VANE_2_", "selected");
-  // } else if (settings.vane == "3") {
-  //   controlPage.replace("_VANE_3_", "selected");
-  // } else if (settings.vane == "4") {
-  //   controlPage.replace("_VANE_4_", "selected");
-  // } else if (settings.vane == "5") {
-  //   controlPage.replace("_VANE_5_", "selected");
-  // } else if (settings.vane == "SWING") {
-  //   controlPage.replace("_VANE_S_", "selected");
-  // }
+// The first event a new /events subscriber gets: every field
+String renderStateEvent() {
+  const StateLock lock;
+  JsonDocument doc;
+  addControlState(doc, nullptr, 0);
+  String payload;
+  serializeJson(doc, payload);
+  return payload;
+}
 
-  // controlPage.replace("_WIDEVANE_V_", settings.wideVane);
-  // if (settings.wideVane == "<<") {
-  //   controlPage.replace("_WVANE_1_", "selected");
-  // } else if (settings.wideVane == "<") {
-  //   controlPage.replace("_WVANE_2_", "selected");
-  // } else if (settings.wideVane == "|") {
-  //   controlPage.replace("_WVANE_3_", "selected");
-  // } else if (settings.wideVane == ">") {
-  //   controlPage.replace("_WVANE_4_", "selected");
-  // } else if (settings.wideVane == ">>") {
-  //   controlPage.replace("_WVANE_5_", "selected");
-  // } else if (settings.wideVane == "<>") {
-  //   controlPage.replace("_WVANE_6_", "selected");
-  // } else if (settings.wideVane == "SWING") {
-  //   controlPage.replace("_WVANE_S_", "selected");
-  // }
-  // controlPage.replace("_TEMP_",
-  //                     Temperature(hp.getTemperature(),
-  //                     TempUnit::C).toString(config.unit.tempUnit));
-
-  // // We need to send the page content in chunks to overcome
-  // // a limitation on the maximum size we can send at one
-  // // time (approx 6k).
-  // server.setContentLength(CONTENT_LENGTH_UNKNOWN);
-  // server.send(HttpStatusCodes::httpOk, "text/html", headerContent);
-  // server.sendContent(controlPage);
-  // server.sendContent(footerContent);
-  // // Signal the end of the content
-  // server.sendContent("");
-  renderView(views::control, data, {{"header", partials::header}, {"footer", partials::footer}});
-}
-
-void handleControlPost() {
-  if (!checkLogin()) {
+// Push whatever changed in the snapshot since the last event. The baseline moves even when nobody
+// is listening, so a new subscriber's full state and later deltas line up.
+void publishStateEvents() {
+  Events::maintain();
+  if (hpState.getVersion() == eventVersion) {
+    return;
+  }
+  if (Events::subscriberCount() > 0) {
+    JsonDocument doc;
+    addControlState(doc, &eventSettings, eventRoomCenti);
+    if (doc.size() > 0) {
+      String payload;
+      serializeJson(doc, payload);
+      Events::broadcast("state", payload);
+    }
+  }
+  eventVersion = hpState.getVersion();
+  eventSettings = hpState.getSettings();
+  eventRoomCenti = hpState.getStatus().roomTemperature.getCentiCelsius();
+}
+
+void handleControlPost(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
+  const StateLock lock;
   // not connected to hp, redirect to status page
-  if (!hp.isConnected()) {
-    server.sendHeader("Location", "/status");
-    server.sendHeader("Cache-Control", "no-cache");
-    server.send(httpFound);
+  if (!hpState.isConnected()) {
+    redirect(request, F("/status"));
     return;
   }
 
   LOG(F("handleControlPost()"));
 
-  // Apply changes and try to flush them
-  HeatpumpSettings settings(hp.getSettings());
-  settings = change_states(settings);
-  hp.sync();
-
-  server.send(httpOk);
+  // The loop picks the changes up from the reconciler on its next pass
+  change_states(request);
+  request->send(httpOk);
 }
 
-void handleMetrics() {
+void handleMetrics(AsyncWebServerRequest *request) {
   LOG(F("handleMetrics()"));
 
-  const HeatpumpSettings currentSettings(hp.getSettings());
-  const HeatpumpStatus currentStatus(hp.getStatus());
+  // The heat pump gauges only change with the snapshot, but the counters move all the time, so
+  // they're rendered separately and sent after the cached part
+  static VersionedCache<String> metrics;
+  AsyncResponseStream *response = request->beginResponseStream("text/plain");
+  {
+    const StateLock lock;
+    response->print(metrics.get(hpState.getVersion(), []() { return renderMetrics(); }));
+  }
+  response->print(renderCounters());
+  request->send(response);
+}
+
+// Seconds rather than milliseconds, since that's what Prometheus and Home Assistant expect
+void addRuntimeTotals(const JsonObject &runtimeTotals, const HeatpumpRuntime::Totals &totals) {
+  runtimeTotals[F("poweredSeconds")] = totals.poweredMs / 1000.0;
+  runtimeTotals[F("compressorSeconds")] = totals.compressorMs / 1000.0;
+  runtimeTotals[F("compressorStarts")] = totals.compressorStarts;
+  runtimeTotals[F("energyKWh")] = totals.energyKWh();
+  auto modes = runtimeTotals[F("modeSeconds")].to<JsonObject>();
+  for (const auto &entry : heatpump::Codec<heatpump::Mode>::entries) {
+    modes[entry.homeAssistant] = totals.modeMsFor(entry.value) / 1000.0;
+  }
+}
+
+// Buckets as Prometheus wants them: cumulative, with the last one for everything
+template <size_t Buckets>
+void addHistogram(const JsonObject &target, const Histogram<Buckets> &histogram) {
+  auto buckets = target[F("buckets")].to<JsonArray>();
+  for (size_t idx = 0; idx <= Buckets; idx++) {
+    auto bucket = buckets.add<JsonObject>();
+    if (idx < Buckets) {
+      bucket[F("le")] = histogram.bound(idx);
+    } else {
+      bucket[F("le")] = F("+Inf");
+    }
+    bucket[F("count")] = histogram.cumulative(idx);
+  }
+  target[F("count")] = histogram.count();
+  target[F("sum")] = histogram.getSum();
+  target[F("max")] = histogram.max();
+}
+
+// Call with StateLock held: the serial callback updates these from inside hp.sync()
+void addLinkStats(const JsonObject &link) {
+  const auto &linkStats = hpLink.getStats();
+  const std::array<const char *, HeatpumpLinkStats::typeCount> typeNames = {"connect", "set",
+                                                                            "info", "other"};
+  auto sent = link[F("sent")].to<JsonObject>();
+  auto received = link[F("received")].to<JsonObject>();
+  for (size_t type = 0; type < HeatpumpLinkStats::typeCount; type++) {
+    const auto packetType = static_cast<HeatpumpLinkStats::PacketType>(type);
+    sent[typeNames[type]] = linkStats.packetsOf(HeatpumpLinkStats::Direction::sent, packetType);
+    received[typeNames[type]] =
+        linkStats.packetsOf(HeatpumpLinkStats::Direction::received, packetType);
+  }
+  link[F("malformed")] = linkStats.malformed;
+  link[F("checksumErrors")] = linkStats.checksumErrors;
+  link[F("timeouts")] = linkStats.timeouts;
+  link[F("unsolicited")] = linkStats.unsolicited;
+  link[F("retries")] = hpConnectionTotalRetries;
+  addHistogram(link[F("latencyMs")].to<JsonObject>(), hpLink.getLatency());
+  addHistogram(link[F("syncIntervalMs")].to<JsonObject>(), hpLink.getSyncInterval());
+}
+
+// Counters are single words, so relaxed stores are enough: a reader may catch a mix of two passes,
+// but never a torn value
+void snapshotQueueCounters() {
+  const auto store = [](std::atomic<uint32_t> &counter, const uint32_t value) {
+    counter.store(value, std::memory_order_relaxed);
+  };
+  const auto &queueStats = hpCommands.getStats();
+  store(queueCounters.commands.depth, hpCommands.size());
+  store(queueCounters.commands.highWater, queueStats.highWater);
+  store(queueCounters.commands.queued, queueStats.queued);
+  store(queueCounters.commands.replaced, queueStats.replaced);
+  store(queueCounters.commands.overflowed, queueStats.overflowed);
+  store(queueCounters.commands.dispatched, queueStats.dispatched);
+
+  const auto &outboxStats = mqttOutbox.getStats();
+  store(queueCounters.outbox.depth, mqttOutbox.size());
+  store(queueCounters.outbox.bytes, mqttOutbox.bytesQueued());
+  store(queueCounters.outbox.highWater, outboxStats.highWater);
+  store(queueCounters.outbox.queued, outboxStats.queued);
+  store(queueCounters.outbox.coalesced, outboxStats.coalesced);
+  store(queueCounters.outbox.published, outboxStats.published);
+  store(queueCounters.outbox.failed, outboxStats.failed);
+  for (size_t kind = 0; kind < MqttOutbox::kindCount; kind++) {
+    store(queueCounters.outbox.dropped[kind], outboxStats.dropped[kind]);
+  }
+
+  const auto &remoteTempStats = remoteTempFilter.getStats();
+  store(queueCounters.remoteTemp.received, remoteTempStats.received);
+  store(queueCounters.remoteTemp.forwarded, remoteTempStats.forwarded);
+  store(queueCounters.remoteTemp.refreshed, remoteTempStats.refreshed);
+}
+
+String renderCounters() {
+  JsonDocument data;
+  data["unit_name"] = config.network.hostname;
+
+  const auto load = [](const std::atomic<uint32_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  auto queue = data["queue"].to<JsonObject>();
+  queue["depth"] = load(queueCounters.commands.depth);
+  queue["highWater"] = load(queueCounters.commands.highWater);
+  queue["queued"] = load(queueCounters.commands.queued);
+  queue["replaced"] = load(queueCounters.commands.replaced);
+  queue["overflowed"] = load(queueCounters.commands.overflowed);
+  queue["dispatched"] = load(queueCounters.commands.dispatched);
+
+  auto outbox = data["outbox"].to<JsonObject>();
+  outbox["depth"] = load(queueCounters.outbox.depth);
+  outbox["bytes"] = load(queueCounters.outbox.bytes);
+  outbox["highWater"] = load(queueCounters.outbox.highWater);
+  outbox["queued"] = load(queueCounters.outbox.queued);
+  outbox["coalesced"] = load(queueCounters.outbox.coalesced);
+  outbox["published"] = load(queueCounters.outbox.published);
+  outbox["failed"] = load(queueCounters.outbox.failed);
+  const auto dropped = [&](const MqttOutbox::Kind kind) {
+    return load(queueCounters.outbox.dropped[static_cast<size_t>(kind)]);
+  };
+  auto droppedByKind = outbox["dropped"].to<JsonObject>();
+  droppedByKind["state"] = dropped(MqttOutbox::Kind::state);
+  droppedByKind["availability"] = dropped(MqttOutbox::Kind::availability);
+  droppedByKind["ack"] = dropped(MqttOutbox::Kind::ack);
+  droppedByKind["log"] = dropped(MqttOutbox::Kind::log);
+  droppedByKind["telemetry"] = dropped(MqttOutbox::Kind::telemetry);
+  droppedByKind["debugPacket"] = dropped(MqttOutbox::Kind::debugPacket);
+
+  auto remoteTemp = data["remoteTemp"].to<JsonObject>();
+  remoteTemp["received"] = load(queueCounters.remoteTemp.received);
+  remoteTemp["forwarded"] = load(queueCounters.remoteTemp.forwarded);
+  remoteTemp["refreshed"] = load(queueCounters.remoteTemp.refreshed);
+
+  // The runtime totals, link stats and command latencies are updated under the lock, so read them
+  // all in one go; rendering can wait
+  {
+    const StateLock lock;
+    addRuntimeTotals(data[F("runtime")].to<JsonObject>(), hpRuntime.getTotals());
+    addLinkStats(data[F("link")].to<JsonObject>());
+    auto commands = data[F("commands")].to<JsonObject>();
+    commands[F("unconfirmed")] = hpReconciler.getStats().unconfirmed;
+    addHistogram(commands[F("latencyMs")].to<JsonObject>(), hpReconciler.getLatency());
+  }
+
+  return ministache::render(views::counters, data);
+}
+
+String renderMetrics() {
+  const HeatpumpSettings &currentSettings = hpState.getSettings();
+  const HeatpumpStatus &currentStatus = hpState.getStatus();
   ArduinoJson::JsonDocument data;
   data["unit_name"] = config.network.hostname;
   data["version"] = F(MITSUQTT_BUILD_DATE);
   data["git_hash"] = F(MITSUQTT_GIT_COMMIT);
-  data["power"] = currentSettings.power == "ON" ? 1 : 0;
-  data["roomtemp"] = currentStatus.roomTemperature.toString(TempUnit::C);
-  data["temp"] = currentSettings.temperature.toString(TempUnit::C);
+  data["power"] = heatpump::toMetric(currentSettings.power);
+  // Format into stack buffers: char arrays are copied into the document, no String needed
+  std::array<char, Temperature::maxChars> roomTemp;
+  currentStatus.roomTemperature.toChars(roomTemp.data(), roomTemp.size(), TempUnit::C);
+  data["roomtemp"] = roomTemp.data();
+  std::array<char, Temperature::maxChars> temp;
+  currentSettings.temperature.toChars(temp.data(), temp.size(), TempUnit::C);
+  data["temp"] = temp.data();
   data["oper"] = currentStatus.operating ? 1 : 0;
   data["compfreq"] = currentStatus.compressorFrequency;
 
-  data["fan"] = currentSettings.fan;
-  if (currentSettings.fan == "AUTO") {  // NOLINT(bugprone-branch-clone) false positive
-    data["fan"] = "-1";
-  } else if (currentSettings.fan == "QUIET") {
-    data["fan"] = "0";
-  }
-
-  data["vane"] = currentSettings.vane;
-  if (currentSettings.vane == "AUTO") {  // NOLINT(bugprone-branch-clone) false positive
-    data["vane"] = "-1";
-  } else if (currentSettings.vane == "SWING") {
-    data["vane"] = "0";
-  }
-
-  if (currentSettings.wideVane == "SWING") {  // NOLINT(bugprone-branch-clone) false positive
-    data["widevane"] = "0";
-  } else if (currentSettings.wideVane == "<<") {
-    data["widevane"] = "1";
-  } else if (currentSettings.wideVane == "<") {
-    data["widevane"] = "2";
-  } else if (currentSettings.wideVane == "|") {
-    data["widevane"] = "3";
-  } else if (currentSettings.wideVane == ">") {
-    data["widevane"] = "4";
-  } else if (currentSettings.wideVane == ">>") {
-    data["widevane"] = "5";
-  } else if (currentSettings.wideVane == "<>") {
-    data["widevane"] = "6";
-  } else {
-    data["widevane"] = "-2";
-  }
-
-  if (currentSettings.mode == "AUTO") {  // NOLINT(bugprone-branch-clone) false positive
-    data["mode"] = "-1";
-  } else if (currentSettings.mode == "COOL") {
-    data["mode"] = "1";
-  } else if (currentSettings.mode == "DRY") {
-    data["mode"] = "2";
-  } else if (currentSettings.mode == "HEAT") {
-    data["mode"] = "3";
-  } else if (currentSettings.mode == "FAN") {
-    data["mode"] = "4";
-  } else if (data["power"] == "0") {
-    data["mode"] = "0";
-  } else {
-    data["mode"] = "-2";
+  data["fan"] = heatpump::toMetric(currentSettings.fan);
+  data["vane"] = heatpump::toMetric(currentSettings.vane);
+  data["widevane"] = heatpump::toMetric(currentSettings.wideVane);
+  data["mode"] = heatpump::toMetric(currentSettings.mode);
+
+  return ministache::render(views::metrics, data);
+}
+
+void handleMetricsJson(AsyncWebServerRequest *request) {
+  // The safe mode lockout depends on the clock rather than the heat pump, so it's part of the key
+  const StateLock lock;
+  const bool lockout = safeModeActive();
+  static VersionedCache<String> metrics;
+  const String &cached = metrics.get(hpState.getVersion() * 2 + (lockout ? 1 : 0),
+                                     [lockout]() { return renderMetricsJson(lockout); });
+
+  // The serial link and command counters move all the time, so like /metrics they're rendered
+  // fresh, and their members spliced in ahead of the cached document's closing brace
+  JsonDocument live;
+  addLinkStats(live[F("serialLink")].to<JsonObject>());
+  auto commands = live[F("commands")].to<JsonObject>();
+  commands[F("unconfirmed")] = hpReconciler.getStats().unconfirmed;
+  addHistogram(commands[F("latencyMs")].to<JsonObject>(), hpReconciler.getLatency());
+  String members;
+  serializeJson(live, members);
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->write(reinterpret_cast<const uint8_t *>(cached.c_str()), cached.length() - 1);
+  response->print(',');
+  response->print(members.c_str() + 1);
+  request->send(response);
+}
+
+// API clients can't follow the login redirect, so they get a plain 401 instead
+bool checkApiLogin(AsyncWebServerRequest *request) {
+  if (!isAuthorized(request)) {
+    sendApiError(request, httpUnauthorized, F("login required"));
+    return false;
   }
+  return true;
+}
 
-  server.send(HttpStatusCodes::httpOk, F("text/plain"), ministache::render(views::metrics, data));
+void sendApiError(AsyncWebServerRequest *request, const int code, const String &message) {
+  JsonDocument doc;
+  doc[F("error")] = message;
+  String payload;
+  serializeJson(doc, payload);
+  request->send(code, "application/json", payload);
 }
 
-void handleMetricsJson() {
+void handleApiState(AsyncWebServerRequest *request) {
+  if (!checkApiLogin(request)) {
+    return;
+  }
+  const StateLock lock;
+  static VersionedCache<ApiState> state;
+  const ApiState &current = state.get(hpState.getVersion(), []() { return renderApiState(); });
+  AsyncWebServerResponse *response =
+      request->header("If-None-Match") == current.etag
+          ? request->beginResponse(httpNotModified)
+          : request->beginResponse(httpOk, "application/json", current.body);
+  response->addHeader(F("ETag"), current.etag);
+  response->addHeader(F("Cache-Control"), F("no-cache"));
+  request->send(response);
+}
+
+// The ETag is a hash of the body rather than the snapshot version, which restarts at every boot
+ApiState renderApiState() {
+  const HeatpumpSettings &settings = hpState.getSettings();
+  const HeatpumpStatus &status = hpState.getStatus();
+  JsonDocument doc;
+  doc[F("connected")] = hpState.isConnected();
+  doc[F("unit")] = config.unit.tempUnit == TempUnit::C ? "C" : "F";
+  doc[F("power")] = heatpump::toProtocol(settings.power);
+  doc[F("mode")] = heatpump::toProtocol(settings.mode);
+  doc[F("temp")] = settings.temperature.get(config.unit.tempUnit, 0.5f);
+  doc[F("fan")] = heatpump::toProtocol(settings.fan);
+  doc[F("vane")] = heatpump::toProtocol(settings.vane);
+  doc[F("wideVane")] = heatpump::toProtocol(settings.wideVane);
+  doc[F("roomTemp")] = status.roomTemperature.get(config.unit.tempUnit, 0.1f);
+  doc[F("operating")] = status.operating;
+  doc[F("compressorFrequency")] = status.compressorFrequency;
+
+  ApiState state;
+  serializeJson(doc, state.body);
+  const uint32_t hash = fnv1a(state.body);
+  char etag[11];
+  snprintf(etag, sizeof(etag), "\"%08x\"", static_cast<unsigned>(hash));
+  state.etag = etag;
+  return state;
+}
+
+// 32-bit FNV-1a: cheap, and good enough to tell one payload from another
+uint32_t fnv1a(const String &text) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < text.length(); i++) {
+    hash = (hash ^ static_cast<uint8_t>(text[i])) * 16777619UL;
+  }
+  return hash;
+}
+
+// Only names the codec maps back to themselves are accepted, so a typo can't fall through to the
+// codec's fallback value (which, for power, is "off")
+template <typename Value>
+bool parseSettingValue(const JsonVariantConst value, Value &parsed) {
+  const char *name = value.as<const char *>();
+  if (name == nullptr) {
+    return false;
+  }
+  parsed = heatpump::fromProtocol<Value>(name);
+  return strcasecmp(heatpump::toProtocol(parsed), name) == 0;
+}
+
+// /api/control speaks the /api/state dialect; the MQTT set topic takes the same values as the
+// per-field topics
+const SettingsDialect apiSettingsDialect{
+    .temperatureKey = "temp", .homeAssistantModes = false, .clampTemperature = false};
+const SettingsDialect mqttSettingsDialect{
+    .temperatureKey = "temperature", .homeAssistantModes = true, .clampTemperature = true};
+
+// Checks one field of a batch of settings and merges it into `command`. Returns false for a field
+// it doesn't know or a value it can't take, so callers can check the whole batch before applying
+// any of it.
+bool parseSettingsField(const char *key, const JsonVariantConst value,
+                        const SettingsDialect &dialect, SettingsCommand &command) {
+  HeatpumpSettings &settings = command.settings;
+  if (strcmp(key, "power") == 0) {
+    if (value.is<bool>()) {
+      settings.power =
+          value.as<bool>() ? HeatpumpSettings::Power::on : HeatpumpSettings::Power::off;
+    } else if (!parseSettingValue(value, settings.power)) {
+      return false;
+    }
+    command.fields |= HeatpumpReconciler::Field::power;
+    return true;
+  }
+  if (strcmp(key, "mode") == 0) {
+    HeatpumpSettings::Mode mode = HeatpumpSettings::Mode::unknown;
+    if (dialect.homeAssistantModes) {
+      // Home Assistant folds power into the mode: "off" is the power, and any other mode turns
+      // the unit on
+      const char *const name = value.as<const char *>();
+      if (name != nullptr && strcasecmp(name, "off") == 0) {
+        settings.power = HeatpumpSettings::Power::off;
+        command.fields |= HeatpumpReconciler::Field::power;
+        return true;
+      }
+      mode = heatpump::fromHomeAssistant<HeatpumpSettings::Mode>(name);
+    } else if (!parseSettingValue(value, mode)) {
+      return false;
+    }
+    if (mode == HeatpumpSettings::Mode::unknown ||
+        (mode == HeatpumpSettings::Mode::heat && !config.unit.supportHeatMode)) {
+      return false;
+    }
+    settings.mode = mode;
+    command.fields |= HeatpumpReconciler::Field::mode;
+    if (dialect.homeAssistantModes) {
+      settings.power = HeatpumpSettings::Power::on;
+      command.fields |= HeatpumpReconciler::Field::power;
+    }
+    return true;
+  }
+  if (strcmp(key, dialect.temperatureKey) == 0) {
+    if (!value.is<float>()) {
+      return false;
+    }
+    const Temperature temperature(value.as<float>(), config.unit.tempUnit);
+    if (dialect.clampTemperature) {
+      settings.temperature = temperature.clamp(config.unit.minTemp, config.unit.maxTemp);
+    } else if (temperature.getCentiCelsius() < config.unit.minTemp.getCentiCelsius() ||
+               temperature.getCentiCelsius() > config.unit.maxTemp.getCentiCelsius()) {
+      return false;
+    } else {
+      settings.temperature = temperature;
+    }
+    command.fields |= HeatpumpReconciler::Field::temperature;
+    return true;
+  }
+  if (strcmp(key, "fan") == 0) {
+    if (!parseSettingValue(value, settings.fan)) {
+      return false;
+    }
+    command.fields |= HeatpumpReconciler::Field::fan;
+    return true;
+  }
+  if (strcmp(key, "vane") == 0) {
+    if (!parseSettingValue(value, settings.vane)) {
+      return false;
+    }
+    command.fields |= HeatpumpReconciler::Field::vane;
+    return true;
+  }
+  if (strcmp(key, "wideVane") == 0) {
+    if (!parseSettingValue(value, settings.wideVane)) {
+      return false;
+    }
+    command.fields |= HeatpumpReconciler::Field::wideVane;
+    return true;
+  }
+  return false;
+}
+
+// Copies the fields set in `command` over `target`
+void mergeSettings(HeatpumpSettings &target, const SettingsCommand &command) {
+  const HeatpumpSettings &settings = command.settings;
+  if ((command.fields & HeatpumpReconciler::Field::power) != 0) {
+    target.power = settings.power;
+  }
+  if ((command.fields & HeatpumpReconciler::Field::mode) != 0) {
+    target.mode = settings.mode;
+  }
+  if ((command.fields & HeatpumpReconciler::Field::temperature) != 0) {
+    target.temperature = settings.temperature;
+  }
+  if ((command.fields & HeatpumpReconciler::Field::fan) != 0) {
+    target.fan = settings.fan;
+  }
+  if ((command.fields & HeatpumpReconciler::Field::vane) != 0) {
+    target.vane = settings.vane;
+  }
+  if ((command.fields & HeatpumpReconciler::Field::wideVane) != 0) {
+    target.wideVane = settings.wideVane;
+  }
+}
+
+// Hands the fields set in `command` to the reconciler, which folds them into a single write
+void applySettings(const SettingsCommand &command) {
+  const Moment now = Moment::now();
+  const HeatpumpSettings &settings = command.settings;
+  if ((command.fields & HeatpumpReconciler::Field::power) != 0) {
+    hpReconciler.setPower(settings.power, now);
+  }
+  if ((command.fields & HeatpumpReconciler::Field::mode) != 0) {
+    hpReconciler.setMode(settings.mode, now);
+  }
+  if ((command.fields & HeatpumpReconciler::Field::temperature) != 0) {
+    hpReconciler.setTemperature(settings.temperature, now);
+  }
+  if ((command.fields & HeatpumpReconciler::Field::fan) != 0) {
+    hpReconciler.setFan(settings.fan, now);
+  }
+  if ((command.fields & HeatpumpReconciler::Field::vane) != 0) {
+    hpReconciler.setVane(settings.vane, now);
+  }
+  if ((command.fields & HeatpumpReconciler::Field::wideVane) != 0) {
+    hpReconciler.setWideVane(settings.wideVane, now);
+  }
+}
+
+// Takes any subset of the fields /api/state reports as settings, all or nothing: every field is
+// checked before any is applied, and the reconciler folds the lot into a single write
+void handleApiControl(AsyncWebServerRequest *request, JsonVariant &json) {
+  if (!checkApiLogin(request)) {
+    return;
+  }
+  if (!json.is<JsonObject>()) {
+    sendApiError(request, httpBadRequest, F("expected a JSON object"));
+    return;
+  }
+  const StateLock lock;
+  if (!hpState.isConnected()) {
+    sendApiError(request, httpServiceUnavailable, F("heat pump not connected"));
+    return;
+  }
+
+  const JsonObjectConst fields = json.as<JsonObjectConst>();
+  SettingsCommand command{.settings = hpState.getSettings()};
+  for (const JsonPairConst field : fields) {
+    if (!parseSettingsField(field.key().c_str(), field.value(), apiSettingsDialect, command)) {
+      sendApiError(request, httpBadRequest, String(F("invalid field: ")) + field.key().c_str());
+      return;
+    }
+  }
+
+  LOG(F("handleApiControl()"));
+  // The loop picks the changes up from the reconciler on its next pass
+  applySettings(command);
+  JsonDocument response;
+  const JsonArray accepted = response[F("accepted")].to<JsonArray>();
+  for (const JsonPairConst field : fields) {
+    accepted.add(field.key().c_str());
+  }
+
+  String payload;
+  serializeJson(response, payload);
+  request->send(httpAccepted, "application/json", payload);
+}
+
+String renderMetricsJson(const bool safeModeLockout) {
   JsonDocument doc;
   doc[F("hostname")] = config.network.hostname;
   doc[F("version")] = F(MITSUQTT_BUILD_DATE);
   doc[F("git_hash")] = F(MITSUQTT_GIT_COMMIT);
 
   auto systemStatus = doc[F("status")].to<JsonObject>();
-  systemStatus[F("safeModeLockout")] = safeModeActive();
+  systemStatus[F("safeModeLockout")] = safeModeLockout;
 
   // auto mallocStats = mallinfo();
   // doc[F("memory")] = JsonObject();
@@ -1239,57 +2047,148 @@ void handleMetricsJson() {
   // mallocStats.fordblks);
 
   auto heatpump = doc[F("heatpump")].to<JsonObject>();
-  heatpump[F("connected")] = hp.isConnected();
-  if (hp.isConnected()) {
-    const HeatpumpStatus currentStatus(hp.getStatus());
+  heatpump[F("connected")] = hpState.isConnected();
+  if (hpState.isConnected()) {
+    const HeatpumpStatus &currentStatus = hpState.getStatus();
     auto status = heatpump[F("status")].to<JsonObject>();
     status[F("compressorFrequency")] = currentStatus.compressorFrequency;
     status[F("operating")] = currentStatus.operating;
-    status[F("roomTemperature_F")] = currentStatus.roomTemperature.toString(TempUnit::F, 0.1f);
-    status[F("roomTemperature")] = currentStatus.roomTemperature.toString(TempUnit::C, 0.1f);
+    std::array<char, Temperature::maxChars> buffer;
+    currentStatus.roomTemperature.toChars(buffer.data(), buffer.size(), TempUnit::F, 0.1f);
+    status[F("roomTemperature_F")] = buffer.data();
+    currentStatus.roomTemperature.toChars(buffer.data(), buffer.size(), TempUnit::C, 0.1f);
+    status[F("roomTemperature")] = buffer.data();
 
-    const HeatpumpSettings currentSettings(hp.getSettings());
+    const HeatpumpSettings &currentSettings = hpState.getSettings();
     auto settings = heatpump[F("settings")].to<JsonObject>();
     settings[F("connected")] = currentSettings.connected;
-    settings[F("fan")] = currentSettings.fan;
+    settings[F("fan")] = heatpump::toProtocol(currentSettings.fan);
     settings[F("iSee")] = currentSettings.iSee;
-    settings[F("mode")] = currentSettings.mode;
-    settings[F("power")] = currentSettings.power;
-    settings[F("temperature_F")] = currentSettings.temperature.toString(TempUnit::F, 0.1f);
-    settings[F("temperature")] = currentSettings.temperature.toString(TempUnit::C, 0.1f);
-    settings[F("vane")] = currentSettings.vane;
-    settings[F("wideVane")] = currentSettings.wideVane;
+    settings[F("mode")] = heatpump::toProtocol(currentSettings.mode);
+    settings[F("power")] = heatpump::toProtocol(currentSettings.power);
+    currentSettings.temperature.toChars(buffer.data(), buffer.size(), TempUnit::F, 0.1f);
+    settings[F("temperature_F")] = buffer.data();
+    currentSettings.temperature.toChars(buffer.data(), buffer.size(), TempUnit::C, 0.1f);
+    settings[F("temperature")] = buffer.data();
+    settings[F("vane")] = heatpump::toProtocol(currentSettings.vane);
+    settings[F("wideVane")] = heatpump::toProtocol(currentSettings.wideVane);
   }
 
   String response;
   serializeJsonPretty(doc, response);
-  server.send(HttpStatusCodes::httpOk, F("application/json"), response);
+  return response;
+}
+
+// Stream the history ring as JSON: {"interval": seconds between samples, "age": seconds since the
+// newest one, "unit": "C" or "F", "samples": [[room, target, compressor frequency, operating],
+// ...]}, oldest first, with null for samples taken while the heat pump was disconnected. A day of
+// samples is more JSON than we'd want in one String, so it goes out in chunks as the connection
+// drains, each picking up from the sample number where the last one stopped.
+void handleHistoryJson(AsyncWebServerRequest *request) {
+  auto stream = std::make_shared<HistoryStream>();
+  {
+    const StateLock lock;
+    stream->next = history.total() - history.size();
+    stream->end = history.total();
+    String &chunk = stream->pending;
+    chunk += F("{\"interval\":");
+    chunk += HISTORY_INTERVAL_MS / 1000;
+    chunk += F(",\"age\":");
+    if (history.size() > 0) {
+      // nextHistorySample is one interval past the newest sample
+      chunk += static_cast<uint32_t>(
+          (Moment::now() - nextHistorySample + HISTORY_INTERVAL_MS) / 1000);
+    } else {
+      chunk += '0';
+    }
+    chunk += F(",\"unit\":\"");
+    chunk += getTemperatureScale();
+    chunk += F("\",\"samples\":[");
+  }
+
+  request->send(request->beginChunkedResponse(
+      "application/json", [stream](uint8_t *buffer, const size_t maxLen, size_t /*index*/) {
+        if (stream->pending.length() < maxLen && !stream->done) {
+          const StateLock lock;
+          fillHistoryStream(*stream, maxLen);
+        }
+        const size_t length = std::min(maxLen, static_cast<size_t>(stream->pending.length()));
+        memcpy(buffer, stream->pending.c_str(), length);
+        stream->pending.remove(0, length);
+        return length;
+      }));
+}
+
+// Adds samples to the stream's pending text until there's at least `length` of it, or the samples
+// run out
+void fillHistoryStream(HistoryStream &stream, const size_t length) {
+  const uint32_t oldest = history.total() - history.size();
+  if (static_cast<int32_t>(stream.next - oldest) < 0) {
+    stream.next = oldest;
+  }
+  uint32_t remaining =
+      static_cast<int32_t>(stream.end - stream.next) > 0 ? stream.end - stream.next : 0;
+  String &chunk = stream.pending;
+  if (remaining == 0) {
+    chunk += F("]}");
+    stream.done = true;
+    return;
+  }
+  // The visitor returning false still counts its sample as read
+  stream.next = history.forEachFrom(stream.next, [&](const HistorySample &sample) {
+    remaining--;
+    if (!stream.first) {
+      chunk += ',';
+    }
+    stream.first = false;
+    if (!sample.valid) {
+      chunk += F("null");
+    } else {
+      std::array<char, Temperature::maxChars> buffer;
+      chunk += '[';
+      Temperature::fromCentiCelsius(sample.roomCenti)
+          .toChars(buffer.data(), buffer.size(), config.unit.tempUnit, 0.1f);
+      chunk += buffer.data();
+      chunk += ',';
+      Temperature::fromCentiCelsius(sample.targetCenti)
+          .toChars(buffer.data(), buffer.size(), config.unit.tempUnit, 0.1f);
+      chunk += buffer.data();
+      chunk += ',';
+      chunk += sample.compressorFrequency;
+      chunk += sample.operating ? F(",1]") : F(",0]");
+    }
+    return remaining > 0 && chunk.length() < length;
+  });
+  if (remaining == 0) {
+    chunk += F("]}");
+    stream.done = true;
+  }
 }
 
 // Render the login form
-void handleLogin() {
+void handleLogin(AsyncWebServerRequest *request) {
   LOG(F("handleLogin()"));
 
   // Don't render the login form if login is not required; just redirect back to the home page
-  if (is_authenticated() || config.unit.login_password.length() == 0) {
-    server.sendHeader("Cache-Control", "no-cache");
-    server.sendHeader("Location", "/");
-    server.send(httpFound, F("text/plain"), "Redirect to home page");
+  if (isAuthorized(request)) {
+    redirect(request, F("/"));
+    return;
   }
 
   JsonDocument data;
-  data[F("authError")] = server.hasArg("authError");
-  renderView(views::login, data, {{"header", partials::header}, {"footer", partials::footer}});
+  data[F("authError")] = request->hasArg("authError");
+  renderView(request, views::login, data,
+             {{"header", partials::header}, {"footer", partials::footer}});
 }
 
 // The session cookie is a hash of the client's IP address and the login password
 // (https://github.com/floatplane/MitsuQTT/issues/59): it can't be forged without knowing the
 // password, and can't be replayed from a different address. Changing the password invalidates
 // all sessions.
-String sessionCookie() {
+String sessionCookie(AsyncWebServerRequest *request) {
   MD5Builder md5;
   md5.begin();
-  md5.add(server.client().remoteIP().toString() + config.unit.login_password);
+  md5.add(request->client()->remoteIP().toString() + config.unit.login_password);
   md5.calculate();
   return String(F("M2MSESSIONID=")) + md5.toString();
 }
@@ -1297,34 +2196,25 @@ String sessionCookie() {
 // Handle the auth via POST
 // If the password is correct, set the session cookie and redirect to the home page
 // If the password is incorrect, redirect back to the login page with an error message
-void handleAuth() {
+void handleAuth(AsyncWebServerRequest *request) {
   LOG(F("handleAuth()"));
 
-  if (server.hasArg("PASSWORD") && server.arg("PASSWORD") == config.unit.login_password) {
-    server.sendHeader("Cache-Control", "no-cache");
-    server.sendHeader("Set-Cookie", sessionCookie() + F("; HttpOnly; SameSite=Strict"));
-    server.sendHeader("Location", "/");
-    server.send(httpFound, F("text/plain"), "Redirect to home page");
+  if (request->hasArg("PASSWORD") && request->arg("PASSWORD") == config.unit.login_password) {
+    redirect(request, F("/"), sessionCookie(request) + F("; HttpOnly; SameSite=Strict"));
   } else {
-    server.sendHeader("Cache-Control", "no-cache");
-    server.sendHeader("Set-Cookie", F("M2MSESSIONID=0; HttpOnly; SameSite=Strict"));
-    server.sendHeader("Location", "/login?authError");
-    server.send(httpFound, F("text/plain"), "Redirect to login");
+    redirect(request, F("/login?authError"), F("M2MSESSIONID=0; HttpOnly; SameSite=Strict"));
   }
 }
 
 // Handle logout via POST
-void handleLogout() {
+void handleLogout(AsyncWebServerRequest *request) {
   LOG(F("handleLogout()"));
 
-  server.sendHeader("Cache-Control", "no-cache");
-  server.sendHeader("Set-Cookie", F("M2MSESSIONID=0; HttpOnly; SameSite=Strict; Max-Age=0"));
-  server.sendHeader("Location", "/login");
-  server.send(httpFound, F("text/plain"), "Redirect to login");
+  redirect(request, F("/login"), F("M2MSESSIONID=0; HttpOnly; SameSite=Strict; Max-Age=0"));
 }
 
-void handleUpgrade() {
-  if (!checkLogin()) {
+void handleUpgrade(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
     return;
   }
 
@@ -1333,10 +2223,15 @@ void handleUpgrade() {
   uploaderror = UploadError::noError;
   JsonDocument data;
   data[F("firmware")] = F(MITSUQTT_PROGNAME);
-  renderView(views::upgrade, data, {{"header", partials::header}, {"footer", partials::footer}});
+  renderView(request, views::upgrade, data,
+             {{"header", partials::header}, {"footer", partials::footer}});
 }
 
-void handleUploadDone() {
+void handleUploadDone(AsyncWebServerRequest *request) {
+  if (!checkLogin(request)) {
+    return;
+  }
+
   LOG(F("handleUploadDone()"));
 
   // Serial.printl(PSTR("HTTP: Firmware upload done"));
@@ -1370,19 +2265,22 @@ void handleUploadDone() {
     restartflag = true;
   }
 
-  renderView(views::upload, data,
+  renderView(request, views::upload, data,
              {{"header", partials::header},
               {"footer", partials::footer},
               {"countdown", partials::countdown}});
 
   if (restartflag) {
     LOG(F("Restarting in 500ms..."));
-    restartAfterDelay(500);
+    deferRestart(500);
   }
 }
 
-void handleUploadLoop() {  // NOLINT(readability-function-cognitive-complexity)
-  if (!checkLogin()) {
+// NOLINTBEGIN(readability-function-cognitive-complexity)
+void handleUploadLoop(AsyncWebServerRequest *request, const String &filename, const size_t index,
+                      uint8_t *data, const size_t len, const bool final) {
+  // NOLINTEND(readability-function-cognitive-complexity)
+  if (!isAuthorized(request)) {
     return;
   }
 
@@ -1392,35 +2290,41 @@ void handleUploadLoop() {  // NOLINT(readability-function-cognitive-complexity)
     Update.end();
     return;
   }
-  HTTPUpload &upload = server.upload();
-  if (upload.status == UPLOAD_FILE_START) {
-    if (upload.filename.c_str()[0] == 0) {
+  if (index == 0) {
+    if (filename.isEmpty()) {
       uploaderror = UploadError::noFileSelected;
       return;
     }
     // save cpu by disconnect/stop retry mqtt server
     // TODO(floatplane): should we do this? I feel like we should log to MQTT instead
-    if (mqtt_client.state() == MQTT_CONNECTED) {
-      mqtt_client.disconnect();
-      lastMqttRetry = Moment::now();
-    }
-    // snprintf_P(log, sizeof(log), PSTR("Upload: File %s ..."),
-    // upload.filename.c_str()); Serial.printl(log);
+    defer(DeferredWork::disconnectMqtt);
+#ifndef ESP32
+    // This runs in the network stack's context, where the updater mustn't yield
+    Update.runAsync(true);
+#endif
     const uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
     if (!Update.begin(maxSketchSpace)) {  // start with max available size
       // Update.printError(Serial);
       uploaderror = UploadError::fileTooLarge;
       return;
     }
-  } else if (uploaderror == UploadError::noError && (upload.status == UPLOAD_FILE_WRITE)) {
-    if (upload.totalSize == 0) {
-      if (upload.buf[0] != 0xE9) {
+    request->onDisconnect([]() {
+      if (Update.isRunning()) {
+        // Serial.println(PSTR("Upload: Update was aborted"));
+        uploaderror = UploadError::fileUploadAborted;
+        Update.end();
+      }
+    });
+  }
+  if (len > 0) {
+    if (index == 0) {
+      if (data[0] != 0xE9) {
         // Serial.println(PSTR("Upload: File magic header does not start with
         // 0xE9"));
         uploaderror = UploadError::fileMagicHeaderIncorrect;
         return;
       }
-      const uint32_t bin_flash_size = ESP.magicFlashChipSize((upload.buf[3] & 0xf0) >> 4);
+      const uint32_t bin_flash_size = ESP.magicFlashChipSize((data[3] & 0xf0) >> 4);
 #ifdef ESP32
       if (bin_flash_size > ESP.getFlashChipSize()) {
 #else
@@ -1432,18 +2336,18 @@ void handleUploadLoop() {  // NOLINT(readability-function-cognitive-complexity)
         return;
       }
       if (ESP.getFlashChipMode() == 3) {
-        upload.buf[2] = 3;  // DOUT - ESP8285
+        data[2] = 3;  // DOUT - ESP8285
       } else {
-        upload.buf[2] = 2;  // DIO - ESP8266
+        data[2] = 2;  // DIO - ESP8266
       }
     }
-    if (uploaderror == UploadError::noError &&
-        (Update.write(upload.buf, upload.currentSize) != upload.currentSize)) {
+    if (Update.write(data, len) != len) {
       // Update.printError(Serial);
       uploaderror = UploadError::fileUploadBufferMiscompare;
       return;
     }
-  } else if (uploaderror == UploadError::noError && (upload.status == UPLOAD_FILE_END)) {
+  }
+  if (final) {
     if (Update.end(true)) {  // true to set the size to the current progress
                              // snprintf_P(log, sizeof(log), PSTR("Upload:
                              // Successful %u bytes. Restarting"),
@@ -1453,119 +2357,328 @@ void handleUploadLoop() {  // NOLINT(readability-function-cognitive-complexity)
       uploaderror = UploadError::fileUploadFailed;
       return;
     }
-  } else if (upload.status == UPLOAD_FILE_ABORTED) {
-    // Serial.println(PSTR("Upload: Update was aborted"));
-    uploaderror = UploadError::fileUploadAborted;
-    Update.end();
   }
 }
 
-HeatpumpSettings change_states(const HeatpumpSettings &settings) {
-  HeatpumpSettings newSettings = settings;
-  if (server.hasArg("CONNECT")) {
-    hp.connect(&Serial);
-  } else {
-    bool update = false;
-    if (server.hasArg("POWER")) {
-      newSettings.power = server.arg("POWER");
-      update = true;
-    }
-    if (server.hasArg("MODE")) {
-      newSettings.mode = server.arg("MODE");
-      update = true;
-    }
-    if (server.hasArg("TEMP")) {
-      newSettings.temperature = Temperature(server.arg("TEMP").toFloat(), config.unit.tempUnit);
-      update = true;
-    }
-    if (server.hasArg("FAN")) {
-      newSettings.fan = server.arg("FAN");
-      update = true;
-    }
-    if (server.hasArg("VANE")) {
-      newSettings.vane = server.arg("VANE");
-      update = true;
-    }
-    if (server.hasArg("WIDEVANE")) {
-      newSettings.wideVane = server.arg("WIDEVANE");
-      update = true;
-    }
-    if (update) {
-      hp.setSettings(newSettings.getRaw());
-    }
+void change_states(AsyncWebServerRequest *request) {
+  if (request->hasArg("CONNECT")) {
+    defer(DeferredWork::connectHeatpump);
+    return;
+  }
+  if (request->hasArg("POWER")) {
+    hpReconciler.setPower(
+        heatpump::fromProtocol<HeatpumpSettings::Power>(request->arg("POWER").c_str()),
+        Moment::now());
+  }
+  if (request->hasArg("MODE")) {
+    hpReconciler.setMode(
+        heatpump::fromProtocol<HeatpumpSettings::Mode>(request->arg("MODE").c_str()),
+        Moment::now());
+  }
+  if (request->hasArg("TEMP")) {
+    hpReconciler.setTemperature(
+        Temperature(request->arg("TEMP").toFloat(), config.unit.tempUnit), Moment::now());
+  }
+  if (request->hasArg("FAN")) {
+    hpReconciler.setFan(
+        heatpump::fromProtocol<HeatpumpSettings::FanSpeed>(request->arg("FAN").c_str()),
+        Moment::now());
+  }
+  if (request->hasArg("VANE")) {
+    hpReconciler.setVane(
+        heatpump::fromProtocol<HeatpumpSettings::Vane>(request->arg("VANE").c_str()),
+        Moment::now());
+  }
+  if (request->hasArg("WIDEVANE")) {
+    hpReconciler.setWideVane(
+        heatpump::fromProtocol<HeatpumpSettings::WideVane>(request->arg("WIDEVANE").c_str()),
+        Moment::now());
   }
-  return newSettings;
 }
 
-JsonDocument getHeatPumpStatusJson() {
-  const HeatpumpStatus currentStatus(hp.getStatus());
-  const HeatpumpSettings currentSettings(hp.getSettings());
+// Hand the HeatPump library one merged settings write if the reconciler says one is due; the
+// library's auto-update sends it on the next sync()
+void reconcileHeatpumpSettings() {
+  if (!hpState.isConnected()) {
+    return;
+  }
+  HeatpumpSettings write = hpState.getSettings();
+  if (hpReconciler.nextWrite(hpState.getSettings(), Moment::now(), write)) {
+    warnIfDropped(hpCommands.pushSettings(write), "settings");
+    hpAcks.queued(hpReconciler.lastWriteFields());
+  }
+  const auto outcomes = hpReconciler.takeOutcomes();
+  hpAcks.settle(outcomes.confirmed, outcomes.abandoned, Moment::now(), publishAck);
+}
+
+void warnIfDropped(const bool queued, const char *what) {
+  if (!queued) {
+    LOG(F("Heat pump command queue full, dropping %s"), what);
+  }
+}
 
+// Send at most one queued command per HP_COMMAND_INTERVAL_MS. Settings go through the HeatPump
+// library's wanted settings, which its auto-update sends on the sync() that follows.
+void dispatchHeatpumpCommand() {
+  if (hpCommands.empty() || Moment::now() - lastHpCommand < HP_COMMAND_INTERVAL_MS) {
+    return;
+  }
+  HeatpumpCommandQueue::Command command;
+  hpCommands.pop(command);
+  lastHpCommand = Moment::now();
+  switch (command.kind) {
+    case HeatpumpCommandQueue::Kind::customPacket:
+      hp.sendCustomPacket(command.packet.data(), command.length);
+      break;
+    case HeatpumpCommandQueue::Kind::settings:
+      hp.setSettings(command.settings.getRaw());
+      break;
+    case HeatpumpCommandQueue::Kind::remoteTemperature:
+      hp.setRemoteTemperature(command.remoteTemperature);
+      break;
+  }
+}
+
+// Build the MQTT state payload for a given set of settings: either the reported ones, or an
+// optimistic copy with pending commands applied
+String serializeHeatPumpState(const HeatpumpSettings &currentSettings,
+                              const HeatpumpStatus &currentStatus) {
   JsonDocument doc;
 
   doc["operating"] = currentStatus.operating;
   doc["roomTemperature"] = currentStatus.roomTemperature.get(config.unit.tempUnit, 0.5f);
   doc["temperature"] = currentSettings.temperature.get(config.unit.tempUnit, 0.5f);
-  doc["fan"] = currentSettings.fan;
-  doc["vane"] = currentSettings.vane;
-  doc["wideVane"] = currentSettings.wideVane;
+  doc["fan"] = heatpump::toProtocol(currentSettings.fan);
+  doc["vane"] = heatpump::toProtocol(currentSettings.vane);
+  doc["wideVane"] = heatpump::toProtocol(currentSettings.wideVane);
   doc["mode"] = hpGetMode(currentSettings);
   doc["action"] = hpGetAction(currentStatus, currentSettings);
   doc["compressorFrequency"] = currentStatus.compressorFrequency;
 
-  return doc;
+  String payload;
+  serializeJson(doc, payload);
+  return payload;
+}
+
+// The same fields as serializeHeatPumpState, as MessagePack with one-letter keys, written straight
+// into `buffer`. Returns the length, or 0 if it didn't fit.
+size_t encodeCompactState(const HeatpumpSettings &currentSettings,
+                          const HeatpumpStatus &currentStatus, uint8_t *buffer,
+                          const size_t capacity) {
+  MsgpackWriter writer(buffer, capacity);
+  writer.map(9);
+  writer.str("o", 1);
+  writer.boolean(currentStatus.operating);
+  writer.str("r", 1);
+  writer.number(currentStatus.roomTemperature.get(config.unit.tempUnit, 0.5f));
+  writer.str("t", 1);
+  writer.number(currentSettings.temperature.get(config.unit.tempUnit, 0.5f));
+  writer.str("f", 1);
+  writer.str(heatpump::toProtocol(currentSettings.fan));
+  writer.str("v", 1);
+  writer.str(heatpump::toProtocol(currentSettings.vane));
+  writer.str("w", 1);
+  writer.str(heatpump::toProtocol(currentSettings.wideVane));
+  writer.str("m", 1);
+  writer.str(hpGetMode(currentSettings));
+  writer.str("a", 1);
+  writer.str(hpGetAction(currentStatus, currentSettings));
+  writer.str("c", 1);
+  writer.integer(currentStatus.compressorFrequency);
+  return writer.ok() ? writer.size() : 0;
+}
+
+void queueCompactState(const HeatpumpSettings &currentSettings,
+                       const HeatpumpStatus &currentStatus) {
+  if (!config.other.compactState) {
+    return;
+  }
+  std::array<uint8_t, 96> buffer;
+  const size_t length =
+      encodeCompactState(currentSettings, currentStatus, buffer.data(), buffer.size());
+  if (length > 0) {
+    mqttOutbox.push(MqttOutbox::Kind::state, config.mqtt.ha_state_msgpack_topic().c_str(),
+                    buffer.data(), length);
+  }
 }
 
-String hpGetMode(const HeatpumpSettings &hpSettings) {
-  // Map the heat pump state to one of HA's HVAC_MODE_* values.
-  // https://github.com/home-assistant/core/blob/master/homeassistant/components/climate/const.py#L3-L23
+const String &getHeatPumpStatePayload() {
+  static VersionedCache<String> payload;
+  return payload.get(hpState.getVersion(), []() {
+    return serializeHeatPumpState(hpState.getSettings(), hpState.getStatus());
+  });
+}
 
-  if (hpSettings.power.equalsIgnoreCase("off")) {
-    return "off";
-  }
+// Device health for Home Assistant's diagnostic sensors
+String getDiagnosticsPayload() {
+  JsonDocument doc;
+  doc[F("rssi")] = WiFi.RSSI();
+  doc[F("freeHeap")] = ESP.getFreeHeap();
+  doc[F("hvacConnected")] = hpState.isConnected();
+  addRuntimeTotals(doc[F("runtime")].to<JsonObject>(), hpRuntime.getTotals());
+  String payload;
+  serializeJson(doc, payload);
+  return payload;
+}
 
-  String hpmode = hpSettings.mode;
-  hpmode.toLowerCase();
+const char *hpGetMode(const HeatpumpSettings &hpSettings) {
+  return heatpump::homeAssistantMode(hpSettings.power, hpSettings.mode);
+}
 
-  if (hpmode == "fan") {
-    return "fan_only";
+const char *hpGetAction(const HeatpumpStatus &hpStatus, const HeatpumpSettings &hpSettings) {
+  return heatpump::toHomeAssistant(
+      heatpump::homeAssistantAction(hpSettings.power, hpSettings.mode, hpStatus.operating));
+}
+
+// Add a sample to the history ring every HISTORY_INTERVAL_MS, on a fixed cadence so the samples
+// can be timed from their position
+void recordHistory() {
+  if (nextHistorySample == Moment::never()) {
+    nextHistorySample = Moment::now();
   }
-  if (hpmode == "auto") {
-    return "heat_cool";
+  if (Moment::now() < nextHistorySample) {
+    return;
   }
-  return hpmode;  // cool, heat, dry
+  nextHistorySample.offset(HISTORY_INTERVAL_MS);
+
+  const HeatpumpStatus &status = hpState.getStatus();
+  history.append(HistorySample{
+      .roomCenti = status.roomTemperature.getCentiCelsius(),
+      .targetCenti = hpState.getSettings().temperature.getCentiCelsius(),
+      .compressorFrequency = static_cast<uint8_t>(std::min(std::max(status.compressorFrequency, 0),
+                                                           static_cast<int>(UINT8_MAX))),
+      .operating = status.operating,
+      .valid = hpState.isConnected(),
+  });
+}
+
+// Charge the time since the last loop pass to whatever the unit was doing during it
+void updateRuntime() {
+  const HeatpumpSettings &settings = hpState.getSettings();
+  const HeatpumpStatus &status = hpState.getStatus();
+  hpRuntime.update(Moment::now(), {
+                                      .connected = hpState.isConnected(),
+                                      .power = settings.power,
+                                      .mode = settings.mode,
+                                      .compressorFrequency = status.compressorFrequency,
+                                  });
 }
 
-String hpGetAction(const HeatpumpStatus &hpStatus, const HeatpumpSettings &hpSettings) {
-  // Map heat pump state to one of HA's CURRENT_HVAC_* values.
-  // https://github.com/home-assistant/core/blob/master/homeassistant/components/climate/const.py#L80-L86
+uint64_t journalCounter(const JournalCounter counter, const size_t offset = 0) {
+  return counterJournal.get(static_cast<uint8_t>(counter) + offset);
+}
+
+void setJournalCounter(const JournalCounter counter, const uint64_t value,
+                       const size_t offset = 0) {
+  counterJournal.set(static_cast<uint8_t>(counter) + offset, value);
+}
 
-  if (hpSettings.power.equalsIgnoreCase("off")) {
-    return "off";
+void restoreCounters() {
+  const size_t records = counterJournal.restore();
+  if (counterJournal.getStats().discarded > 0) {
+    LOG(F("Discarded %u bytes of damaged counters"),
+        static_cast<unsigned>(counterJournal.getStats().discarded));
   }
+  LOG(F("Restored counters from %u journal records"), static_cast<unsigned>(records));
 
-  String hpmode = hpSettings.mode;
-  hpmode.toLowerCase();
+  hpConnectionTotalRetries = static_cast<unsigned>(journalCounter(JournalCounter::hvacRetries));
+  HeatpumpRuntime::Totals totals{};
+  totals.poweredMs = journalCounter(JournalCounter::poweredMs);
+  totals.compressorMs = journalCounter(JournalCounter::compressorMs);
+  totals.compressorStarts =
+      static_cast<uint32_t>(journalCounter(JournalCounter::compressorStarts));
+  totals.energyWattMs = journalCounter(JournalCounter::energyWattMs);
+  for (size_t mode = 0; mode < HeatpumpRuntime::modeCount; mode++) {
+    totals.modeMs[mode] = journalCounter(JournalCounter::modeMs, mode);
+  }
+  hpRuntime.restore(totals);
+}
 
-  if (hpmode == "fan") {
-    return "fan";
+void checkpointCounters() {
+  HeatpumpRuntime::Totals totals;
+  {
+    const StateLock lock;
+    totals = hpRuntime.getTotals();
+  }
+  setJournalCounter(JournalCounter::hvacRetries, hpConnectionTotalRetries);
+  setJournalCounter(JournalCounter::poweredMs, totals.poweredMs);
+  setJournalCounter(JournalCounter::compressorMs, totals.compressorMs);
+  setJournalCounter(JournalCounter::compressorStarts, totals.compressorStarts);
+  setJournalCounter(JournalCounter::energyWattMs, totals.energyWattMs);
+  for (size_t mode = 0; mode < HeatpumpRuntime::modeCount; mode++) {
+    setJournalCounter(JournalCounter::modeMs, totals.modeMs[mode], mode);
   }
-  if (!hpStatus.operating) {
-    return "idle";
+  if (!counterJournal.checkpoint()) {
+    LOG(F("Failed to save counters"));
   }
-  if (hpmode == "auto") {
-    return "idle";
+  nextCounterCheckpoint = Moment::now().offset(COUNTER_CHECKPOINT_INTERVAL_MS);
+}
+
+// Called from the HeatPump library whenever a status report differs from the last, which is as
+// often as the unit's readings change
+void recordTelemetry(const heatpumpStatus &status) {
+  if (!config.other.telemetry) {
+    return;
   }
-  if (hpmode == "cool") {
-    return "cooling";
+  if (!telemetry.add({
+          .millis = millis(),
+          .roomCenti = Temperature(status.roomTemperature, TempUnit::C).getCentiCelsius(),
+          .compressorFrequency = static_cast<uint8_t>(
+              std::min(std::max(status.compressorFrequency, 0), static_cast<int>(UINT8_MAX))),
+          .operating = status.operating,
+      })) {
+    // The batch should have gone out already; make room rather than lose the newest reading
+    flushTelemetry(true);
+    recordTelemetry(status);
   }
-  if (hpmode == "heat") {
-    return "heating";
+}
+
+void flushTelemetry(const bool force) {
+  if (!force && !telemetry.due(millis(), TELEMETRY_MAX_AGE_MS)) {
+    return;
   }
-  if (hpmode == "dry") {
-    return "drying";
+  std::array<uint8_t, TelemetryBatch<>::maxEncodedBytes> buffer;
+  const size_t length = telemetry.encode(buffer.data(), buffer.size());
+  if (length > 0 && config.mqtt.configured()) {
+    mqttOutbox.push(MqttOutbox::Kind::telemetry, config.mqtt.ha_telemetry_topic().c_str(),
+                    buffer.data(), length);
   }
-  return hpmode;  // unknown
+  telemetry.clear();
+}
+
+// Pull the heat pump's state into the shared snapshot, but only when sync() has reported a change
+// or the connection has come or gone
+void refreshHeatpumpState() {
+  if (!hpStateDirty && hp.isConnected() == hpState.isConnected()) {
+    return;
+  }
+  hpStateDirty = false;
+  hpState.update(HeatpumpSettings(hp.getSettings()), HeatpumpStatus(hp.getStatus()),
+                 hp.isConnected());
+}
+
+// Returns false if the outbox had no room for the message
+bool queueMqttMessage(const MqttOutbox::Kind kind, const String &topic, const String &payload,
+                      const bool retained) {
+  return mqttOutbox.push(kind, topic.c_str(), payload.c_str(), retained);
+}
+
+void queueMqttLog(const char *line) {
+  mqttOutbox.push(MqttOutbox::Kind::log, config.mqtt.ha_debug_logs_topic().c_str(), line);
+}
+
+void drainMqttOutbox() {
+  const Moment deadline = Moment::now().offset(MQTT_DRAIN_BUDGET_MS);
+  mqttOutbox.drain(
+      [](const MqttOutbox::Message &message) {
+        // Streamed, so a message bigger than the client's buffer still goes out
+        return mqtt_client.beginPublish(message.topic.c_str(), message.payload.size(),
+                                        message.retained) &&
+               mqtt_client.write(reinterpret_cast<const uint8_t *>(message.payload.data()),
+                                 message.payload.size()) == message.payload.size() &&
+               mqtt_client.endPublish() == 1;
+      },
+      [&deadline]() { return Moment::now() > deadline; });
 }
 
 void pushHeatPumpStateToMqtt() {
@@ -1573,12 +2686,13 @@ void pushHeatPumpStateToMqtt() {
   // state to MQTT at a higher cadence
   const uint32_t interval = config.other.optimisticUpdates ? 30000UL : 10000UL;
   if (Moment::now() - lastMqttStatePacketSend > interval) {
-    String mqttOutput;
-    serializeJson(getHeatPumpStatusJson(), mqttOutput);
-
-    if (!mqtt_client.publish_P(config.mqtt.ha_state_topic().c_str(), mqttOutput.c_str(), false)) {
-      LOG(F("Failed to publish hp status change"));
+    if (!queueMqttMessage(MqttOutbox::Kind::state, config.mqtt.ha_state_topic(),
+                          getHeatPumpStatePayload())) {
+      LOG(F("Failed to queue hp status change"));
     }
+    queueCompactState(hpState.getSettings(), hpState.getStatus());
+    queueMqttMessage(MqttOutbox::Kind::state, config.mqtt.ha_diagnostics_topic(),
+                     getDiagnosticsPayload());
 
     lastMqttStatePacketSend = Moment::now();
   }
@@ -1591,6 +2705,20 @@ void hpPacketDebug(byte *packet_, unsigned int length, char *packetDirection_) {
   const byte *const packet = packet_;
   const char *const packetDirection = packetDirection_;
 
+  // The library calls this from inside sync(), where the loop doesn't hold the lock. The custom
+  // packet handler calls it too, with the lock held, to dump a packet it hasn't sent yet.
+  const bool sent = strcmp(packetDirection, "packetSent") == 0;
+  if (sent || strcmp(packetDirection, "packetRecv") == 0) {
+    const StateLock lock;
+    hpLink.onPacket(packet, length,
+                    sent ? HeatpumpLinkStats::Direction::sent
+                         : HeatpumpLinkStats::Direction::received,
+                    millis());
+    if (sent && HeatpumpLinkStats::isSettingsWrite(packet, length)) {
+      hpAcks.written(Moment::now(), publishAck);
+    }
+  }
+
   if (config.other.dumpPacketsToMqtt) {
     String message;
     for (unsigned int idx = 0; idx < length; idx++) {
@@ -1605,40 +2733,52 @@ void hpPacketDebug(byte *packet_, unsigned int length, char *packetDirection_) {
     root[packetDirection] = message;
     String mqttOutput;
     serializeJson(root, mqttOutput);
-    if (!mqtt_client.publish(config.mqtt.ha_debug_pckts_topic().c_str(), mqttOutput.c_str())) {
-      mqtt_client.publish(config.mqtt.ha_debug_logs_topic().c_str(),
-                          "Failed to publish to heatpump/debug topic");
-    }
+    queueMqttMessage(MqttOutbox::Kind::debugPacket, config.mqtt.ha_debug_pckts_topic(),
+                     mqttOutput);
   }
 }
 
-// This is used to send an optimistic state update to MQTT, which in turn causes the Home Assistant
-// UI to update without waiting to apply a setting and read it back.
-void publishOptimisticStateChange(JsonDocument &override) {
-  if (!config.other.optimisticUpdates) {
+// Optimistic state updates to MQTT let the Home Assistant UI update without waiting to apply a
+// setting and read it back. Command handlers apply their change to the settings returned here, and
+// every change made before the next flush is merged into a single publish.
+HeatpumpSettings &beginOptimisticStateChange() {
+  if (!optimisticPublishPending) {
+    pendingOptimisticSettings = hpState.getSettings();
+    pendingOptimisticSince = Moment::now();
+    optimisticPublishPending = true;
+  }
+  return pendingOptimisticSettings;
+}
+
+void flushOptimisticStateChange() {
+  if (!optimisticPublishPending ||
+      Moment::now() - pendingOptimisticSince < OPTIMISTIC_PUBLISH_WINDOW_MS) {
     return;
   }
+  optimisticPublishPending = false;
 
-  JsonDocument status(getHeatPumpStatusJson());
-  auto override2 = override.as<JsonObject>();
-  for (auto pair : override2) {
-    status[pair.key()] = pair.value();
+  if (!config.other.optimisticUpdates) {
+    return;
   }
-  String mqttOutput;
-  serializeJson(status, mqttOutput);
+
+  const String mqttOutput = serializeHeatPumpState(pendingOptimisticSettings, hpState.getStatus());
   if (config.other.dumpPacketsToMqtt) {
-    mqtt_client.publish(config.mqtt.ha_debug_pckts_topic().c_str(), mqttOutput.c_str(), false);
+    queueMqttMessage(MqttOutbox::Kind::debugPacket, config.mqtt.ha_debug_pckts_topic(),
+                     mqttOutput);
   }
-  if (!mqtt_client.publish_P(config.mqtt.ha_state_topic().c_str(), mqttOutput.c_str(), false)) {
-    LOG(F("Failed to publish dummy hp status change"));
+  if (!queueMqttMessage(MqttOutbox::Kind::state, config.mqtt.ha_state_topic(), mqttOutput)) {
+    LOG(F("Failed to queue dummy hp status change"));
   }
+  queueCompactState(pendingOptimisticSettings, hpState.getStatus());
 
   // Restart counter for waiting enought time for the unit to update before
   // sending a state packet
   lastMqttStatePacketSend = Moment::now();
 }
 
-static std::map<String, std::function<void(const char *)>> mqttTopicHandlers;
+static std::map<String, MqttTopicHandler> mqttTopicHandlers;
+// Topics whose commands can carry a correlation id, as a JSON envelope or a topic suffix
+static std::set<String> mqttCommandTopics;
 
 void mqttCallback(const char *topic, const byte *payload, unsigned int length) {
   // Copy payload into message buffer
@@ -1648,15 +2788,91 @@ void mqttCallback(const char *topic, const byte *payload, unsigned int length) {
   }
   message[length] = '\0';
 
+  // Handlers share the heat pump state with the web server
+  const StateLock lock;
   auto handler = mqttTopicHandlers.find(topic);
   if (handler != mqttTopicHandlers.end()) {
-    handler->second(message);
+    if (message[0] == '{' && mqttCommandTopics.count(topic) != 0) {
+      runEnvelopedCommand(handler->second, message);
+    } else {
+      handler->second(message);
+    }
+    return;
+  }
+
+  // <set topic>/<correlation id>
+  const char *const idStart = strrchr(topic, '/');
+  if (idStart != nullptr) {
+    const String commandTopic = String(topic).substring(0, idStart - topic);
+    handler = mqttTopicHandlers.find(commandTopic);
+    if (handler != mqttTopicHandlers.end() && mqttCommandTopics.count(commandTopic) != 0) {
+      runCorrelatedCommand(handler->second, message, idStart + 1);
+      return;
+    }
+  }
+  const String msg = String("heatpump: unrecognized mqtt topic: ") + topic;
+  queueMqttMessage(MqttOutbox::Kind::log, config.mqtt.ha_debug_logs_topic(), msg);
+}
+
+// {"id": "<correlation id>", "value": <what would otherwise be the whole payload>}
+void runEnvelopedCommand(const MqttTopicHandler &handler, const char *message) {
+  JsonDocument envelope;
+  if (deserializeJson(envelope, message) != DeserializationError::Ok) {
+    LOG(F("Ignoring malformed command envelope: %s"), message);
+    return;
+  }
+  const JsonVariantConst value = envelope[F("value")];
+  String text;
+  if (value.is<const char *>()) {
+    text = value.as<const char *>();
+  } else if (!value.isNull()) {
+    serializeJson(value, text);
+  }
+  const char *const id = envelope[F("id")] | "";
+  if (id[0] == '\0') {
+    handler(text.c_str());
   } else {
-    const String msg = String("heatpump: unrecognized mqtt topic: ") + topic;
-    mqtt_client.publish(config.mqtt.ha_debug_logs_topic().c_str(), msg.c_str());
+    runCorrelatedCommand(handler, text.c_str(), id);
   }
 }
 
+void runCorrelatedCommand(const MqttTopicHandler &handler, const char *message, const char *id) {
+  if (!HeatpumpCommandAcks::validId(id)) {
+    LOG(F("Ignoring command with a correlation id over %u characters"),
+        static_cast<unsigned>(HeatpumpCommandAcks::maxIdLength));
+    return;
+  }
+  mqttCommandId = id;
+  mqttCommandTracked = false;
+  handler(message);
+  if (!mqttCommandTracked) {
+    publishAck({id, HeatpumpCommandAcks::Status::rejected, -1});
+  }
+  mqttCommandId = "";
+}
+
+// Called by the setting handlers once they've handed a command to the reconciler, with the fields
+// it's waiting on; none if it only set the remote temperature
+void trackCommand(const uint8_t fields) {
+  if (mqttCommandId.isEmpty()) {
+    return;
+  }
+  mqttCommandTracked = true;
+  hpAcks.track(mqttCommandId.c_str(), fields, Moment::now(), publishAck);
+}
+
+void publishAck(const HeatpumpCommandAcks::Ack &ack) {
+  JsonDocument doc;
+  doc[F("id")] = ack.id;
+  doc[F("status")] = HeatpumpCommandAcks::statusName(ack.status);
+  if (ack.latencyMs >= 0) {
+    doc[F("latencyMs")] = ack.latencyMs;
+  }
+  String payload;
+  serializeJson(doc, payload);
+  queueMqttMessage(MqttOutbox::Kind::ack, config.mqtt.ha_ack_topic(), payload);
+}
+
 void onSetCustomPacket(const char *message) {
   const String custom = message;
 
@@ -1683,12 +2899,12 @@ void onSetCustomPacket(const char *message) {
   // callback function, it can't be.  So we'll just have to be careful not to modify it.
   hpPacketDebug(bytes, byteCount, const_cast<char *>("customPacket"));
 
-  hp.sendCustomPacket(bytes, byteCount);
+  warnIfDropped(hpCommands.pushCustomPacket(bytes, byteCount), "custom packet");
 }
 
 void onSetDebugLogs(const char *message) {
   if (strcmp(message, "on") == 0) {
-    Logger::enableMqttLogging(mqtt_client, config.mqtt.ha_debug_logs_topic().c_str());
+    Logger::enableMqttLogging(queueMqttLog);
     config.other.logToMqtt = true;
     LOG(F("Debug logs mode enabled"));
   } else if (strcmp(message, "off") == 0) {
@@ -1701,10 +2917,12 @@ void onSetDebugLogs(const char *message) {
 void onSetDebugPackets(const char *message) {
   if (strcmp(message, "on") == 0) {
     config.other.dumpPacketsToMqtt = true;
-    mqtt_client.publish(config.mqtt.ha_debug_pckts_topic().c_str(), "Debug packets mode enabled");
+    queueMqttMessage(MqttOutbox::Kind::debugPacket, config.mqtt.ha_debug_pckts_topic(),
+                     F("Debug packets mode enabled"));
   } else if (strcmp(message, "off") == 0) {
     config.other.dumpPacketsToMqtt = false;
-    mqtt_client.publish(config.mqtt.ha_debug_pckts_topic().c_str(), "Debug packets mode disabled");
+    queueMqttMessage(MqttOutbox::Kind::debugPacket, config.mqtt.ha_debug_pckts_topic(),
+                     F("Debug packets mode disabled"));
   }
 }
 
@@ -1715,90 +2933,183 @@ void onSetSystem(const char *message) {
 }
 
 void onSetRemoteTemp(const char *message) {
-  const float temperature = strtof(message, NULL);
+  setRemoteTemp(strtof(message, NULL));
+}
+
+void setRemoteTemp(const float temperature) {
   if (temperature == 0) {      // Remote temp disabled by mqtt topic set
     remoteTempActive = false;  // clear the remote temp flag
-    hp.setRemoteTemperature(0.0);
+    remoteTempFilter.reset();
+    warnIfDropped(hpCommands.pushRemoteTemperature(0.0f), "remote temperature");
   } else {
-    if (safeModeActive()) {
-      LOG(F("Safe mode lockout turned off: we got a remote temp message to %f"), temperature);
-    }
-    remoteTempActive = true;         // Remote temp has been pushed.
-    lastRemoteTemp = Moment::now();  // Note time
-    hp.setRemoteTemperature(Temperature(temperature, config.unit.tempUnit).getCelsius());
+    acceptRemoteTemp(Temperature(temperature, config.unit.tempUnit));
+  }
+}
+
+// Messages from the configured sensor topic: pick the temperature out of the JSON, and ignore
+// anything that doesn't have one (availability messages, button presses, etc.). Sensors and their
+// bridges report Celsius whatever unit the heat pump is set to.
+void onSensorMessage(const char *message) {
+  float temperature = 0.0f;
+  if (jsonscan::findNumber(message, config.mqtt.remoteTempPath.c_str(), temperature)) {
+    acceptRemoteTemp(Temperature(temperature, TempUnit::C));
+  }
+}
+
+void acceptRemoteTemp(const Temperature &temperature) {
+  if (safeModeActive()) {
+    LOG(F("Safe mode lockout turned off: we got a remote temp message to %f C"),
+        temperature.getCelsius());
+  }
+  remoteTempActive = true;         // Remote temp has been pushed.
+  lastRemoteTemp = Moment::now();  // Note time
+  Temperature forward = temperature;
+  if (remoteTempFilter.offer(forward, Moment::now(), forward)) {
+    warnIfDropped(hpCommands.pushRemoteTemperature(forward.getCelsius()), "remote temperature");
   }
 }
 
 void onSetWideVane(const char *message) {
-  JsonDocument stateOverride;
-  stateOverride["wideVane"] = String(message);
-  publishOptimisticStateChange(stateOverride);
-  hp.setWideVaneSetting(message);
+  const auto wideVane = heatpump::fromProtocol<HeatpumpSettings::WideVane>(message);
+  if (wideVane == HeatpumpSettings::WideVane::unknown) {
+    return;
+  }
+  beginOptimisticStateChange().wideVane = wideVane;
+  hpReconciler.setWideVane(wideVane, Moment::now());
+  trackCommand(HeatpumpReconciler::Field::wideVane);
 }
 
 void onSetVane(const char *message) {
-  JsonDocument stateOverride;
-  stateOverride["vane"] = String(message);
-  publishOptimisticStateChange(stateOverride);
-  hp.setVaneSetting(message);
+  const auto vane = heatpump::fromProtocol<HeatpumpSettings::Vane>(message);
+  if (vane == HeatpumpSettings::Vane::unknown) {
+    return;
+  }
+  beginOptimisticStateChange().vane = vane;
+  hpReconciler.setVane(vane, Moment::now());
+  trackCommand(HeatpumpReconciler::Field::vane);
 }
 
 void onSetFan(const char *message) {
-  JsonDocument stateOverride;
-  stateOverride["fan"] = String(message);
-  publishOptimisticStateChange(stateOverride);
-  hp.setFanSpeed(message);
+  const auto fan = heatpump::fromProtocol<HeatpumpSettings::FanSpeed>(message);
+  if (fan == HeatpumpSettings::FanSpeed::unknown) {
+    return;
+  }
+  beginOptimisticStateChange().fan = fan;
+  hpReconciler.setFan(fan, Moment::now());
+  trackCommand(HeatpumpReconciler::Field::fan);
 }
 
 void onSetTemp(const char *message) {
-  JsonDocument stateOverride;
   const float value = strtof(message, NULL);
   const Temperature temperature =
       Temperature(value, config.unit.tempUnit).clamp(config.unit.minTemp, config.unit.maxTemp);
 
-  stateOverride["temperature"] = temperature.get(config.unit.tempUnit);
-
-  publishOptimisticStateChange(stateOverride);
-  hp.setTemperature(temperature.getCelsius());
+  beginOptimisticStateChange().temperature = temperature;
+  hpReconciler.setTemperature(temperature, Moment::now());
+  trackCommand(HeatpumpReconciler::Field::temperature);
 }
 
 void onSetMode(const char *message) {
-  JsonDocument stateOverride;
-  String modeUpper = message;
-  modeUpper.toUpperCase();
-  if (modeUpper == "OFF" || safeModeActive()) {
-    if (modeUpper != "OFF") {
-      LOG(F("Safe mode lockout enabled, ignoring mode change to %s"), modeUpper.c_str());
-    }
-    stateOverride["mode"] = "off";
-    stateOverride["action"] = "off";
-    publishOptimisticStateChange(stateOverride);
-    hp.setPowerSetting("OFF");
-  } else {
-    if (modeUpper == "HEAT_COOL") {
-      stateOverride["mode"] = "heat_cool";
-      modeUpper = "AUTO";
-      // NOLINTNEXTLINE(bugprone-branch-clone) why is the next branch getting flagged as a clone?
-    } else if (modeUpper == "HEAT") {
-      stateOverride["mode"] = "heat";
-    } else if (modeUpper == "COOL") {
-      stateOverride["mode"] = "cool";
-    } else if (modeUpper == "DRY") {
-      stateOverride["mode"] = "dry";
-    } else if (modeUpper == "FAN_ONLY") {
-      stateOverride["mode"] = "fan_only";
-      modeUpper = "FAN";
+  if (strcasecmp(message, "off") == 0 || safeModeActive()) {
+    beginOptimisticStateChange().power = HeatpumpSettings::Power::off;
+    hpReconciler.setPower(HeatpumpSettings::Power::off, Moment::now());
+    if (strcasecmp(message, "off") != 0) {
+      // Not what was asked for, so a correlated command is rejected
+      LOG(F("Safe mode lockout enabled, ignoring mode change to %s"), message);
     } else {
+      trackCommand(HeatpumpReconciler::Field::power);
+    }
+  } else {
+    // Home Assistant sends its own mode names, e.g. "heat_cool" rather than "AUTO"
+    const auto mode = heatpump::fromHomeAssistant<HeatpumpSettings::Mode>(message);
+    if (mode == HeatpumpSettings::Mode::unknown) {
       return;
     }
-    publishOptimisticStateChange(stateOverride);
-    hp.setPowerSetting("ON");
-    hp.setModeSetting(modeUpper.c_str());
+    HeatpumpSettings &optimisticSettings = beginOptimisticStateChange();
+    optimisticSettings.power = HeatpumpSettings::Power::on;
+    optimisticSettings.mode = mode;
+    hpReconciler.setPower(HeatpumpSettings::Power::on, Moment::now());
+    hpReconciler.setMode(mode, Moment::now());
+    trackCommand(HeatpumpReconciler::Field::power | HeatpumpReconciler::Field::mode);
+  }
+}
+
+// <root>/<name>/set: any of power, mode, temperature, fan, vane, wideVane and remoteTemp in one
+// JSON object, with the same values as the per-field topics, e.g.
+// {"mode": "heat", "temperature": 21}. The reconciler folds the settings into a single write, and
+// they go out in a single optimistic publish. An "id" field makes it a correlated command,
+// acknowledged as one.
+void onSetSettings(const char *message) {
+  JsonDocument doc;
+  if (deserializeJson(doc, message) != DeserializationError::Ok || !doc.is<JsonObject>()) {
+    LOG(F("Ignoring malformed settings command: %s"), message);
+    return;
+  }
+  const JsonObjectConst fields = doc.as<JsonObjectConst>();
+  const char *const id = fields[F("id")] | "";
+  if (id[0] == '\0') {
+    applySettingsCommand(fields);
+  } else {
+    runCorrelatedCommand([&fields](const char *) { applySettingsCommand(fields); }, "", id);
   }
 }
 
-void sendHomeAssistantConfig() {
-  // send HA config packet
+// All or nothing: a command with any field missing or out of place changes nothing
+bool parseSettingsCommand(const JsonObjectConst &fields, SettingsCommand &command) {
+  for (const JsonPairConst field : fields) {
+    const char *const key = field.key().c_str();
+    const JsonVariantConst value = field.value();
+    if (strcmp(key, "id") == 0) {
+      continue;
+    }
+    if (strcmp(key, "remoteTemp") == 0) {
+      if (!value.is<float>()) {
+        return false;
+      }
+      command.remoteTemp = value.as<float>();
+      command.hasRemoteTemp = true;
+    } else if (!parseSettingsField(key, value, mqttSettingsDialect, command)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void applySettingsCommand(const JsonObjectConst &fields) {
+  SettingsCommand command{.settings = hpState.getSettings()};
+  if (!parseSettingsCommand(fields, command)) {
+    LOG(F("Ignoring invalid settings command"));
+    return;
+  }
+  // First, so a fresh remote temperature can lift the safe mode lockout for the rest
+  if (command.hasRemoteTemp) {
+    setRemoteTemp(command.remoteTemp);
+  }
+  if (command.fields == 0) {
+    if (command.hasRemoteTemp) {
+      trackCommand(0);  // accepted: the unit doesn't report the remote temperature back
+    }
+    return;
+  }
+  const bool powerOn = (command.fields & HeatpumpReconciler::Field::power) != 0 &&
+                       command.settings.power == HeatpumpSettings::Power::on;
+  if (powerOn && safeModeActive()) {
+    // As on the mode topic: the unit stays off, and a correlated command is rejected
+    LOG(F("Safe mode lockout enabled, ignoring settings command"));
+    beginOptimisticStateChange().power = HeatpumpSettings::Power::off;
+    hpReconciler.setPower(HeatpumpSettings::Power::off, Moment::now());
+    return;
+  }
+
+  mergeSettings(beginOptimisticStateChange(), command);
+  applySettings(command);
+  trackCommand(command.fields);
+}
+
+// The discovery payload is big and retained, so it's only rendered and published when its inputs
+// change or when Home Assistant comes online and asks for it (`force`). A hash of the inputs last
+// sent is kept in flash, so reconnecting or rebooting with nothing changed sends nothing.
+void sendHomeAssistantConfig(const bool force) {
   // setup HA payload device
   JsonDocument haConfig;
 
@@ -1848,12 +3159,95 @@ void sendHomeAssistantConfig() {
   // Additional attributes are in the state
   // For now, only compressorFrequency
   haConfig[F("json_attr_t")] = config.mqtt.ha_state_topic();
-
-  String mqttOutput = ministache::render(views::autoconfig, haConfig);
-
+  haConfig[F("diag_t")] = config.mqtt.ha_diagnostics_topic();
+
+  String inputs = ha_config_topic;
+  serializeJson(haConfig, inputs);
+  const uint32_t hash = fnv1a(inputs);
+  const JsonDocument sent = FileSystem::loadJSON(discovery_hash);
+  const bool changed = sent[F("hash")].as<uint32_t>() != hash;
+  const bool migrated = sent[F("migrated")] | false;
+  if (!changed && !force) {
+    return;
+  }
+  const String mqttOutput = ministache::render(views::autoconfig, haConfig);
+
+  // Earlier versions announced the climate entity on its own. Home Assistant moves that entity,
+  // with its name, area and history, over to the device if it's told to migrate before the device
+  // discovery arrives; only then is the old topic cleared. Clearing it straight away would delete
+  // the entity and have it recreated from scratch. This only has to happen once, and the migrate
+  // message isn't retained, so a failed attempt leaves nothing behind on the broker.
+  const String legacyTopic = config.other.haAutodiscoveryTopic + F("/climate/") +
+                             config.mqtt.friendlyName + F("/config");
+  if (!migrated) {
+    mqtt_client.publish(legacyTopic.c_str(), "{\"migrate_discovery\": true}", false);
+  }
+  // One device-level message declares every entity. It's streamed straight to the client rather
+  // than queued: it's bigger than the outbox allows for, and this way the client doesn't need a
+  // buffer the size of the payload either.
   mqtt_client.beginPublish(ha_config_topic.c_str(), mqttOutput.length(), true);
   mqtt_client.print(mqttOutput);
-  mqtt_client.endPublish();
+  if (mqtt_client.endPublish() != 1) {
+    return;
+  }
+  const bool cleared = migrated || mqtt_client.publish(legacyTopic.c_str(), "", true);
+  if (changed || cleared != migrated) {
+    JsonDocument doc;
+    doc[F("hash")] = hash;
+    doc[F("migrated")] = cleared;
+    FileSystem::saveJSON(discovery_hash, doc);
+  }
+}
+
+// Home Assistant announces itself on <discovery prefix>/status when it starts or reconnects to the
+// broker, and has forgotten any discovery it hasn't got retained. The loop sends it once the
+// callback has released the lock.
+void onHomeAssistantStatus(const char *message) {
+  if (strcmp(message, "online") == 0) {
+    haConfigRequested = true;
+  }
+}
+
+// Splits the configured groups, dropping any that are empty or would make a wildcard topic
+std::vector<String> mqttGroups(const String &groups) {
+  std::vector<String> names;
+  int start = 0;
+  while (start <= static_cast<int>(groups.length()) && names.size() < MQTT_MAX_GROUPS) {
+    int end = groups.indexOf(',', start);
+    if (end < 0) {
+      end = groups.length();
+    }
+    String name = groups.substring(start, end);
+    name.trim();
+    if (name.length() > 0 && name.indexOf('/') < 0 && name.indexOf('+') < 0 &&
+        name.indexOf('#') < 0) {
+      names.push_back(name);
+    }
+    start = end + 1;
+  }
+  return names;
+}
+
+// Group commands are handled exactly as the unit's own: <root>/groups/<group>/mode/set goes to the
+// same handler as <root>/<name>/mode/set, correlation ids and all. Acks still go to the unit's own
+// ack topic, so a controller can tell which units carried out a group command.
+void addMqttGroupTopics() {
+  const String unitPrefix = config.mqtt.rootTopic + F("/") + config.mqtt.friendlyName;
+  const String groupTopics[] = {
+      config.mqtt.ha_set_topic(),      config.mqtt.ha_mode_set_topic(),
+      config.mqtt.ha_temp_set_topic(), config.mqtt.ha_fan_set_topic(),
+      config.mqtt.ha_vane_set_topic(), config.mqtt.ha_wideVane_set_topic(),
+      config.mqtt.ha_remote_temp_set_topic()};
+  for (const String &group : mqttGroups(config.mqtt.groups)) {
+    const String groupPrefix = config.mqtt.rootTopic + F("/groups/") + group;
+    for (const String &topic : groupTopics) {
+      const String groupTopic = groupPrefix + topic.substring(unitPrefix.length());
+      mqttTopicHandlers[groupTopic] = mqttTopicHandlers[topic];
+      if (mqttCommandTopics.count(topic) != 0) {
+        mqttCommandTopics.insert(groupTopic);
+      }
+    }
+  }
 }
 
 void mqttConnect() {
@@ -1881,18 +3275,41 @@ void mqttConnect() {
                        {config.mqtt.ha_vane_set_topic(), onSetVane},
                        {config.mqtt.ha_wideVane_set_topic(), onSetWideVane},
                        {config.mqtt.ha_remote_temp_set_topic(), onSetRemoteTemp},
+                       {config.mqtt.ha_set_topic(), onSetSettings},
                        {config.mqtt.ha_system_set_topic(), onSetSystem},
                        {config.mqtt.ha_debug_pckts_set_topic(), onSetDebugPackets},
                        {config.mqtt.ha_debug_logs_set_topic(), onSetDebugLogs},
                        {config.mqtt.ha_custom_packet(), onSetCustomPacket}};
+  if (config.mqtt.remoteTempTopic.length() > 0) {
+    mqttTopicHandlers[config.mqtt.remoteTempTopic] = onSensorMessage;
+  }
+  if (config.other.haAutodiscovery) {
+    mqttTopicHandlers[config.other.haAutodiscoveryTopic + F("/status")] = onHomeAssistantStatus;
+  }
+  mqttCommandTopics = {config.mqtt.ha_mode_set_topic(), config.mqtt.ha_temp_set_topic(),
+                       config.mqtt.ha_fan_set_topic(), config.mqtt.ha_vane_set_topic(),
+                       config.mqtt.ha_wideVane_set_topic()};
+  addMqttGroupTopics();
   for (const auto &[topic, _] : mqttTopicHandlers) {
     mqtt_client.subscribe(topic.c_str());
   }
-  mqtt_client.publish(config.mqtt.ha_availability_topic().c_str(), mqtt_payload_available,
-                      true);  // publish status as available
+  for (const auto &topic : mqttCommandTopics) {
+    mqtt_client.subscribe((topic + F("/+")).c_str());
+  }
+  // Whatever we published while disconnected never arrived, so bring the broker up to date in
+  // one burst now instead of leaving Home Assistant stale until the next state timer
+  queueMqttMessage(MqttOutbox::Kind::availability, config.mqtt.ha_availability_topic(),
+                   mqtt_payload_available, true);  // publish status as available
+  queueMqttMessage(MqttOutbox::Kind::state, config.mqtt.ha_state_topic(),
+                   getHeatPumpStatePayload());
+  queueCompactState(hpState.getSettings(), hpState.getStatus());
+  queueMqttMessage(MqttOutbox::Kind::state, config.mqtt.ha_diagnostics_topic(),
+                   getDiagnosticsPayload());
+  lastMqttStatePacketSend = Moment::now();
   if (config.other.haAutodiscovery) {
-    sendHomeAssistantConfig();
+    sendHomeAssistantConfig(false);
   }
+  drainMqttOutbox();
 }
 
 bool connectWifi() {
@@ -1973,10 +3390,10 @@ String getId() {
 }
 
 // Check if header is present and correct
-bool is_authenticated() {
-  if (server.hasHeader("Cookie")) {
+bool is_authenticated(AsyncWebServerRequest *request) {
+  if (request->hasHeader("Cookie")) {
     // Found cookie; verify that it contains the session token for this client
-    if (server.header("Cookie").indexOf(sessionCookie()) != -1) {
+    if (request->header("Cookie").indexOf(sessionCookie(request)) != -1) {
       // Authentication Successful
       return true;
     }
@@ -1985,11 +3402,14 @@ bool is_authenticated() {
   return false;
 }
 
-bool checkLogin() {
-  if (!is_authenticated() and config.unit.login_password.length() > 0) {
-    server.sendHeader("Location", "/login");
-    server.sendHeader("Cache-Control", "no-cache");
-    server.send(httpFound, F("text/plain"), "Login required");
+// Logged in, or no login required
+bool isAuthorized(AsyncWebServerRequest *request) {
+  return config.unit.login_password.length() == 0 or is_authenticated(request);
+}
+
+bool checkLogin(AsyncWebServerRequest *request) {
+  if (!isAuthorized(request)) {
+    redirect(request, F("/login"));
     return false;
   }
   return true;
@@ -1997,6 +3417,8 @@ bool checkLogin() {
 
 void loop() {  // NOLINT(readability-function-cognitive-complexity)
   getTimer()->tick();
+  runDeferredWork();
+  snapshotQueueCounters();
 
   if (restartPending) {
     // We're waiting for the timeout specified in restartAfterDelay, we shouldn't process anything
@@ -2004,8 +3426,6 @@ void loop() {  // NOLINT(readability-function-cognitive-complexity)
     return;
   }
 
-  server.handleClient();
-
   // If wifi dropped out, nudge the stack to reconnect every WIFI_RECONNECT_INTERVAL_MS;
   // reset the board as a last resort if that hasn't succeeded within WIFI_RETRY_INTERVAL_MS.
   // Also reset if we've been sitting in AP mode for that long with a valid config.
@@ -2034,19 +3454,38 @@ void loop() {  // NOLINT(readability-function-cognitive-complexity)
     // if it's been CHECK_REMOTE_TEMP_INTERVAL_MS since last remote_temp
     // message was received, either revert back to HP internal temp sensor
     // or shut down.
-    if (remoteTempStale() && (remoteTempActive || config.other.safeMode)) {
-      if (config.other.safeMode) {
-        if (strcmp(hp.getPowerSetting(), "ON") == 0) {
-          LOG(F("Remote temperature updates aren't coming in, shutting down"));
-          hp.setPowerSetting("OFF");
+    {
+      const StateLock lock;
+      if (remoteTempStale() && (remoteTempActive || config.other.safeMode)) {
+        if (config.other.safeMode) {
+          if (hpState.getSettings().power == HeatpumpSettings::Power::on) {
+            LOG(F("Remote temperature updates aren't coming in, shutting down"));
+            hpReconciler.setPower(HeatpumpSettings::Power::off);
+          }
+        } else if (remoteTempActive) {
+          LOG(F("Remote temperature feed is stale, reverting to internal thermometer"));
+          remoteTempActive = false;
+          remoteTempFilter.reset();
+          warnIfDropped(hpCommands.pushRemoteTemperature(0.0f), "remote temperature");
         }
       } else if (remoteTempActive) {
-        LOG(F("Remote temperature feed is stale, reverting to internal thermometer"));
-        remoteTempActive = false;
-        hp.setRemoteTemperature(0.0f);
+        // Send any change the filter held back, or a refresh if one is due
+        Temperature forward(0.0f, TempUnit::C);
+        if (remoteTempFilter.poll(Moment::now(), forward)) {
+          warnIfDropped(hpCommands.pushRemoteTemperature(forward.getCelsius()),
+                        "remote temperature");
+        }
       }
     }
+    dispatchHeatpumpCommand();
+    {
+      const StateLock lock;
+      hpLink.onSync(millis());
+    }
     hp.sync();
+    const StateLock lock;
+    refreshHeatpumpState();
+    reconcileHeatpumpSettings();
   } else {
     LOG(F("HVAC not connected"));
     // Use exponential backoff for retries, where each retry is double the
@@ -2059,9 +3498,28 @@ void loop() {  // NOLINT(readability-function-cognitive-complexity)
       hpConnectionRetries = min(hpConnectionRetries + 1U, HP_MAX_RETRIES);
       hpConnectionTotalRetries++;
       LOG(F("Trying to reconnect to HVAC"));
+      {
+        const StateLock lock;
+        hpLink.onDisconnected();
+      }
       hp.sync();
+      const StateLock lock;
+      refreshHeatpumpState();
     }
   }
+  {
+    const StateLock lock;
+    recordHistory();
+    updateRuntime();
+    hpLink.expire(millis());
+  }
+  if (nextCounterCheckpoint == Moment::never()) {
+    nextCounterCheckpoint = Moment::now().offset(COUNTER_CHECKPOINT_INTERVAL_MS);
+  } else if (Moment::now() > nextCounterCheckpoint) {
+    checkpointCounters();
+  }
+  publishStateEvents();
+  flushTelemetry();
 
   if (config.mqtt.configured()) {
     // MQTT failed, retry to connect with the same exponential backoff scheme as the
@@ -2078,8 +3536,19 @@ void loop() {  // NOLINT(readability-function-cognitive-complexity)
     }
     // MQTT connected send status
     else {
+      // The client and the outbox belong to the loop, and both can block on the socket, so they
+      // run without the lock; the callback takes it for each command it dispatches
       mqtt_client.loop();
-      pushHeatPumpStateToMqtt();
+      {
+        const StateLock lock;
+        flushOptimisticStateChange();
+        pushHeatPumpStateToMqtt();
+      }
+      drainMqttOutbox();
+      if (haConfigRequested) {
+        haConfigRequested = false;
+        sendHomeAssistantConfig(true);
+      }
     }
   }
 }
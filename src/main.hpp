@@ -14,10 +14,18 @@
 */
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
 #include <HeatPump.h>
 
+#include <functional>
+#include <vector>
+
+#include "HeatpumpCommandAcks.hpp"
+#include "HeatpumpRuntime.hpp"
 #include "HeatpumpSettings.hpp"
 #include "HeatpumpStatus.hpp"
+#include "mqttoutbox.hpp"
 
 String getId();
 
@@ -27,41 +35,110 @@ void loadUnitConfig();
 void loadMqttConfig();
 
 bool initWifi();
-void handleRoot();
-void handleNotFound();
-void handleInitSetup();
-void handleSaveWifi();
-void handleReboot();
-void handleSetup();
-void handleMqtt();
-void handleUnitGet();
-void handleUnitPost();
-void handleWifi();
-void handleStatus();
-void handleOthers();
-void handleMetrics();
-void handleMetricsJson();
-void handleLogin();
-void handleAuth();
-void handleLogout();
-void handleUpgrade();
-void handleUploadDone();
-void handleUploadLoop();
-void handleControlGet();
-void handleControlPost();
+void runDeferredWork();
+void deferRestart(uint32_t delayMs);
+void redirect(AsyncWebServerRequest *request, const String &location, const String &cookie = "");
+void handleRoot(AsyncWebServerRequest *request);
+void handleNotFound(AsyncWebServerRequest *request);
+void handleInitSetup(AsyncWebServerRequest *request);
+void handleSaveWifi(AsyncWebServerRequest *request);
+void handleReboot(AsyncWebServerRequest *request);
+void handleSetup(AsyncWebServerRequest *request);
+void handleMqtt(AsyncWebServerRequest *request);
+void handleUnitGet(AsyncWebServerRequest *request);
+void handleUnitPost(AsyncWebServerRequest *request);
+void handleWifi(AsyncWebServerRequest *request);
+void handleStatus(AsyncWebServerRequest *request);
+void handleOthers(AsyncWebServerRequest *request);
+void handleMetrics(AsyncWebServerRequest *request);
+void handleMetricsJson(AsyncWebServerRequest *request);
+void handleHistoryJson(AsyncWebServerRequest *request);
+struct HistoryStream {
+  String pending;
+  uint32_t next;  // sample number, see HistoryRing::total()
+  uint32_t end;   // one past the newest sample when the request came in
+  bool first = true;
+  bool done = false;
+};
+void fillHistoryStream(HistoryStream &stream, size_t length);
+void handleLogin(AsyncWebServerRequest *request);
+void handleAuth(AsyncWebServerRequest *request);
+void handleLogout(AsyncWebServerRequest *request);
+void handleUpgrade(AsyncWebServerRequest *request);
+void handleUploadDone(AsyncWebServerRequest *request);
+void handleUploadLoop(AsyncWebServerRequest *request, const String &filename, size_t index,
+                      uint8_t *data, size_t len, bool final);
+void handleControlGet(AsyncWebServerRequest *request);
+void handleControlPost(AsyncWebServerRequest *request);
+String renderControlPage();
+String renderStateEvent();
+void addControlState(JsonDocument &doc, const HeatpumpSettings *previous,
+                     int16_t previousRoomCenti);
+void publishStateEvents();
+String renderMetrics();
+void snapshotQueueCounters();
+String renderCounters();
+void addRuntimeTotals(const JsonObject &runtimeTotals, const HeatpumpRuntime::Totals &totals);
+String renderMetricsJson(bool safeModeLockout);
+struct ApiState {
+  String body;
+  String etag;
+};
+bool checkApiLogin(AsyncWebServerRequest *request);
+void sendApiError(AsyncWebServerRequest *request, int code, const String &message);
+void handleApiState(AsyncWebServerRequest *request);
+ApiState renderApiState();
+uint32_t fnv1a(const String &text);
+struct SettingsCommand {
+  HeatpumpSettings settings;
+  uint8_t fields = 0;  // HeatpumpReconciler::Field
+  bool hasRemoteTemp = false;
+  float remoteTemp = 0.0f;
+};
+// How a batch of settings is spelled
+struct SettingsDialect {
+  const char *temperatureKey;
+  bool homeAssistantModes;  // Home Assistant's mode names, rather than the protocol's
+  bool clampTemperature;    // to the unit's range, rather than rejecting anything outside it
+};
+bool parseSettingsField(const char *key, JsonVariantConst value, const SettingsDialect &dialect,
+                        SettingsCommand &command);
+void mergeSettings(HeatpumpSettings &target, const SettingsCommand &command);
+void applySettings(const SettingsCommand &command);
+void handleApiControl(AsyncWebServerRequest *request, JsonVariant &json);
 void initMqtt();
 void initCaptivePortal();
 void hpPacketDebug(byte *packet_, unsigned int length, char *packetDirection_);
 float convertCelsiusToLocalUnit(float temperature, bool isFahrenheit);
 float convertLocalUnitToCelsius(float temperature, bool isFahrenheit);
-String hpGetMode(const HeatpumpSettings &hpSettings);
-String hpGetAction(const HeatpumpStatus &hpStatus, const HeatpumpSettings &hpSettings);
+String getDiagnosticsPayload();
+size_t encodeCompactState(const HeatpumpSettings &currentSettings,
+                          const HeatpumpStatus &currentStatus, uint8_t *buffer, size_t capacity);
+void queueCompactState(const HeatpumpSettings &currentSettings,
+                       const HeatpumpStatus &currentStatus);
+const char *hpGetMode(const HeatpumpSettings &hpSettings);
+const char *hpGetAction(const HeatpumpStatus &hpStatus, const HeatpumpSettings &hpSettings);
+using MqttTopicHandler = std::function<void(const char *)>;
 void mqttCallback(const char *topic, const byte *payload, unsigned int length);
+void runEnvelopedCommand(const MqttTopicHandler &handler, const char *message);
+void runCorrelatedCommand(const MqttTopicHandler &handler, const char *message, const char *id);
+void trackCommand(uint8_t fields);
+bool parseSettingsCommand(const JsonObjectConst &fields, SettingsCommand &command);
+void applySettingsCommand(const JsonObjectConst &fields);
+void onSetSettings(const char *message);
+void publishAck(const HeatpumpCommandAcks::Ack &ack);
 void onSetCustomPacket(const char *message);
 void onSetDebugLogs(const char *message);
 void onSetDebugPackets(const char *message);
 void onSetSystem(const char *message);
 void onSetRemoteTemp(const char *message);
+void setRemoteTemp(float temperature);
+void onSensorMessage(const char *message);
+void onHomeAssistantStatus(const char *message);
+std::vector<String> mqttGroups(const String &groups);
+void addMqttGroupTopics();
+void sendHomeAssistantConfig(bool force);
+void acceptRemoteTemp(const Temperature &temperature);
 void onSetWideVane(const char *message);
 void onSetVane(const char *message);
 void onSetFan(const char *message);
@@ -69,9 +146,26 @@ void onSetTemp(const char *message);
 void onSetMode(const char *message);
 void mqttConnect();
 bool connectWifi();
-bool checkLogin();
-HeatpumpSettings change_states(const HeatpumpSettings &settings);
+bool isAuthorized(AsyncWebServerRequest *request);
+bool checkLogin(AsyncWebServerRequest *request);
+void change_states(AsyncWebServerRequest *request);
+void reconcileHeatpumpSettings();
+void warnIfDropped(bool queued, const char *what);
+void dispatchHeatpumpCommand();
 String getTemperatureScale();
-String sessionCookie();
-bool is_authenticated();
-void hpCheckRemoteTemp();
\ No newline at end of file
+String sessionCookie(AsyncWebServerRequest *request);
+bool is_authenticated(AsyncWebServerRequest *request);
+void hpCheckRemoteTemp();
+void refreshHeatpumpState();
+void recordHistory();
+void updateRuntime();
+void restoreCounters();
+void checkpointCounters();
+void recordTelemetry(const heatpumpStatus &status);
+void flushTelemetry(bool force = false);
+HeatpumpSettings &beginOptimisticStateChange();
+void flushOptimisticStateChange();
+bool queueMqttMessage(MqttOutbox::Kind kind, const String &topic, const String &payload,
+                      bool retained = false);
+void queueMqttLog(const char *line);
+void drainMqttOutbox();
@@ -0,0 +1,30 @@
+// Minimal stand-in for SwiCago's HeatPump.h (https://github.com/SwiCago/HeatPump), declaring just
+// the plain structs that the heatpump library converts from.
+
+#pragma once
+
+struct heatpumpSettings {
+  const char *power;
+  const char *mode;
+  float temperature;
+  const char *fan;
+  const char *vane;      // vertical vane, up/down
+  const char *wideVane;  // horizontal vane, left/right
+  bool iSee;             // iSee sensor, at the moment can only detect it, not set it
+  bool connected;
+};
+
+struct heatpumpTimers {
+  const char *mode;
+  int onMinutesSet;
+  int onMinutesRemaining;
+  int offMinutesSet;
+  int offMinutesRemaining;
+};
+
+struct heatpumpStatus {
+  float roomTemperature;
+  bool operating;  // if true, the heatpump is operating to reach the desired temperature
+  heatpumpTimers timers;
+  int compressorFrequency;
+};
@@ -0,0 +1,652 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <HeatpumpCommandAcks.hpp>
+#include <HeatpumpCommandQueue.hpp>
+#include <HeatpumpLinkStats.hpp>
+#include <HeatpumpReconciler.hpp>
+#include <HeatpumpRuntime.hpp>
+#include <HeatpumpSettings.hpp>
+#include <HeatpumpState.hpp>
+#include <HeatpumpStatus.hpp>
+#include <RemoteTemperatureFilter.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using heatpump::Action;
+using heatpump::FanSpeed;
+using heatpump::Mode;
+using heatpump::Power;
+using heatpump::Vane;
+using heatpump::WideVane;
+
+TEST_CASE("codec tables are usable at compile time") {
+  static_assert(heatpump::fromProtocol<Mode>("COOL") == Mode::cool);
+  static_assert(heatpump::fromProtocol<Mode>("cool") == Mode::cool);
+  static_assert(heatpump::fromProtocol<Mode>("COOLER") == Mode::unknown);
+  static_assert(heatpump::fromProtocol<Mode>(nullptr) == Mode::unknown);
+  static_assert(heatpump::fromHomeAssistant<Mode>("HEAT_COOL") == Mode::automatic);
+  static_assert(heatpump::toMetric(WideVane::split) == 6);
+  static_assert(heatpump::toMetric(Vane::unknown) == heatpump::unknownMetric);
+  static_assert(heatpump::equalsIgnoreCase(heatpump::toHomeAssistant(Mode::fan), "fan_only"));
+  static_assert(heatpump::equalsIgnoreCase(heatpump::toProtocol(Power::on), "ON"));
+  CHECK(true);
+}
+
+TEST_CASE("protocol strings round trip") {
+  for (const auto &entry : heatpump::Codec<Mode>::entries) {
+    CHECK(heatpump::fromProtocol<Mode>(entry.protocol) == entry.value);
+    CHECK(strcmp(heatpump::toProtocol(entry.value), entry.protocol) == 0);
+  }
+  for (const auto &entry : heatpump::Codec<FanSpeed>::entries) {
+    CHECK(heatpump::fromProtocol<FanSpeed>(entry.protocol) == entry.value);
+  }
+  for (const auto &entry : heatpump::Codec<Vane>::entries) {
+    CHECK(heatpump::fromProtocol<Vane>(entry.protocol) == entry.value);
+  }
+  for (const auto &entry : heatpump::Codec<WideVane>::entries) {
+    CHECK(heatpump::fromProtocol<WideVane>(entry.protocol) == entry.value);
+  }
+  CHECK(strcmp(heatpump::toProtocol(Mode::unknown), "") == 0);
+}
+
+TEST_CASE("prometheus codes match the published dashboard") {
+  CHECK(heatpump::toMetric(Mode::automatic) == -1);
+  CHECK(heatpump::toMetric(Mode::cool) == 1);
+  CHECK(heatpump::toMetric(Mode::dry) == 2);
+  CHECK(heatpump::toMetric(Mode::heat) == 3);
+  CHECK(heatpump::toMetric(Mode::fan) == 4);
+  CHECK(heatpump::toMetric(Mode::unknown) == -2);
+  CHECK(heatpump::toMetric(FanSpeed::automatic) == -1);
+  CHECK(heatpump::toMetric(FanSpeed::quiet) == 0);
+  CHECK(heatpump::toMetric(FanSpeed::speed3) == 3);
+  CHECK(heatpump::toMetric(Vane::swing) == 0);
+  CHECK(heatpump::toMetric(WideVane::swing) == 0);
+  CHECK(heatpump::toMetric(WideVane::farLeft) == 1);
+}
+
+TEST_CASE("home assistant mode and action") {
+  CHECK(strcmp(heatpump::homeAssistantMode(Power::off, Mode::cool), "off") == 0);
+  CHECK(strcmp(heatpump::homeAssistantMode(Power::on, Mode::automatic), "heat_cool") == 0);
+  CHECK(strcmp(heatpump::homeAssistantMode(Power::on, Mode::fan), "fan_only") == 0);
+
+  CHECK(heatpump::homeAssistantAction(Power::off, Mode::heat, true) == Action::off);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::fan, false) == Action::fan);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::heat, false) == Action::idle);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::automatic, true) == Action::idle);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::heat, true) == Action::heating);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::cool, true) == Action::cooling);
+  CHECK(heatpump::homeAssistantAction(Power::on, Mode::dry, true) == Action::drying);
+  CHECK(strcmp(heatpump::toHomeAssistant(Action::cooling), "cooling") == 0);
+}
+
+TEST_CASE("settings snapshot") {
+  const heatpumpSettings raw{.power = "ON",
+                             .mode = "HEAT",
+                             .temperature = 21.5f,
+                             .fan = "QUIET",
+                             .vane = "SWING",
+                             .wideVane = "<>",
+                             .iSee = false,
+                             .connected = true};
+  const HeatpumpSettings settings(raw);
+
+  CHECK(sizeof(HeatpumpSettings) <= 10);
+  CHECK(settings.power == Power::on);
+  CHECK(settings.mode == Mode::heat);
+  CHECK(settings.temperature.getCentiCelsius() == 2150);
+  CHECK(settings.fan == FanSpeed::quiet);
+  CHECK(settings.vane == Vane::swing);
+  CHECK(settings.wideVane == WideVane::split);
+
+  const auto roundTrip = settings.getRaw();
+  CHECK(strcmp(roundTrip.power, "ON") == 0);
+  CHECK(strcmp(roundTrip.mode, "HEAT") == 0);
+  CHECK(roundTrip.temperature == 21.5f);
+  CHECK(strcmp(roundTrip.fan, "QUIET") == 0);
+  CHECK(strcmp(roundTrip.vane, "SWING") == 0);
+  CHECK(strcmp(roundTrip.wideVane, "<>") == 0);
+  CHECK(HeatpumpSettings(roundTrip) == settings);
+
+  auto changed = settings;
+  changed.fan = FanSpeed::speed2;
+  CHECK(changed != settings);
+
+  // The HeatPump library zero-initializes its settings until the unit first reports in
+  const HeatpumpSettings empty(heatpumpSettings{});
+  CHECK(empty.power == Power::off);
+  CHECK(empty.mode == Mode::unknown);
+}
+
+TEST_CASE("status snapshot") {
+  const heatpumpStatus raw{.roomTemperature = 19.f,
+                           .operating = true,
+                           .timers = {},
+                           .compressorFrequency = 42};
+  const HeatpumpStatus status(raw);
+  CHECK(status.roomTemperature.getCentiCelsius() == 1900);
+  CHECK(status.operating);
+  CHECK(status.compressorFrequency == 42);
+
+  auto changed = status;
+  CHECK(changed == status);
+  changed.compressorFrequency = 0;
+  CHECK(changed != status);
+}
+
+TEST_CASE("state snapshot versioning") {
+  HeatpumpState state;
+  CHECK(state.getVersion() == 0);
+  CHECK_FALSE(state.isConnected());
+
+  const heatpumpSettings rawSettings{.power = "ON",
+                                     .mode = "COOL",
+                                     .temperature = 24.f,
+                                     .fan = "AUTO",
+                                     .vane = "AUTO",
+                                     .wideVane = "|",
+                                     .iSee = false,
+                                     .connected = true};
+  const heatpumpStatus rawStatus{.roomTemperature = 26.f,
+                                 .operating = true,
+                                 .timers = {},
+                                 .compressorFrequency = 30};
+
+  CHECK(state.update(HeatpumpSettings(rawSettings), HeatpumpStatus(rawStatus), true));
+  CHECK(state.getVersion() == 1);
+  CHECK(state.isConnected());
+  CHECK(state.getSettings().mode == Mode::cool);
+  CHECK(state.getStatus().compressorFrequency == 30);
+
+  // Same snapshot again: no new version
+  CHECK_FALSE(state.update(HeatpumpSettings(rawSettings), HeatpumpStatus(rawStatus), true));
+  CHECK(state.getVersion() == 1);
+
+  auto status = state.getStatus();
+  status.compressorFrequency = 0;
+  CHECK(state.update(state.getSettings(), status, true));
+  CHECK(state.getVersion() == 2);
+  CHECK(state.update(state.getSettings(), status, false));
+  CHECK(state.getVersion() == 3);
+}
+
+TEST_CASE("versioned cache rebuilds only on version change") {
+  VersionedCache<int> cache;
+  int builds = 0;
+  const auto build = [&builds]() { return ++builds; };
+
+  CHECK(cache.get(0, build) == 1);
+  CHECK(cache.get(0, build) == 1);
+  CHECK(cache.get(1, build) == 2);
+  CHECK(cache.get(1, build) == 2);
+  cache.invalidate();
+  CHECK(cache.get(1, build) == 3);
+}
+
+TEST_CASE("reconciler merges requests and drops no-ops") {
+  const heatpumpSettings raw{.power = "ON",
+                             .mode = "COOL",
+                             .temperature = 24.f,
+                             .fan = "AUTO",
+                             .vane = "AUTO",
+                             .wideVane = "|",
+                             .iSee = false,
+                             .connected = true};
+  const HeatpumpSettings reported(raw);
+  HeatpumpReconciler reconciler;
+  Moment::resetRolloverCount();
+  HeatpumpSettings write = reported;
+
+  SUBCASE("nothing requested, nothing written") {
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(0), write));
+    CHECK(reconciler.getStats().writes == 0);
+  }
+
+  SUBCASE("requests matching the unit are dropped") {
+    reconciler.setMode(Mode::cool);
+    reconciler.setFan(FanSpeed::automatic);
+    reconciler.setTemperature(Temperature(24.f, Temperature::Unit::C));
+    CHECK_FALSE(reconciler.isPending(reported));
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(0), write));
+    CHECK(reconciler.getStats().writes == 0);
+    CHECK(reconciler.getStats().skipped == 3);
+  }
+
+  SUBCASE("a burst of requests becomes one write") {
+    reconciler.setMode(Mode::heat);
+    reconciler.setTemperature(Temperature(21.f, Temperature::Unit::C));
+    reconciler.setFan(FanSpeed::speed2);
+    reconciler.setVane(Vane::automatic);  // already set, nothing to do for this one
+    REQUIRE(reconciler.nextWrite(reported, Moment(0), write));
+    CHECK(write.power == Power::on);
+    CHECK(write.mode == Mode::heat);
+    CHECK(write.temperature.getCentiCelsius() == 2100);
+    CHECK(write.fan == FanSpeed::speed2);
+    CHECK(write.vane == Vane::automatic);
+    CHECK(write.wideVane == WideVane::center);
+    CHECK(reconciler.getStats().writes == 1);
+
+    // Waiting on the unit: no second write
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(100), write));
+
+    // The unit reports the new settings back
+    CHECK_FALSE(reconciler.isPending(write));
+    CHECK_FALSE(reconciler.nextWrite(write, Moment(200), write));
+    CHECK(reconciler.getStats().writes == 1);
+    CHECK(reconciler.getStats().retries == 0);
+  }
+
+  SUBCASE("a request during a write goes out straight away") {
+    reconciler.setMode(Mode::heat);
+    REQUIRE(reconciler.nextWrite(reported, Moment(0), write));
+    reconciler.setFan(FanSpeed::quiet);
+    REQUIRE(reconciler.nextWrite(reported, Moment(100), write));
+    CHECK(write.mode == Mode::heat);
+    CHECK(write.fan == FanSpeed::quiet);
+    CHECK(reconciler.getStats().writes == 2);
+  }
+
+  SUBCASE("unacknowledged writes are retried, then abandoned") {
+    reconciler.setPower(Power::off);
+    REQUIRE(reconciler.nextWrite(reported, Moment(0), write));
+    const int64_t timeout = HeatpumpReconciler::ackTimeoutMs;
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(timeout - 1), write));
+    CHECK(reconciler.nextWrite(reported, Moment(timeout), write));
+    CHECK(reconciler.nextWrite(reported, Moment(timeout * 2), write));
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(timeout * 3), write));
+    CHECK(reconciler.getStats().writes == 3);
+    CHECK(reconciler.getStats().retries == 2);
+    CHECK(reconciler.getStats().abandoned == 1);
+    CHECK_FALSE(reconciler.isPending(reported));
+  }
+
+  SUBCASE("repeating an outstanding request doesn't force another write") {
+    reconciler.setPower(Power::off);
+    REQUIRE(reconciler.nextWrite(reported, Moment(0), write));
+    reconciler.setPower(Power::off);
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(100), write));
+    CHECK(reconciler.getStats().writes == 1);
+  }
+
+  SUBCASE("temperatures are rounded to what the unit can report") {
+    reconciler.setTemperature(Temperature(24.2f, Temperature::Unit::C));
+    CHECK_FALSE(reconciler.isPending(reported));
+    reconciler.setTemperature(Temperature(72.f, Temperature::Unit::F));
+    REQUIRE(reconciler.nextWrite(reported, Moment(0), write));
+    CHECK(write.temperature.getCentiCelsius() == 2200);
+  }
+
+  SUBCASE("unknown values are ignored") {
+    reconciler.setMode(Mode::unknown);
+    reconciler.setWideVane(WideVane::unknown);
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(0), write));
+  }
+
+  SUBCASE("requests are timed until the unit reports them") {
+    reconciler.setMode(Mode::heat, Moment(1000));
+    reconciler.setFan(FanSpeed::quiet, Moment(1200));
+    reconciler.setVane(Vane::automatic, Moment(1200));  // already set, so never written or timed
+    REQUIRE(reconciler.nextWrite(reported, Moment(1250), write));
+    CHECK_FALSE(reconciler.nextWrite(reported, Moment(1800), write));
+
+    // Repeating a request doesn't restart its clock
+    reconciler.setMode(Mode::heat, Moment(2000));
+    CHECK_FALSE(reconciler.nextWrite(write, Moment(2200), write));
+    const auto &latency = reconciler.getLatency();
+    CHECK(latency.count() == 2);
+    CHECK(latency.getSum() == 1200 + 1000);
+    CHECK(latency.cumulative(1) == 0);
+    CHECK(latency.cumulative(2) == 1);
+    CHECK(latency.cumulative(3) == 2);
+    CHECK(reconciler.getStats().unconfirmed == 0);
+  }
+
+  SUBCASE("abandoned requests are never confirmed") {
+    reconciler.setPower(Power::off, Moment(0));
+    reconciler.setFan(FanSpeed::quiet, Moment(0));
+    const int64_t timeout = HeatpumpReconciler::ackTimeoutMs;
+    for (int64_t now = 0; now <= timeout * 3; now += timeout) {
+      reconciler.nextWrite(reported, Moment(now), write);
+    }
+    CHECK(reconciler.getStats().abandoned == 1);
+    CHECK(reconciler.getStats().unconfirmed == 2);
+    CHECK(reconciler.getLatency().count() == 0);
+  }
+}
+
+TEST_CASE("command queue ordering and deduplication") {
+  using Kind = HeatpumpCommandQueue::Kind;
+  HeatpumpCommandQueue queue;
+  HeatpumpCommandQueue::Command command;
+  const uint8_t packet[] = {0xfc, 0x42, 0x01, 0x30, 0x10};
+
+  CHECK_FALSE(queue.pop(command));
+
+  SUBCASE("user commands go before remote temperature updates") {
+    CHECK(queue.pushRemoteTemperature(20.f));
+    HeatpumpSettings settings(heatpumpSettings{});
+    settings.mode = Mode::heat;
+    CHECK(queue.pushSettings(settings));
+    CHECK(queue.pushCustomPacket(packet, sizeof(packet)));
+    CHECK(queue.size() == 3);
+
+    REQUIRE(queue.pop(command));
+    CHECK(command.kind == Kind::customPacket);
+    CHECK(command.length == sizeof(packet));
+    CHECK(command.packet[1] == 0x42);
+    REQUIRE(queue.pop(command));
+    CHECK(command.kind == Kind::settings);
+    CHECK(command.settings.mode == Mode::heat);
+    REQUIRE(queue.pop(command));
+    CHECK(command.kind == Kind::remoteTemperature);
+    CHECK_FALSE(queue.pop(command));
+    CHECK(queue.getStats().dispatched == 3);
+  }
+
+  SUBCASE("only the latest remote temperature is sent") {
+    CHECK(queue.pushRemoteTemperature(20.f));
+    CHECK(queue.pushCustomPacket(packet, sizeof(packet)));
+    CHECK(queue.pushRemoteTemperature(21.f));
+    CHECK(queue.pushRemoteTemperature(21.5f));
+    CHECK(queue.size() == 2);
+    CHECK(queue.getStats().replaced == 2);
+
+    REQUIRE(queue.pop(command));
+    REQUIRE(queue.pop(command));
+    CHECK(command.kind == Kind::remoteTemperature);
+    CHECK(command.remoteTemperature == 21.5f);
+  }
+
+  SUBCASE("custom packets keep their order") {
+    for (uint8_t idx = 0; idx < 3; idx++) {
+      const uint8_t numbered[] = {idx};
+      CHECK(queue.pushCustomPacket(numbered, sizeof(numbered)));
+    }
+    for (uint8_t idx = 0; idx < 3; idx++) {
+      REQUIRE(queue.pop(command));
+      CHECK(command.packet[0] == idx);
+    }
+  }
+
+  SUBCASE("overlong packets are refused") {
+    const uint8_t tooLong[HeatpumpCommandQueue::maxPacketLength + 1] = {};
+    CHECK_FALSE(queue.pushCustomPacket(tooLong, sizeof(tooLong)));
+    CHECK(queue.empty());
+  }
+
+  SUBCASE("a full queue evicts lower priority commands first") {
+    CHECK(queue.pushRemoteTemperature(20.f));
+    for (size_t idx = 1; idx < HeatpumpCommandQueue::capacity; idx++) {
+      CHECK(queue.pushCustomPacket(packet, sizeof(packet)));
+    }
+    CHECK(queue.getStats().highWater == HeatpumpCommandQueue::capacity);
+
+    // Pushes out the remote temperature update
+    CHECK(queue.pushCustomPacket(packet, sizeof(packet)));
+    CHECK(queue.size() == HeatpumpCommandQueue::capacity);
+    CHECK(queue.getStats().overflowed == 1);
+
+    // Nothing left that's lower priority
+    CHECK_FALSE(queue.pushCustomPacket(packet, sizeof(packet)));
+    CHECK_FALSE(queue.pushRemoteTemperature(21.f));
+    CHECK(queue.getStats().overflowed == 3);
+
+    while (queue.pop(command)) {
+      CHECK(command.kind == Kind::customPacket);
+    }
+  }
+}
+
+TEST_CASE("remote temperature forwarding policy") {
+  Moment::resetRolloverCount();
+  RemoteTemperatureFilter::Policy policy;
+  policy.minIntervalMs = 10000;
+  policy.refreshIntervalMs = 60000;
+  policy.minDeltaCenti = 10;
+  RemoteTemperatureFilter filter(policy);
+  Temperature forward(0.f, Temperature::Unit::C);
+  const auto celsius = [](const float value) { return Temperature(value, Temperature::Unit::C); };
+
+  // The first reading always goes through
+  REQUIRE(filter.offer(celsius(21.f), Moment(0), forward));
+  CHECK(forward.getCentiCelsius() == 2100);
+
+  SUBCASE("jitter is suppressed") {
+    CHECK_FALSE(filter.offer(celsius(21.05f), Moment(20000), forward));
+    CHECK_FALSE(filter.offer(celsius(20.96f), Moment(25000), forward));
+    CHECK(filter.getStats().received == 3);
+    CHECK(filter.getStats().forwarded == 1);
+  }
+
+  SUBCASE("real changes wait for the minimum interval") {
+    CHECK_FALSE(filter.offer(celsius(21.5f), Moment(2000), forward));
+    CHECK_FALSE(filter.poll(Moment(9999), forward));
+    REQUIRE(filter.poll(Moment(10000), forward));
+    CHECK(forward.getCentiCelsius() == 2150);
+    CHECK_FALSE(filter.poll(Moment(10001), forward));
+  }
+
+  SUBCASE("steady readings are refreshed") {
+    CHECK_FALSE(filter.poll(Moment(59999), forward));
+    REQUIRE(filter.poll(Moment(60000), forward));
+    CHECK(forward.getCentiCelsius() == 2100);
+    CHECK(filter.getStats().refreshed == 1);
+    CHECK(filter.getStats().forwarded == 2);
+  }
+
+  SUBCASE("smoothing") {
+    policy.newReadingPercent = 50;
+    filter.setPolicy(policy);
+    REQUIRE(filter.offer(celsius(22.f), Moment(10000), forward));
+    CHECK(forward.getCentiCelsius() == 2150);
+    REQUIRE(filter.offer(celsius(22.f), Moment(20000), forward));
+    CHECK(forward.getCentiCelsius() == 2175);
+  }
+
+  SUBCASE("heavy smoothing converges on a steady reading") {
+    policy.newReadingPercent = 5;
+    policy.minDeltaCenti = 1;
+    filter.setPolicy(policy);
+    for (int i = 1; i <= 1000; i++) {
+      filter.offer(celsius(22.f), Moment(i * 10000), forward);
+    }
+    CHECK(forward.getCentiCelsius() == 2200);
+    REQUIRE(filter.offer(celsius(20.f), Moment(10020000), forward));
+    CHECK(forward.getCentiCelsius() == 2190);
+    for (int i = 1003; i <= 2000; i++) {
+      filter.offer(celsius(20.f), Moment(i * 10000), forward);
+    }
+    CHECK(forward.getCentiCelsius() == 2000);
+  }
+
+  SUBCASE("reset starts over") {
+    filter.reset();
+    CHECK_FALSE(filter.poll(Moment(100000), forward));
+    REQUIRE(filter.offer(celsius(18.f), Moment(100001), forward));
+    CHECK(forward.getCentiCelsius() == 1800);
+  }
+}
+
+TEST_CASE("runtime and energy totals") {
+  Moment::resetRolloverCount();
+  HeatpumpRuntime::EnergyModel model;
+  model.idleWatts = 10;
+  model.compressorWatts = 100;
+  model.wattsPerHz = 20;
+  HeatpumpRuntime runtime(model);
+  using Power = heatpump::Power;
+  using Mode = heatpump::Mode;
+  const auto sample = [](const Power power, const Mode mode, const int frequency) {
+    return HeatpumpRuntime::Sample{true, power, mode, frequency};
+  };
+
+  runtime.update(Moment(0), sample(Power::on, Mode::heat, 0));
+  CHECK(runtime.getTotals().poweredMs == 0);
+
+  // An hour idle, then an hour at 45Hz
+  runtime.update(Moment(3600000), sample(Power::on, Mode::heat, 45));
+  runtime.update(Moment(7200000), sample(Power::on, Mode::cool, 30));
+  const auto &totals = runtime.getTotals();
+  CHECK(totals.poweredMs == 7200000);
+  CHECK(totals.modeMsFor(Mode::heat) == 7200000);
+  CHECK(totals.modeMsFor(Mode::cool) == 0);
+  CHECK(totals.compressorMs == 3600000);
+  CHECK(totals.compressorStarts == 1);
+  // 10Wh idle + (100 + 20 * 45)Wh running
+  CHECK(totals.energyKWh() == doctest::Approx(1.01));
+
+  SUBCASE("time goes to the mode the unit was in") {
+    runtime.update(Moment(7260000), sample(Power::on, Mode::cool, 30));
+    CHECK(totals.modeMsFor(Mode::cool) == 60000);
+    CHECK(totals.compressorStarts == 1);  // it never stopped
+  }
+
+  SUBCASE("switched off, only the compressor counts") {
+    runtime.update(Moment(7200000), sample(Power::off, Mode::cool, 0));
+    runtime.update(Moment(9000000), sample(Power::on, Mode::cool, 20));
+    CHECK(totals.poweredMs == 7200000);
+    CHECK(totals.compressorMs == 3600000);
+    CHECK(totals.compressorStarts == 2);
+  }
+
+  SUBCASE("disconnected time isn't counted") {
+    runtime.update(Moment(7200000), HeatpumpRuntime::Sample{false, Power::on, Mode::cool, 30});
+    runtime.update(Moment(9000000), sample(Power::on, Mode::cool, 30));
+    CHECK(totals.poweredMs == 7200000);
+    CHECK(totals.compressorStarts == 1);  // reconnecting isn't a start
+  }
+
+  SUBCASE("restored totals carry on growing") {
+    HeatpumpRuntime restarted(model);
+    restarted.restore(totals);
+    restarted.update(Moment(100), sample(Power::on, Mode::cool, 30));
+    restarted.update(Moment(1100), sample(Power::on, Mode::cool, 30));
+    CHECK(restarted.getTotals().poweredMs == 7201000);
+    CHECK(restarted.getTotals().modeMsFor(Mode::cool) == 1000);
+    CHECK(restarted.getTotals().compressorStarts == 1);
+  }
+}
+
+TEST_CASE("serial link statistics") {
+  using Direction = HeatpumpLinkStats::Direction;
+  using PacketType = HeatpumpLinkStats::PacketType;
+  const std::array<uint8_t, 8> connect = {0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01, 0xa8};
+  const std::array<uint8_t, 6> connected = {0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00};
+  std::array<uint8_t, 7> accepted = {0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00, 0x54};
+
+  HeatpumpLinkStats link;
+  CHECK(HeatpumpLinkStats::classify(0x62) == PacketType::info);
+  CHECK(HeatpumpLinkStats::checksumValid(connect.data(), connect.size()));
+  const std::array<uint8_t, 6> setSettings = {0xfc, 0x41, 0x01, 0x30, 0x10, 0x01};
+  const std::array<uint8_t, 6> setRemoteTemp = {0xfc, 0x41, 0x01, 0x30, 0x10, 0x07};
+  CHECK(HeatpumpLinkStats::isSettingsWrite(setSettings.data(), setSettings.size()));
+  CHECK_FALSE(HeatpumpLinkStats::isSettingsWrite(setRemoteTemp.data(), setRemoteTemp.size()));
+  CHECK_FALSE(HeatpumpLinkStats::isSettingsWrite(connect.data(), connect.size()));
+
+  link.onPacket(connect.data(), connect.size(), Direction::sent, 1000);
+  link.onPacket(accepted.data(), accepted.size(), Direction::received, 1180);
+  CHECK(link.getStats().packetsOf(Direction::sent, PacketType::connect) == 1);
+  CHECK(link.getStats().packetsOf(Direction::received, PacketType::connect) == 1);
+  CHECK(link.getLatency().count() == 1);
+  CHECK(link.getLatency().getSum() == 180);
+  CHECK(link.getLatency().cumulative(1) == 0);
+  CHECK(link.getLatency().cumulative(2) == 1);
+
+  SUBCASE("bad packets are counted and otherwise ignored") {
+    link.onPacket(connected.data(), connected.size(), Direction::received, 1200);
+    accepted[6] = 0x55;
+    link.onPacket(accepted.data(), accepted.size(), Direction::received, 1200);
+    CHECK(link.getStats().malformed == 0);
+    CHECK(link.getStats().checksumErrors == 2);
+    link.onPacket(accepted.data(), 3, Direction::received, 1200);
+    CHECK(link.getStats().malformed == 1);
+    CHECK(link.getStats().packetsOf(Direction::received, PacketType::connect) == 1);
+  }
+
+  SUBCASE("unanswered requests time out") {
+    link.onPacket(connect.data(), connect.size(), Direction::sent, 2000);
+    link.expire(3000);
+    CHECK(link.getStats().timeouts == 0);
+    link.expire(4001);
+    CHECK(link.getStats().timeouts == 1);
+
+    // A late reply is unsolicited, and a request sent over an unanswered one times it out
+    link.onPacket(accepted.data(), accepted.size(), Direction::received, 4100);
+    CHECK(link.getStats().unsolicited == 1);
+    link.onPacket(connect.data(), connect.size(), Direction::sent, 5000);
+    link.onPacket(connect.data(), connect.size(), Direction::sent, 5500);
+    CHECK(link.getStats().timeouts == 2);
+    CHECK(link.getLatency().count() == 1);
+  }
+
+  SUBCASE("gaps between syncs") {
+    link.onSync(0);
+    link.onSync(30);
+    link.onSync(UINT32_MAX - 10);  // wraps like millis()
+    link.onSync(20);
+    CHECK(link.getSyncInterval().count() == 3);
+    CHECK(link.getSyncInterval().cumulative(1) == 0);
+    CHECK(link.getSyncInterval().cumulative(2) == 2);
+
+    link.onDisconnected();
+    link.onSync(60000);
+    CHECK(link.getSyncInterval().count() == 3);
+  }
+}
+
+TEST_CASE("command acknowledgements") {
+  using Field = HeatpumpReconciler::Field;
+  HeatpumpCommandAcks acks;
+  std::vector<std::string> sent;
+  const auto emit = [&sent](const HeatpumpCommandAcks::Ack &ack) {
+    sent.push_back(std::string(ack.id) + " " + HeatpumpCommandAcks::statusName(ack.status) + " " +
+                   std::to_string(ack.latencyMs));
+  };
+
+  CHECK(HeatpumpCommandAcks::validId("abc"));
+  CHECK_FALSE(HeatpumpCommandAcks::validId(""));
+  CHECK_FALSE(HeatpumpCommandAcks::validId(std::string(41, 'x').c_str()));
+
+  acks.track("a", Field::power | Field::mode, Moment(1000), emit);
+  acks.track("b", Field::fan, Moment(1100), emit);
+  CHECK(acks.size() == 2);
+
+  SUBCASE("written, then confirmed once every field is reported") {
+    acks.queued(Field::power | Field::mode);
+    acks.written(Moment(1300), emit);
+    acks.written(Moment(1400), emit);  // only once
+    acks.settle(Field::power, 0, Moment(1500), emit);
+    acks.settle(Field::mode | Field::fan, 0, Moment(1900), emit);
+    CHECK(sent == std::vector<std::string>{"a written 300", "a confirmed 900", "b confirmed 800"});
+    CHECK(acks.size() == 0);
+  }
+
+  SUBCASE("a newer command for the same fields supersedes an older one") {
+    acks.track("c", Field::fan | Field::vane, Moment(1200), emit);
+    CHECK(sent == std::vector<std::string>{"b superseded -1"});
+    acks.settle(0, Field::vane, Moment(9000), emit);
+    CHECK(sent.back() == "c unconfirmed -1");
+    CHECK(acks.size() == 1);
+  }
+
+  SUBCASE("a command with nothing for the unit to confirm is accepted straight away") {
+    acks.track("d", 0, Moment(1200), emit);
+    CHECK(sent == std::vector<std::string>{"d accepted -1"});
+    CHECK(acks.size() == 2);
+  }
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
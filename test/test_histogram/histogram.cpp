@@ -0,0 +1,48 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <histogram.hpp>
+
+TEST_CASE("an empty histogram") {
+  const Histogram<3> histogram({10, 100, 1000});
+  CHECK(histogram.count() == 0);
+  CHECK(histogram.getSum() == 0);
+  CHECK(histogram.max() == 0);
+  CHECK(histogram.cumulative(Histogram<3>::buckets) == 0);
+}
+
+TEST_CASE("observations land in the first bucket that holds them") {
+  Histogram<3> histogram({10, 100, 1000});
+  histogram.observe(0);
+  histogram.observe(10);    // bounds are inclusive
+  histogram.observe(11);
+  histogram.observe(1000);
+  histogram.observe(5000);  // overflow
+
+  CHECK(histogram.bound(1) == 100);
+  CHECK(histogram.cumulative(0) == 2);
+  CHECK(histogram.cumulative(1) == 3);
+  CHECK(histogram.cumulative(2) == 4);
+  CHECK(histogram.cumulative(3) == 5);
+  CHECK(histogram.count() == 5);
+  CHECK(histogram.getSum() == 6021);
+  CHECK(histogram.max() == 5000);
+
+  histogram.clear();
+  CHECK(histogram.count() == 0);
+  CHECK(histogram.cumulative(3) == 0);
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
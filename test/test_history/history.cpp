@@ -0,0 +1,144 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <history.hpp>
+
+#include <vector>
+
+using Ring = HistoryRing<32, 4>;
+using Sample = Ring::Sample;
+
+namespace {
+std::vector<Sample> contents(const Ring &ring) {
+  std::vector<Sample> result;
+  ring.forEach([&result](const Sample &sample) { result.push_back(sample); });
+  return result;
+}
+
+Sample sample(int16_t room, int16_t target, uint8_t frequency, bool operating) {
+  return Sample{room, target, frequency, operating, true};
+}
+}  // namespace
+
+TEST_CASE("empty ring") {
+  const Ring ring;
+  CHECK(ring.size() == 0);
+  CHECK(ring.bytesUsed() == 0);
+  CHECK(contents(ring).empty());
+}
+
+TEST_CASE("samples round trip") {
+  Ring ring;
+  const std::vector<Sample> input{
+      sample(2150, 2200, 0, false),
+      sample(2150, 2200, 0, false),
+      sample(2163, 2200, 42, true),
+      sample(-1000, 3100, 255, true),
+      sample(32767, -32768, 1, false),
+      Sample{0, 0, 0, false, false},
+      sample(2100, 2200, 30, true),
+  };
+  for (const auto &entry : input) {
+    ring.append(entry);
+  }
+  CHECK(ring.size() == input.size());
+  CHECK(contents(ring) == input);
+}
+
+TEST_CASE("steady samples cost one byte each") {
+  Ring ring;
+  ring.append(sample(2150, 2200, 20, true));
+  const size_t first = ring.bytesUsed();
+  for (int idx = 0; idx < 10; idx++) {
+    ring.append(sample(2150, 2200, 20, true));
+  }
+  CHECK(ring.bytesUsed() == first + 10);
+}
+
+TEST_CASE("oldest block is dropped when full") {
+  Ring ring;
+  std::vector<Sample> input;
+  for (int16_t idx = 0; idx < 500; idx++) {
+    input.push_back(sample(static_cast<int16_t>(2000 + idx * 7), 2200, idx % 100, idx % 2 == 0));
+    ring.append(input.back());
+  }
+  CHECK(ring.bytesUsed() <= Ring::capacityBytes);
+
+  const auto kept = contents(ring);
+  REQUIRE(kept.size() == ring.size());
+  REQUIRE(kept.size() > 0);
+  CHECK(kept.size() < input.size());
+  // What's left is the most recent run of samples, intact
+  const std::vector<Sample> tail(input.end() - static_cast<std::ptrdiff_t>(kept.size()),
+                                 input.end());
+  CHECK(kept == tail);
+
+  ring.clear();
+  CHECK(ring.size() == 0);
+  ring.append(input.front());
+  CHECK(contents(ring) == std::vector<Sample>{input.front()});
+}
+
+TEST_CASE("reading in pieces picks up where it left off") {
+  Ring ring;
+  std::vector<Sample> input;
+  for (int16_t idx = 0; idx < 500; idx++) {
+    input.push_back(sample(static_cast<int16_t>(2000 + idx * 7), 2200, idx % 100, true));
+    ring.append(input.back());
+  }
+  CHECK(ring.total() == 500);
+  const auto kept = contents(ring);
+
+  SUBCASE("pieces add up to the whole") {
+    std::vector<Sample> read;
+    uint32_t next = ring.total() - ring.size();
+    while (next != ring.total()) {
+      size_t piece = 0;
+      next = ring.forEachFrom(next, [&read, &piece](const Sample &entry) {
+        read.push_back(entry);
+        return ++piece < 17;
+      });
+    }
+    CHECK(read == kept);
+  }
+
+  SUBCASE("samples dropped since the last piece are skipped") {
+    const uint32_t next = ring.total() - ring.size();
+    for (int16_t idx = 0; idx < 200; idx++) {
+      ring.append(sample(idx, 2200, 0, false));
+    }
+    size_t read = 0;
+    CHECK(ring.forEachFrom(next, [&read](const Sample & /*entry*/) {
+      read++;
+      return true;
+    }) == ring.total());
+    CHECK(read == ring.size());
+  }
+}
+
+TEST_CASE("a day of minute samples fits in a few KB") {
+  HistoryRing<> ring;
+  for (int minute = 0; minute < 24 * 60; minute++) {
+    // Room temperature wandering by a tenth of a degree every few minutes, compressor cycling
+    const int16_t room = static_cast<int16_t>(2100 + ((minute / 7) % 10) * 10);
+    const bool operating = (minute / 30) % 2 == 0;
+    ring.append(Sample{room, 2150, static_cast<uint8_t>(operating ? 40 : 0), operating, true});
+  }
+  CHECK(ring.size() == 24 * 60);
+  CHECK(HistoryRing<>::capacityBytes <= 4096);
+  MESSAGE("bytes used for a day: " << ring.bytesUsed());
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
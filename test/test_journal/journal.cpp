@@ -0,0 +1,169 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <counterjournal.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+class MemoryStorage : public CounterJournal::Storage {
+ public:
+  size_t size() override {
+    return bytes.size();
+  }
+
+  size_t read(const size_t offset, uint8_t *data, const size_t length) override {
+    const size_t count = offset < bytes.size() ? std::min(length, bytes.size() - offset) : 0;
+    std::copy_n(bytes.begin() + offset, count, data);
+    return count;
+  }
+
+  bool append(const uint8_t *data, const size_t length) override {
+    if (failWrites) {
+      return false;
+    }
+    bytes.insert(bytes.end(), data, data + length);
+    return true;
+  }
+
+  bool replace(const uint8_t *data, const size_t length) override {
+    if (failWrites) {
+      return false;
+    }
+    bytes.assign(data, data + length);
+    replaced++;
+    return true;
+  }
+
+  std::vector<uint8_t> bytes;
+  bool failWrites = false;
+  uint32_t replaced = 0;
+};
+}  // namespace
+
+TEST_CASE("an empty journal restores zeroes") {
+  MemoryStorage storage;
+  CounterJournal journal(storage);
+  CHECK(journal.restore() == 0);
+  CHECK(journal.get(0) == 0);
+  CHECK(journal.get(CounterJournal::maxCounters) == 0);
+  CHECK(journal.checkpoint());
+  CHECK(storage.bytes.empty());
+}
+
+TEST_CASE("checkpoints append only what changed") {
+  MemoryStorage storage;
+  CounterJournal journal(storage);
+  journal.restore();
+
+  journal.set(0, 5);
+  journal.set(3, 1ULL << 40);
+  CHECK(journal.checkpoint());
+  CHECK(storage.bytes.size() == 2 * CounterJournal::recordBytes);
+
+  journal.set(0, 7);
+  CHECK(journal.checkpoint());
+  CHECK(storage.bytes.size() == 3 * CounterJournal::recordBytes);
+  CHECK(journal.getStats().appended == 3);
+
+  // Nothing changed, nothing written
+  CHECK(journal.checkpoint());
+  CHECK(storage.bytes.size() == 3 * CounterJournal::recordBytes);
+
+  CounterJournal restored(storage);
+  CHECK(restored.restore() == 3);
+  CHECK(restored.get(0) == 7);
+  CHECK(restored.get(3) == 1ULL << 40);
+  CHECK(restored.get(1) == 0);
+}
+
+TEST_CASE("a counter that goes down restores correctly") {
+  MemoryStorage storage;
+  CounterJournal journal(storage);
+  journal.set(2, 100);
+  journal.checkpoint();
+  journal.set(2, 40);
+  journal.checkpoint();
+
+  CounterJournal restored(storage);
+  restored.restore();
+  CHECK(restored.get(2) == 40);
+}
+
+TEST_CASE("the journal is compacted when it reaches its size limit") {
+  MemoryStorage storage;
+  CounterJournal journal(storage, 2 * CounterJournal::snapshotBytes);
+  for (uint64_t value = 1; value <= 100; value++) {
+    journal.set(0, value);
+    journal.set(1, value * 2);
+    CHECK(journal.checkpoint());
+    CHECK(storage.bytes.size() <= 2 * CounterJournal::snapshotBytes);
+  }
+  CHECK(journal.getStats().compactions > 0);
+  CHECK(storage.replaced == journal.getStats().compactions);
+
+  CounterJournal restored(storage);
+  restored.restore();
+  CHECK(restored.get(0) == 100);
+  CHECK(restored.get(1) == 200);
+}
+
+TEST_CASE("a torn write is dropped and compacted away") {
+  MemoryStorage storage;
+  CounterJournal journal(storage);
+  journal.set(0, 10);
+  journal.checkpoint();
+  journal.set(0, 20);
+  journal.checkpoint();
+
+  SUBCASE("truncated record") {
+    storage.bytes.resize(storage.bytes.size() - 3);
+  }
+  SUBCASE("corrupt record") {
+    storage.bytes.back() ^= 0xff;
+  }
+
+  CounterJournal restored(storage);
+  CHECK(restored.restore() == 1);
+  CHECK(restored.get(0) == 10);
+  CHECK(restored.getStats().discarded > 0);
+
+  restored.set(0, 15);
+  CHECK(restored.checkpoint());
+  CHECK(storage.replaced == 1);
+  CHECK(storage.bytes.size() == CounterJournal::recordBytes);
+
+  CounterJournal again(storage);
+  again.restore();
+  CHECK(again.get(0) == 15);
+}
+
+TEST_CASE("changes survive a failed write") {
+  MemoryStorage storage;
+  CounterJournal journal(storage);
+  journal.set(4, 9);
+  storage.failWrites = true;
+  CHECK_FALSE(journal.checkpoint());
+  CHECK(journal.getStats().failed == 1);
+
+  storage.failWrites = false;
+  CHECK(journal.checkpoint());
+  CounterJournal restored(storage);
+  restored.restore();
+  CHECK(restored.get(4) == 9);
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
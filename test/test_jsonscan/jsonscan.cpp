@@ -0,0 +1,79 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <jsonscan.hpp>
+
+TEST_CASE("top level fields") {
+  float value = -1.f;
+  const char *zigbee =
+      R"({"battery":97,"humidity":41.2,"linkquality":120,"temperature":21.37,"voltage":2995})";
+  CHECK(jsonscan::findNumber(zigbee, "temperature", value));
+  CHECK(value == doctest::Approx(21.37f));
+  CHECK(jsonscan::findNumber(zigbee, "battery", value));
+  CHECK(value == 97.f);
+  CHECK(jsonscan::findNumber(zigbee, "voltage", value));
+  CHECK(value == 2995.f);
+}
+
+TEST_CASE("missing or non-numeric fields leave the value alone") {
+  float value = -1.f;
+  const char *json = R"({"temperature":null,"name":"bedroom","ok":true,"list":[1,2]})";
+  CHECK_FALSE(jsonscan::findNumber(json, "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber(json, "name", value));
+  CHECK_FALSE(jsonscan::findNumber(json, "ok", value));
+  CHECK_FALSE(jsonscan::findNumber(json, "list", value));
+  CHECK_FALSE(jsonscan::findNumber(json, "humidity", value));
+  CHECK_FALSE(jsonscan::findNumber("{}", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber("", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber(nullptr, "temperature", value));
+  CHECK(value == -1.f);
+}
+
+TEST_CASE("nested paths") {
+  float value = 0.f;
+  const char *json = R"({
+    "device": {"name": "sensor, \"the\" {best}", "ids": [[1], {"temperature": 5}]},
+    "sensor": {"temperature": {"value": 19.5, "unit": "C"}, "temperature_alt": 3}
+  })";
+  CHECK(jsonscan::findNumber(json, "sensor.temperature.value", value));
+  CHECK(value == 19.5f);
+  CHECK_FALSE(jsonscan::findNumber(json, "sensor.temperature", value));
+  CHECK(jsonscan::findNumber(json, "sensor.temperature_alt", value));
+  CHECK(value == 3.f);
+  CHECK_FALSE(jsonscan::findNumber(json, "temperature", value));
+}
+
+TEST_CASE("bare numbers and numeric strings") {
+  float value = 0.f;
+  CHECK(jsonscan::findNumber("22.5", "", value));
+  CHECK(value == 22.5f);
+  CHECK(jsonscan::findNumber(" -3 ", "", value));
+  CHECK(value == -3.f);
+  CHECK(jsonscan::findNumber(R"({"temperature":"20.25"})", "temperature", value));
+  CHECK(value == 20.25f);
+  CHECK_FALSE(jsonscan::findNumber(R"({"temperature":"warm"})", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber(R"({"temperature":"nan"})", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber("{}", "", value));
+}
+
+TEST_CASE("malformed documents") {
+  float value = 0.f;
+  CHECK_FALSE(jsonscan::findNumber(R"({"a":{"b":1)", "c", value));
+  CHECK_FALSE(jsonscan::findNumber(R"({"a" 1, "temperature": 2})", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber(R"({"a":"unterminated)", "temperature", value));
+  CHECK_FALSE(jsonscan::findNumber(R"({"a":[1,2, "temperature": 2})", "temperature", value));
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
@@ -0,0 +1,189 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <mqttoutbox.hpp>
+
+#include <string>
+#include <vector>
+
+using Kind = MqttOutbox::Kind;
+
+namespace {
+std::vector<std::string> drainAll(MqttOutbox &outbox) {
+  std::vector<std::string> sent;
+  outbox.drain(
+      [&sent](const MqttOutbox::Message &message) {
+        sent.push_back(message.topic + "=" + message.payload);
+        return true;
+      },
+      [] { return false; });
+  return sent;
+}
+}  // namespace
+
+TEST_CASE("messages drain by priority, then in arrival order") {
+  MqttOutbox outbox;
+  CHECK(outbox.push(Kind::debugPacket, "debug/packets", "fc 41"));
+  CHECK(outbox.push(Kind::log, "debug/logs", "one"));
+  CHECK(outbox.push(Kind::availability, "status", "online", true));
+  CHECK(outbox.push(Kind::log, "debug/logs", "two"));
+  CHECK(outbox.push(Kind::telemetry, "telemetry", "batch"));
+  CHECK(outbox.push(Kind::state, "state", "{}"));
+  CHECK(outbox.size() == 6);
+  CHECK(drainAll(outbox) == std::vector<std::string>{"state={}", "status=online", "debug/logs=one",
+                                                     "debug/logs=two", "telemetry=batch",
+                                                     "debug/packets=fc 41"});
+  CHECK(outbox.empty());
+  CHECK(outbox.bytesQueued() == 0);
+  CHECK(outbox.getStats().published == 6);
+}
+
+TEST_CASE("a newer state message replaces the queued one") {
+  MqttOutbox outbox;
+  outbox.push(Kind::state, "state", "{\"temperature\":21}");
+  outbox.push(Kind::log, "debug/logs", "hello");
+  outbox.push(Kind::state, "state", "{\"temperature\":22}");
+  outbox.push(Kind::state, "other/state", "{}");
+  CHECK(outbox.size() == 3);
+  CHECK(outbox.getStats().coalesced == 1);
+  CHECK(drainAll(outbox) == std::vector<std::string>{"state={\"temperature\":22}", "other/state={}",
+                                                     "debug/logs=hello"});
+
+  SUBCASE("log lines are never merged") {
+    outbox.push(Kind::log, "debug/logs", "a");
+    outbox.push(Kind::log, "debug/logs", "a");
+    CHECK(outbox.size() == 2);
+  }
+
+  SUBCASE("nor are acknowledgements, which go ahead of logs") {
+    outbox.push(Kind::log, "debug/logs", "a");
+    outbox.push(Kind::ack, "ack", "1");
+    outbox.push(Kind::ack, "ack", "2");
+    CHECK(drainAll(outbox) == std::vector<std::string>{"ack=1", "ack=2", "debug/logs=a"});
+  }
+}
+
+TEST_CASE("a full queue sheds the lowest priority messages first") {
+  MqttOutbox outbox;
+  for (size_t idx = 0; idx < MqttOutbox::capacity; idx++) {
+    CHECK(outbox.push(idx % 2 == 0 ? Kind::debugPacket : Kind::log, "debug",
+                      std::to_string(idx).c_str()));
+  }
+  CHECK(outbox.getStats().highWater == MqttOutbox::capacity);
+
+  SUBCASE("state evicts the newest packet dump") {
+    CHECK(outbox.push(Kind::state, "state", "{}"));
+    CHECK(outbox.size() == MqttOutbox::capacity);
+    CHECK(outbox.getStats().dropped[static_cast<size_t>(Kind::debugPacket)] == 1);
+    const auto sent = drainAll(outbox);
+    CHECK(sent.front() == "state={}");
+    CHECK(sent.back() == "debug=12");
+  }
+
+  SUBCASE("a log line evicts packet dumps but not other log lines") {
+    for (size_t idx = 0; idx < MqttOutbox::capacity / 2; idx++) {
+      CHECK(outbox.push(Kind::log, "debug", "log"));
+    }
+    CHECK(outbox.getStats().dropped[static_cast<size_t>(Kind::debugPacket)] ==
+          MqttOutbox::capacity / 2);
+    CHECK_FALSE(outbox.push(Kind::log, "debug", "log"));
+    CHECK(outbox.getStats().dropped[static_cast<size_t>(Kind::log)] == 1);
+  }
+
+  SUBCASE("a packet dump with nothing lower to evict is turned away") {
+    CHECK_FALSE(outbox.push(Kind::debugPacket, "debug", "late"));
+    CHECK(outbox.size() == MqttOutbox::capacity);
+  }
+}
+
+TEST_CASE("the byte limit sheds messages too") {
+  MqttOutbox outbox;
+  const std::string big(MqttOutbox::maxBytes / 2, 'x');
+  CHECK(outbox.push(Kind::debugPacket, "a", big.c_str()));
+  CHECK(outbox.push(Kind::log, "b", "small"));
+  CHECK(outbox.push(Kind::state, "c", big.c_str()));
+  CHECK(outbox.size() == 2);
+  CHECK(outbox.bytesQueued() <= MqttOutbox::maxBytes);
+
+  const std::string tooBig(MqttOutbox::maxBytes + 1, 'x');
+  CHECK_FALSE(outbox.push(Kind::state, "d", tooBig.c_str()));
+  CHECK(outbox.size() == 2);
+}
+
+TEST_CASE("draining stops when the budget runs out") {
+  MqttOutbox outbox;
+  for (int idx = 0; idx < 5; idx++) {
+    outbox.push(Kind::log, "debug/logs", "line");
+  }
+  int published = 0;
+  const auto publish = [&published](const MqttOutbox::Message & /*message*/) {
+    published++;
+    return true;
+  };
+
+  SUBCASE("at least one message goes out per pass") {
+    CHECK(outbox.drain(publish, [] { return true; }) == 1);
+    CHECK(outbox.size() == 4);
+  }
+
+  SUBCASE("a budget of three messages") {
+    CHECK(outbox.drain(publish, [&published] { return published >= 3; }) == 3);
+    CHECK(outbox.size() == 2);
+  }
+
+  SUBCASE("a refused message is dropped rather than retried") {
+    CHECK(outbox.drain([](const MqttOutbox::Message & /*message*/) { return false; },
+                       [] { return false; }) == 5);
+    CHECK(outbox.empty());
+    CHECK(outbox.getStats().failed == 5);
+  }
+
+  SUBCASE("a refused ack is kept for the reconnect") {
+    outbox.push(Kind::ack, "ack", "{\"id\":\"a\"}");
+    const auto refuse = [](const MqttOutbox::Message & /*message*/) { return false; };
+    CHECK(outbox.drain(refuse, [] { return false; }) == 0);
+    CHECK(outbox.size() == 6);
+    CHECK(drainAll(outbox).front() == "ack={\"id\":\"a\"}");
+    CHECK(outbox.getStats().failed == 1);
+  }
+
+  SUBCASE("but not forever") {
+    outbox.clear();
+    outbox.push(Kind::ack, "ack", "{\"id\":\"a\"}");
+    const auto refuse = [](const MqttOutbox::Message & /*message*/) { return false; };
+    for (uint8_t attempt = 1; attempt < MqttOutbox::maxAckAttempts; attempt++) {
+      CHECK(outbox.drain(refuse, [] { return false; }) == 0);
+    }
+    CHECK(outbox.drain(refuse, [] { return false; }) == 1);
+    CHECK(outbox.empty());
+  }
+}
+
+TEST_CASE("binary payloads keep their nulls") {
+  MqttOutbox outbox;
+  const uint8_t payload[] = {0x82, 0xa1, 't', 0x00, 0xc3};
+  CHECK(outbox.push(Kind::state, "state/msgpack", payload, sizeof(payload)));
+  CHECK(outbox.bytesQueued() == std::string("state/msgpack").size() + sizeof(payload));
+  size_t published = 0;
+  outbox.drain(
+      [&published](const MqttOutbox::Message &message) {
+        published = message.payload.size();
+        return true;
+      },
+      [] { return false; });
+  CHECK(published == sizeof(payload));
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
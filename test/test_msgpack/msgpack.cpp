@@ -0,0 +1,109 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <msgpack.hpp>
+
+#include <array>
+#include <string>
+#include <vector>
+
+namespace {
+template <typename Write>
+std::vector<uint8_t> encode(Write &&write, const size_t capacity = 64) {
+  std::vector<uint8_t> buffer(capacity);
+  MsgpackWriter writer(buffer.data(), buffer.size());
+  write(writer);
+  REQUIRE(writer.ok());
+  buffer.resize(writer.size());
+  return buffer;
+}
+
+using Bytes = std::vector<uint8_t>;
+}  // namespace
+
+TEST_CASE("integers take the smallest encoding") {
+  CHECK(encode([](MsgpackWriter &w) { w.integer(0); }) == Bytes{0x00});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(127); }) == Bytes{0x7f});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(128); }) == Bytes{0xcc, 0x80});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(300); }) == Bytes{0xcd, 0x01, 0x2c});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(70000); }) == Bytes{0xce, 0x00, 0x01, 0x11, 0x70});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(-1); }) == Bytes{0xff});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(-32); }) == Bytes{0xe0});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(-33); }) == Bytes{0xd0, 0xdf});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(-200); }) == Bytes{0xd1, 0xff, 0x38});
+  CHECK(encode([](MsgpackWriter &w) { w.integer(-40000); }) ==
+        Bytes{0xd2, 0xff, 0xff, 0x63, 0xc0});
+  CHECK(encode([](MsgpackWriter &w) { w.unsignedInteger(UINT64_MAX); }) ==
+        Bytes{0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff});
+}
+
+TEST_CASE("scalars") {
+  CHECK(encode([](MsgpackWriter &w) { w.boolean(true); }) == Bytes{0xc3});
+  CHECK(encode([](MsgpackWriter &w) { w.boolean(false); }) == Bytes{0xc2});
+  CHECK(encode([](MsgpackWriter &w) { w.nil(); }) == Bytes{0xc0});
+  CHECK(encode([](MsgpackWriter &w) { w.number(21.5f); }) == Bytes{0xca, 0x41, 0xac, 0x00, 0x00});
+  CHECK(encode([](MsgpackWriter &w) { w.number(-1.0f); }) == Bytes{0xca, 0xbf, 0x80, 0x00, 0x00});
+}
+
+TEST_CASE("strings") {
+  CHECK(encode([](MsgpackWriter &w) { w.str(""); }) == Bytes{0xa0});
+  CHECK(encode([](MsgpackWriter &w) { w.str("AUTO"); }) == Bytes{0xa4, 'A', 'U', 'T', 'O'});
+
+  const std::string longer(40, 'x');
+  const auto encoded = encode([&longer](MsgpackWriter &w) { w.str(longer.c_str()); });
+  CHECK(encoded.size() == 42);
+  CHECK(encoded[0] == 0xd9);
+  CHECK(encoded[1] == 40);
+
+  const std::string longest(300, 'x');
+  const auto bigger = encode([&longest](MsgpackWriter &w) { w.str(longest.c_str()); }, 400);
+  CHECK(bigger.size() == 303);
+  CHECK(Bytes(bigger.begin(), bigger.begin() + 3) == Bytes{0xda, 0x01, 0x2c});
+}
+
+TEST_CASE("maps") {
+  CHECK(encode([](MsgpackWriter &w) {
+          w.map(2);
+          w.str("t");
+          w.number(21.5f);
+          w.str("o");
+          w.boolean(true);
+        }) == Bytes{0x82, 0xa1, 't', 0xca, 0x41, 0xac, 0x00, 0x00, 0xa1, 'o', 0xc3});
+  CHECK(encode([](MsgpackWriter &w) { w.map(16); }) == Bytes{0xde, 0x00, 0x10});
+}
+
+TEST_CASE("arrays") {
+  CHECK(encode([](MsgpackWriter &w) {
+          w.array(3);
+          w.integer(1);
+          w.nil();
+          w.str("a");
+        }) == Bytes{0x93, 0x01, 0xc0, 0xa1, 'a'});
+  CHECK(encode([](MsgpackWriter &w) { w.array(300); }) == Bytes{0xdc, 0x01, 0x2c});
+}
+
+TEST_CASE("a full buffer stops the writer rather than overrunning it") {
+  std::array<uint8_t, 8> buffer{};
+  buffer.fill(0xee);
+  MsgpackWriter writer(buffer.data(), 4);
+  writer.str("AUTO");
+  CHECK_FALSE(writer.ok());
+  CHECK(writer.size() == 1);  // just the header made it
+  writer.boolean(true);
+  CHECK(writer.size() == 1);
+  CHECK(buffer[4] == 0xee);
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
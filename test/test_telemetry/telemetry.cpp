@@ -0,0 +1,83 @@
+#define DOCTEST_CONFIG_IMPLEMENT  // REQUIRED: Enable custom main()
+#include <doctest.h>
+
+#include <telemetry.hpp>
+
+#include <array>
+#include <vector>
+
+using Batch = TelemetryBatch<4>;
+using Bytes = std::vector<uint8_t>;
+
+namespace {
+Bytes encode(const Batch &batch) {
+  std::array<uint8_t, Batch::maxEncodedBytes> buffer{};
+  const size_t length = batch.encode(buffer.data(), buffer.size());
+  return Bytes(buffer.begin(), buffer.begin() + length);
+}
+}  // namespace
+
+TEST_CASE("an empty batch") {
+  const Batch batch;
+  CHECK(batch.empty());
+  CHECK_FALSE(batch.due(100000, 1000));
+  CHECK(encode(batch) == Bytes{0x82, 0xa1, 't', 0x00, 0xa1, 's', 0x90});
+}
+
+TEST_CASE("samples are timed from the first one") {
+  Batch batch;
+  CHECK(batch.add({70000, 2150, 42, true}));
+  CHECK(batch.add({70250, -150, 0, false}));
+  CHECK(encode(batch) == Bytes{0x82, 0xa1, 't', 0xce, 0x00, 0x01, 0x11, 0x70,  // t: 70000
+                               0xa1, 's', 0x92,                                // s: 2 samples
+                               0x94, 0x00, 0xcd, 0x08, 0x66, 0x2a, 0xc3,      // 0, 2150, 42, true
+                               0x94, 0xcc, 0xfa, 0xd1, 0xff, 0x6a, 0x00, 0xc2});
+}
+
+TEST_CASE("a batch is due when it's full or old enough") {
+  Batch batch;
+  batch.add({1000, 2000, 10, true});
+  CHECK_FALSE(batch.due(1500, 1000));
+  CHECK(batch.due(2000, 1000));
+
+  SUBCASE("full") {
+    batch.add({1001, 2000, 10, true});
+    batch.add({1002, 2000, 10, true});
+    CHECK_FALSE(batch.due(1003, 1000));
+    CHECK(batch.add({1003, 2000, 10, true}));
+    CHECK(batch.due(1003, 1000));
+    CHECK_FALSE(batch.add({1004, 2000, 10, true}));
+    CHECK(batch.size() == Batch::capacity);
+  }
+
+  SUBCASE("across the millis() rollover") {
+    Batch late;
+    late.add({UINT32_MAX - 100, 2000, 10, true});
+    CHECK_FALSE(late.due(UINT32_MAX, 1000));
+    CHECK(late.due(1000, 1000));
+  }
+}
+
+TEST_CASE("a full batch of worst-case samples fits the advertised size") {
+  TelemetryBatch<16> batch;
+  for (size_t idx = 0; idx < 16; idx++) {
+    batch.add({static_cast<uint32_t>(idx * 0x10000000UL), INT16_MIN, UINT8_MAX, true});
+  }
+  std::array<uint8_t, TelemetryBatch<16>::maxEncodedBytes> buffer{};
+  CHECK(batch.encode(buffer.data(), buffer.size()) > 0);
+  CHECK(batch.encode(buffer.data(), 20) == 0);
+}
+
+int main(int argc, char **argv) {
+  doctest::Context context;
+
+  // BEGIN:: PLATFORMIO REQUIRED OPTIONS
+  context.setOption("success", true);      // Report successful tests
+  context.setOption("no-exitcode", true);  // Do not return non-zero code on failed test case
+  // END:: PLATFORMIO REQUIRED OPTIONS
+
+  // YOUR CUSTOM DOCTEST OPTIONS
+
+  context.applyCommandLine(argc, argv);
+  return context.run();
+}
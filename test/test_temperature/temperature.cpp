@@ -3,6 +3,8 @@
 
 #include <temperature.hpp>
 
+#include <chrono>
+
 TEST_CASE("testing celsius to fahrenheit") {
   CHECK(std::round(Temperature::celsiusToFahrenheit(0.f)) == 32.f);
   CHECK(std::round(Temperature::celsiusToFahrenheit(37.f)) == 99.f);
@@ -55,14 +57,134 @@ TEST_CASE("test toString with temperature step") {
   CHECK(t.toString(Temperature::Unit::C, 1.0f) == "38");
   CHECK(t.toString(Temperature::Unit::C, 0.5f) == "37.5");
   CHECK(t.toString(Temperature::Unit::C, 0.1f) == "37.6");
-  CHECK(t.toString(Temperature::Unit::C, 0.0f) == "37.560001");
-  CHECK(t.toString(Temperature::Unit::C, -0.1f) == "37.560001");
+  // Unrounded output is limited to the hundredths of a degree we store internally
+  CHECK(t.toString(Temperature::Unit::C, 0.0f) == "37.56");
+  CHECK(t.toString(Temperature::Unit::C, -0.1f) == "37.56");
 
   CHECK(t.toString(Temperature::Unit::F, 1.0f) == "100");
   CHECK(t.toString(Temperature::Unit::F, 0.5f) == "99.5");
   CHECK(t.toString(Temperature::Unit::F, 0.1f) == "99.6");
 }
 
+TEST_CASE("test fixed point conversions") {
+  static_assert(Temperature::centiCelsiusToCentiFahrenheit(0) == 3200);
+  static_assert(Temperature::centiCelsiusToCentiFahrenheit(10000) == 21200);
+  static_assert(Temperature::centiCelsiusToCentiFahrenheit(-4000) == -4000);
+  static_assert(Temperature::centiFahrenheitToCentiCelsius(3200) == 0);
+  static_assert(Temperature::centiFahrenheitToCentiCelsius(9860) == 3700);
+  static_assert(Temperature::centiFahrenheitToCentiCelsius(-4000) == -4000);
+  static_assert(Temperature::roundToStep(3756, 50) == 3750);
+  static_assert(Temperature::roundToStep(3775, 50) == 3800);
+  static_assert(Temperature::roundToStep(-3775, 50) == -3800);
+  static_assert(Temperature::roundToStep(3756, 0) == 3756);
+  static_assert(Temperature::fromCentiCelsius(2200).getCenti(Temperature::Unit::F, 100) == 7200);
+
+  CHECK(Temperature(21.5f, Temperature::Unit::C).getCentiCelsius() == 2150);
+  CHECK(Temperature(70.f, Temperature::Unit::F).getCentiCelsius() == 2111);
+  CHECK(Temperature(-12.345f, Temperature::Unit::C).getCentiCelsius() == -1235);
+  CHECK(Temperature(1000.f, Temperature::Unit::C).getCentiCelsius() == INT16_MAX);
+  CHECK(Temperature(1e30f, Temperature::Unit::C).getCentiCelsius() == INT16_MAX);
+  CHECK(Temperature(-1e30f, Temperature::Unit::C).getCentiCelsius() == INT16_MIN);
+  CHECK(Temperature(1e30f, Temperature::Unit::F).getCentiCelsius() == INT16_MAX);
+  CHECK(Temperature(-1e30f, Temperature::Unit::F).getCentiCelsius() == INT16_MIN);
+  CHECK(Temperature(NAN, Temperature::Unit::C).getCentiCelsius() == 0);
+  CHECK(Temperature(NAN, Temperature::Unit::F).getCentiCelsius() == -1778);
+
+  // Round-tripping a whole Fahrenheit setpoint through Celsius storage must not drift
+  for (int fahrenheit = 40; fahrenheit <= 100; fahrenheit++) {
+    const Temperature t(static_cast<float>(fahrenheit), Temperature::Unit::F);
+    CHECK(t.getCenti(Temperature::Unit::F, 100) == fahrenheit * 100);
+  }
+}
+
+TEST_CASE("test comparison and clamping") {
+  const auto min = Temperature(16.f, Temperature::Unit::C);
+  const auto max = Temperature(31.f, Temperature::Unit::C);
+
+  CHECK(Temperature(60.8f, Temperature::Unit::F) == min);
+  CHECK(Temperature(12.f, Temperature::Unit::C).clamp(min, max) == min);
+  CHECK(Temperature(40.f, Temperature::Unit::C).clamp(min, max) == max);
+  CHECK(Temperature(20.f, Temperature::Unit::C).clamp(min, max) != max);
+}
+
+TEST_CASE("test toChars") {
+  std::array<char, Temperature::maxChars> buffer;
+  Temperature t(-3.14159f, Temperature::Unit::C);
+
+  CHECK(t.toChars(buffer.data(), buffer.size(), Temperature::Unit::C, 0.0f) == 5);
+  CHECK(String(buffer.data()) == "-3.14");
+  CHECK(t.toChars(buffer.data(), buffer.size(), Temperature::Unit::C, 0.5f) == 4);
+  CHECK(String(buffer.data()) == "-3.0");
+  CHECK(t.toChars(buffer.data(), buffer.size(), Temperature::Unit::C, 0.25f) == 5);
+  CHECK(String(buffer.data()) == "-3.25");
+  CHECK(t.toChars(buffer.data(), buffer.size(), Temperature::Unit::F, 1.0f) == 2);
+  CHECK(String(buffer.data()) == "26");
+
+  const Temperature coldest = Temperature::fromCentiCelsius(INT16_MIN);
+  CHECK(coldest.toChars(buffer.data(), buffer.size(), Temperature::Unit::F, 0.0f) == 7);
+  CHECK(String(buffer.data()) == "-557.82");
+
+  // Too small a buffer writes nothing
+  buffer[0] = 'x';
+  CHECK(t.toChars(buffer.data(), 3, Temperature::Unit::C, 0.1f) == 0);
+  CHECK(buffer[0] == 'x');
+}
+
+// The previous floating point implementation, kept here as a baseline for the benchmark below
+static size_t floatToChars(char *buffer, size_t size, float celsius, Temperature::Unit unit,
+                           float tempStep) {
+  float value = unit == Temperature::Unit::C ? celsius : Temperature::celsiusToFahrenheit(celsius);
+  if (tempStep > 0.0f) {
+    value = std::round(value / tempStep) * tempStep;
+  }
+  const auto digits =
+      tempStep > 0.f ? static_cast<int>(std::ceil(std::log10(1.0f / tempStep))) : 6;
+  return snprintf(buffer, size, "%.*f", std::max(0, digits), value);
+}
+
+TEST_CASE("benchmark fixed point against floating point formatting") {
+  const int iterations = 200000;
+  const std::array<float, 3> steps{1.0f, 0.5f, 0.1f};
+  std::array<char, 16> buffer;
+  size_t checksum = 0;
+
+  // Both implementations must agree before comparing their speed
+  for (int tenths = 100; tenths < 400; tenths++) {
+    const float celsius = static_cast<float>(tenths) / 10.0f;
+    for (const auto step : steps) {
+      std::array<char, 16> expected;
+      floatToChars(expected.data(), expected.size(), celsius, Temperature::Unit::C, step);
+      Temperature(celsius, Temperature::Unit::C)
+          .toChars(buffer.data(), buffer.size(), Temperature::Unit::C, step);
+      CHECK(String(buffer.data()) == expected.data());
+    }
+  }
+
+  const auto floatStart = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    const float celsius = static_cast<float>(i % 400) / 10.0f;
+    checksum += floatToChars(buffer.data(), buffer.size(), celsius, Temperature::Unit::F,
+                             steps[i % steps.size()]);
+  }
+  const auto floatElapsed = std::chrono::steady_clock::now() - floatStart;
+
+  const auto fixedStart = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    checksum += Temperature::fromCentiCelsius((i % 400) * 10)
+                    .toChars(buffer.data(), buffer.size(), Temperature::Unit::F,
+                             steps[i % steps.size()]);
+  }
+  const auto fixedElapsed = std::chrono::steady_clock::now() - fixedStart;
+
+  using std::chrono::duration_cast;
+  using std::chrono::nanoseconds;
+  MESSAGE("float/snprintf: " << duration_cast<nanoseconds>(floatElapsed).count() / iterations
+                             << " ns per call");
+  MESSAGE("fixed/toChars:  " << duration_cast<nanoseconds>(fixedElapsed).count() / iterations
+                             << " ns per call");
+  CHECK(checksum > 0);
+}
+
 int main(int argc, char **argv) {
   doctest::Context context;
 